@@ -2,12 +2,125 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <bitset>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>               // GetProcessTimes, timeBeginPeriod, MapViewOfFile
+#pragma comment(lib, "winmm.lib")
+#else
+#include <fcntl.h>                 // level files are memory-mapped
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SIMD width for the batch math kernels: AVX (8), SSE2 (4) or scalar (1)
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
 #include <glut.h>
+#ifdef FREEGLUT
+#include <freeglut_ext.h>
+#endif
+
+// Offscreen (EGL pbuffer) rendering for the --offscreen benchmark.
+// Build with -DOFFSCREEN_EGL=0 where libEGL is not available.
+#ifndef OFFSCREEN_EGL
+#if defined(__linux__)
+#define OFFSCREEN_EGL 1
+#else
+#define OFFSCREEN_EGL 0
+#endif
+#endif
+
+#if OFFSCREEN_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+// GL 1.5-3.3 enums missing from older gl.h headers (e.g. Windows)
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER        0x8892
+#define GL_STATIC_DRAW         0x88E4
+#define GL_STREAM_DRAW         0x88E0
+#endif
+#ifndef GL_VERTEX_SHADER
+#define GL_FRAGMENT_SHADER     0x8B30
+#define GL_VERTEX_SHADER       0x8B31
+#define GL_COMPILE_STATUS      0x8B81
+#define GL_LINK_STATUS         0x8B82
+#define GL_INFO_LOG_LENGTH     0x8B84
+#endif
+#ifndef GL_UNIFORM_BUFFER
+#define GL_UNIFORM_BUFFER      0x8A11
+#define GL_INVALID_INDEX       0xFFFFFFFFu
+#endif
+#ifndef GL_TEXTURE_BUFFER
+#define GL_TEXTURE_BUFFER      0x8C2A
+#define GL_RGBA32F             0x8814
+#define GL_RG32UI              0x823C
+#define GL_R16UI               0x8234
+#endif
+#ifndef GL_TEXTURE0
+#define GL_TEXTURE0            0x84C0
+#endif
+#ifndef GL_POINT_SPRITE
+#define GL_POINT_SPRITE        0x8861
+#endif
+#ifndef GL_VERTEX_PROGRAM_POINT_SIZE
+#define GL_VERTEX_PROGRAM_POINT_SIZE 0x8642
+#endif
+#ifndef GL_SAMPLES_PASSED
+#define GL_SAMPLES_PASSED      0x8914
+#endif
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED        0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT        0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
 
 #define GLUT_KEY_ESCAPE 27
 #define DEG2RAD(a) (a * 0.0174532925f)
 #define RAD2DEG(a) (a * 57.2957795f)
 
+const float PI = 3.14159265f;
+
+// Initial window size and projection shared by rendering and culling
+const int   VIEWPORT_W = 640;
+const int   VIEWPORT_H = 480;
+const float CAMERA_FOVY = 60.0f;
+const float CAMERA_NEAR = 0.1f;
+const float CAMERA_FAR = 100.0f;
+
+// Current framebuffer size, kept up to date by Reshape()
+int viewportW = VIEWPORT_W;
+int viewportH = VIEWPORT_H;
+
 // =========================
 // Basic math & Camera (from Lab 6, extended)
 // =========================
@@ -22,29 +135,37 @@ public:
         z = _z;
     }
 
-    Vector3f operator+(Vector3f& v) {
+    Vector3f operator+(const Vector3f& v) const {
         return Vector3f(x + v.x, y + v.y, z + v.z);
     }
 
-    Vector3f operator-(Vector3f& v) {
+    Vector3f operator-(const Vector3f& v) const {
         return Vector3f(x - v.x, y - v.y, z - v.z);
     }
 
-    Vector3f operator*(float n) {
+    Vector3f operator*(float n) const {
         return Vector3f(x * n, y * n, z * n);
     }
 
-    Vector3f operator/(float n) {
+    Vector3f operator/(float n) const {
         return Vector3f(x / n, y / n, z / n);
     }
 
-    Vector3f unit() {
+    float dot(const Vector3f& v) const {
+        return x * v.x + y * v.y + z * v.z;
+    }
+
+    float lengthSquared() const {
+        return x * x + y * y + z * z;
+    }
+
+    Vector3f unit() const {
         float len = sqrtf(x * x + y * y + z * z);
         if (len == 0.0f) return Vector3f(0, 0, 0);
         return *this / len;
     }
 
-    Vector3f cross(Vector3f v) {
+    Vector3f cross(const Vector3f& v) const {
         return Vector3f(
             y * v.z - z * v.y,
             z * v.x - x * v.z,
@@ -53,6 +174,258 @@ public:
     }
 };
 
+// =========================
+// SIMD math
+// =========================
+
+// 16-byte aligned vectors for SIMD loads; Vec3 carries a pad lane
+struct alignas(16) Vec4 {
+    float x, y, z, w;
+
+    Vec4(float _x = 0.0f, float _y = 0.0f, float _z = 0.0f, float _w = 0.0f)
+        : x(_x), y(_y), z(_z), w(_w) {}
+};
+
+struct alignas(16) Vec3 {
+    float x, y, z, pad;
+
+    Vec3(float _x = 0.0f, float _y = 0.0f, float _z = 0.0f) : x(_x), y(_y), z(_z), pad(0.0f) {}
+    Vec3(const Vector3f& v) : x(v.x), y(v.y), z(v.z), pad(0.0f) {}
+
+    Vector3f toVector3f() const { return Vector3f(x, y, z); }
+};
+
+// Column-major 4x4 matrix, same layout as glLoadMatrixf
+struct alignas(16) Mat4 {
+    float m[16];
+
+    static Mat4 identity() {
+        Mat4 r;
+        for (int i = 0; i < 16; ++i) r.m[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+        return r;
+    }
+
+    static Mat4 translation(float x, float y, float z) {
+        Mat4 r = identity();
+        r.m[12] = x;
+        r.m[13] = y;
+        r.m[14] = z;
+        return r;
+    }
+
+    static Mat4 scale(float x, float y, float z) {
+        Mat4 r = identity();
+        r.m[0] = x;
+        r.m[5] = y;
+        r.m[10] = z;
+        return r;
+    }
+
+    // Same convention as glRotatef(degrees, 0, 1, 0) / (1, 0, 0)
+    static Mat4 rotationY(float degrees) {
+        float c = cosf(DEG2RAD(degrees)), s = sinf(DEG2RAD(degrees));
+        Mat4 r = identity();
+        r.m[0] = c;  r.m[8] = s;
+        r.m[2] = -s; r.m[10] = c;
+        return r;
+    }
+
+    static Mat4 rotationX(float degrees) {
+        float c = cosf(DEG2RAD(degrees)), s = sinf(DEG2RAD(degrees));
+        Mat4 r = identity();
+        r.m[5] = c; r.m[9] = -s;
+        r.m[6] = s; r.m[10] = c;
+        return r;
+    }
+
+    // Same matrix as gluLookAt
+    static Mat4 lookAt(const Vector3f& eye, const Vector3f& center, const Vector3f& up) {
+        Vector3f f = (center - eye).unit();
+        Vector3f s = f.cross(up).unit();
+        Vector3f u = s.cross(f);
+
+        Mat4 r = identity();
+        r.m[0] = s.x; r.m[4] = s.y; r.m[8] = s.z;
+        r.m[1] = u.x; r.m[5] = u.y; r.m[9] = u.z;
+        r.m[2] = -f.x; r.m[6] = -f.y; r.m[10] = -f.z;
+        r.m[12] = -s.dot(eye);
+        r.m[13] = -u.dot(eye);
+        r.m[14] = f.dot(eye);
+        return r;
+    }
+
+    Mat4 operator*(const Mat4& b) const {
+        Mat4 r;
+#if SIMD_WIDTH >= 4
+        __m128 c0 = _mm_load_ps(m), c1 = _mm_load_ps(m + 4);
+        __m128 c2 = _mm_load_ps(m + 8), c3 = _mm_load_ps(m + 12);
+        for (int col = 0; col < 4; ++col) {
+            const float* bc = b.m + col * 4;
+            __m128 v = _mm_mul_ps(c0, _mm_set1_ps(bc[0]));
+            v = _mm_add_ps(v, _mm_mul_ps(c1, _mm_set1_ps(bc[1])));
+            v = _mm_add_ps(v, _mm_mul_ps(c2, _mm_set1_ps(bc[2])));
+            v = _mm_add_ps(v, _mm_mul_ps(c3, _mm_set1_ps(bc[3])));
+            _mm_store_ps(r.m + col * 4, v);
+        }
+#else
+        for (int col = 0; col < 4; ++col) {
+            for (int row = 0; row < 4; ++row) {
+                r.m[col * 4 + row] = m[row] * b.m[col * 4] + m[4 + row] * b.m[col * 4 + 1] +
+                    m[8 + row] * b.m[col * 4 + 2] + m[12 + row] * b.m[col * 4 + 3];
+            }
+        }
+#endif
+        return r;
+    }
+
+    Vec4 operator*(const Vec4& v) const {
+        Vec4 r;
+#if SIMD_WIDTH >= 4
+        __m128 x = _mm_mul_ps(_mm_load_ps(m), _mm_set1_ps(v.x));
+        x = _mm_add_ps(x, _mm_mul_ps(_mm_load_ps(m + 4), _mm_set1_ps(v.y)));
+        x = _mm_add_ps(x, _mm_mul_ps(_mm_load_ps(m + 8), _mm_set1_ps(v.z)));
+        x = _mm_add_ps(x, _mm_mul_ps(_mm_load_ps(m + 12), _mm_set1_ps(v.w)));
+        _mm_store_ps(&r.x, x);
+#else
+        r.x = m[0] * v.x + m[4] * v.y + m[8] * v.z + m[12] * v.w;
+        r.y = m[1] * v.x + m[5] * v.y + m[9] * v.z + m[13] * v.w;
+        r.z = m[2] * v.x + m[6] * v.y + m[10] * v.z + m[14] * v.w;
+        r.w = m[3] * v.x + m[7] * v.y + m[11] * v.z + m[15] * v.w;
+#endif
+        return r;
+    }
+
+    Vector3f transformPoint(const Vector3f& p) const {
+        return Vector3f(
+            m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12],
+            m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13],
+            m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14]);
+    }
+};
+
+// Lane type for the batch kernels below. The kernels are written once
+// against these wrappers; unaligned loads so std::vector data works.
+#if SIMD_WIDTH == 8
+typedef __m256 simdf;
+inline simdf simdLoad(const float* p) { return _mm256_loadu_ps(p); }
+inline void  simdStore(float* p, simdf v) { _mm256_storeu_ps(p, v); }
+inline simdf simdSet(float f) { return _mm256_set1_ps(f); }
+inline simdf simdAdd(simdf a, simdf b) { return _mm256_add_ps(a, b); }
+inline simdf simdSub(simdf a, simdf b) { return _mm256_sub_ps(a, b); }
+inline simdf simdMul(simdf a, simdf b) { return _mm256_mul_ps(a, b); }
+inline simdf simdDiv(simdf a, simdf b) { return _mm256_div_ps(a, b); }
+inline simdf simdMax(simdf a, simdf b) { return _mm256_max_ps(a, b); }
+inline simdf simdSqrt(simdf a) { return _mm256_sqrt_ps(a); }
+#elif SIMD_WIDTH == 4
+typedef __m128 simdf;
+inline simdf simdLoad(const float* p) { return _mm_loadu_ps(p); }
+inline void  simdStore(float* p, simdf v) { _mm_storeu_ps(p, v); }
+inline simdf simdSet(float f) { return _mm_set1_ps(f); }
+inline simdf simdAdd(simdf a, simdf b) { return _mm_add_ps(a, b); }
+inline simdf simdSub(simdf a, simdf b) { return _mm_sub_ps(a, b); }
+inline simdf simdMul(simdf a, simdf b) { return _mm_mul_ps(a, b); }
+inline simdf simdDiv(simdf a, simdf b) { return _mm_div_ps(a, b); }
+inline simdf simdMax(simdf a, simdf b) { return _mm_max_ps(a, b); }
+inline simdf simdSqrt(simdf a) { return _mm_sqrt_ps(a); }
+#else
+typedef float simdf;
+inline simdf simdLoad(const float* p) { return *p; }
+inline void  simdStore(float* p, simdf v) { *p = v; }
+inline simdf simdSet(float f) { return f; }
+inline simdf simdAdd(simdf a, simdf b) { return a + b; }
+inline simdf simdSub(simdf a, simdf b) { return a - b; }
+inline simdf simdMul(simdf a, simdf b) { return a * b; }
+inline simdf simdDiv(simdf a, simdf b) { return a / b; }
+inline simdf simdMax(simdf a, simdf b) { return a > b ? a : b; }
+inline simdf simdSqrt(simdf a) { return sqrtf(a); }
+#endif
+
+// Batch kernels over structure-of-arrays data (x[], y[], z[]). Each runs
+// SIMD_WIDTH lanes at a time with a scalar tail; outputs may alias inputs.
+
+// Normalize in place; zero vectors stay zero like Vector3f::unit()
+void normalizeBatch(float* x, float* y, float* z, int n) {
+    int i = 0;
+    const simdf tiny = simdSet(1e-30f), one = simdSet(1.0f);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        simdf vx = simdLoad(x + i), vy = simdLoad(y + i), vz = simdLoad(z + i);
+        simdf len2 = simdAdd(simdAdd(simdMul(vx, vx), simdMul(vy, vy)), simdMul(vz, vz));
+        simdf inv = simdDiv(one, simdMax(simdSqrt(len2), tiny));
+        simdStore(x + i, simdMul(vx, inv));
+        simdStore(y + i, simdMul(vy, inv));
+        simdStore(z + i, simdMul(vz, inv));
+    }
+    for (; i < n; ++i) {
+        float len = sqrtf(x[i] * x[i] + y[i] * y[i] + z[i] * z[i]);
+        float inv = 1.0f / (len > 1e-30f ? len : 1e-30f);
+        x[i] *= inv;
+        y[i] *= inv;
+        z[i] *= inv;
+    }
+}
+
+// out = a x b
+void crossBatch(const float* ax, const float* ay, const float* az,
+    const float* bx, const float* by, const float* bz,
+    float* ox, float* oy, float* oz, int n) {
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        simdf vax = simdLoad(ax + i), vay = simdLoad(ay + i), vaz = simdLoad(az + i);
+        simdf vbx = simdLoad(bx + i), vby = simdLoad(by + i), vbz = simdLoad(bz + i);
+        simdStore(ox + i, simdSub(simdMul(vay, vbz), simdMul(vaz, vby)));
+        simdStore(oy + i, simdSub(simdMul(vaz, vbx), simdMul(vax, vbz)));
+        simdStore(oz + i, simdSub(simdMul(vax, vby), simdMul(vay, vbx)));
+    }
+    for (; i < n; ++i) {
+        float cx = ay[i] * bz[i] - az[i] * by[i];
+        float cy = az[i] * bx[i] - ax[i] * bz[i];
+        float cz = ax[i] * by[i] - ay[i] * bx[i];
+        ox[i] = cx;
+        oy[i] = cy;
+        oz[i] = cz;
+    }
+}
+
+// out[i] = squared distance from point i to p
+void distanceSqBatch(const float* x, const float* y, const float* z,
+    const Vec3& p, float* out, int n) {
+    int i = 0;
+    const simdf px = simdSet(p.x), py = simdSet(p.y), pz = simdSet(p.z);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        simdf dx = simdSub(simdLoad(x + i), px);
+        simdf dy = simdSub(simdLoad(y + i), py);
+        simdf dz = simdSub(simdLoad(z + i), pz);
+        simdStore(out + i, simdAdd(simdAdd(simdMul(dx, dx), simdMul(dy, dy)), simdMul(dz, dz)));
+    }
+    for (; i < n; ++i) {
+        float dx = x[i] - p.x, dy = y[i] - p.y, dz = z[i] - p.z;
+        out[i] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+// out = M * (x, y, z, 1), affine part only
+void transformPointsBatch(const Mat4& mat, const float* x, const float* y, const float* z,
+    float* ox, float* oy, float* oz, int n) {
+    const float* m = mat.m;
+    int i = 0;
+    const simdf m0 = simdSet(m[0]), m1 = simdSet(m[1]), m2 = simdSet(m[2]);
+    const simdf m4 = simdSet(m[4]), m5 = simdSet(m[5]), m6 = simdSet(m[6]);
+    const simdf m8 = simdSet(m[8]), m9 = simdSet(m[9]), m10 = simdSet(m[10]);
+    const simdf m12 = simdSet(m[12]), m13 = simdSet(m[13]), m14 = simdSet(m[14]);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        simdf vx = simdLoad(x + i), vy = simdLoad(y + i), vz = simdLoad(z + i);
+        simdStore(ox + i, simdAdd(simdAdd(simdMul(m0, vx), simdMul(m4, vy)), simdAdd(simdMul(m8, vz), m12)));
+        simdStore(oy + i, simdAdd(simdAdd(simdMul(m1, vx), simdMul(m5, vy)), simdAdd(simdMul(m9, vz), m13)));
+        simdStore(oz + i, simdAdd(simdAdd(simdMul(m2, vx), simdMul(m6, vy)), simdAdd(simdMul(m10, vz), m14)));
+    }
+    for (; i < n; ++i) {
+        float px = x[i], py = y[i], pz = z[i];
+        ox[i] = m[0] * px + m[4] * py + m[8] * pz + m[12];
+        oy[i] = m[1] * px + m[5] * py + m[9] * pz + m[13];
+        oz[i] = m[2] * px + m[6] * py + m[10] * pz + m[14];
+    }
+}
+
 class Camera {
 public:
     Vector3f eye, center, up;
@@ -84,21 +457,26 @@ public:
     }
 
     void rotateX(float a) {
+        float c = cosf(DEG2RAD(a)), s = sinf(DEG2RAD(a));
         Vector3f view = (center - eye).unit();
         Vector3f right = up.cross(view).unit();
-        view = view * cosf(DEG2RAD(a)) + up * sinf(DEG2RAD(a));
+        view = view * c + up * s;
         up = view.cross(right);
         center = eye + view;
     }
 
     void rotateY(float a) {
+        float c = cosf(DEG2RAD(a)), s = sinf(DEG2RAD(a));
         Vector3f view = (center - eye).unit();
         Vector3f right = up.cross(view).unit();
-        view = view * cosf(DEG2RAD(a)) + right * sinf(DEG2RAD(a));
-        right = view.cross(up);
+        view = view * c + right * s;
         center = eye + view;
     }
 
+    Mat4 viewMatrix() const {
+        return Mat4::lookAt(eye, center, up);
+    }
+
     void look() {
         gluLookAt(
             eye.x, eye.y, eye.z,
@@ -122,14 +500,14 @@ enum GameState {
 
 GameState gameState = GAME_PLAYING;
 
-// World bounds (underwater base perimeter)
-const float WORLD_HALF_SIZE = 5.0f;   // walls at ±5 on x and z
+// World bounds (underwater base perimeter), set by the level
+float worldHalfSize = 5.0f;   // walls at ±worldHalfSize on x and z
 const float GROUND_Y = 0.0f;   // seafloor
-const float MAX_HEIGHT = 3.0f;   // max swim height above seafloor
+float maxHeight = 3.0f;   // max swim height above seafloor
 
 // Oxygen timer
 float oxygenTime = 60.0f; // 60 seconds of O2
-int   lastTimeMs = 0;
+double lastFrameTime = 0.0;   // nowSeconds() at the previous Update()
 
 // Wall color animation (pulsing underwater lights)
 float wallColorPhase = 0.0f;
@@ -144,6 +522,12 @@ struct Player {
     float rotY;        // yaw: face direction of movement
     float rotX;        // tilt forward when swimming
     bool  onGround;
+    Mat4  world;       // rebuilt by updateDiverWorld() when the diver moves
+
+    // Particle emitters, counted up and never reset: the renderer spawns
+    // from the change since the snapshot it last saw
+    unsigned int bubbleEvents;   // moves that changed pos.y
+    unsigned int siltEvents;     // moves along the floor, more for a landing
 };
 
 Player diver;
@@ -162,802 +546,7304 @@ struct Goal {
 Goal oxygenCore;
 
 // =========================
-// Environment objects (5)
+// Environment objects (SoA store)
 // =========================
 
-struct EnvObject {
-    Vector3f pos;
-    float    animParam;    // angle/offset
-    bool     animRunning;
-    int      type;         // which model
+enum EnvType {
+    ENV_TOWER,      // floodlight tower (major)
+    ENV_SONAR,      // sonar array (major)
+    ENV_CRATES,     // supply crates (regular)
+    ENV_DRONE,      // repair drone (regular)
+    ENV_TANKS,      // oxygen tanks (regular)
+    NUM_ENV_TYPES
 };
 
-const int NUM_ENV_OBJECTS = 5;
-EnvObject envObjects[NUM_ENV_OBJECTS];
-
-// =========================
-// Utilities
-// =========================
+// One contiguous array per field so batch loops touch only what they need.
+// Objects are addressed by index; removal swaps the last object into the
+// hole, so indices are stable only until the next remove.
+struct EnvObjectStore {
+    std::vector<float> posX, posY, posZ;
+    std::vector<float> animParam;   // angle/offset
+    std::vector<float> running;     // 1.0f while animating, 0.0f when paused
+    std::vector<int>   type;        // EnvType
+    std::vector<Mat4>  world;       // placement, see updateWorldMatrices()
+    std::vector<unsigned char> worldDirty;  // world needs rebuilding even if paused
+    int count;
+    unsigned int version;           // bumped whenever objects are added/removed
+    unsigned int staticVersion;     // bumped whenever an object starts/stops animating
+};
 
-float clampf(float v, float minv, float maxv) {
-    if (v < minv) return minv;
-    if (v > maxv) return maxv;
-    return v;
+EnvObjectStore envStore;
+
+// Objects resetGame() scatters in beyond the level's own, up to this count (--objects N)
+int envObjectTarget = 0;
+
+int addEnvObject(const Vector3f& pos, int type) {
+    envStore.posX.push_back(pos.x);
+    envStore.posY.push_back(pos.y);
+    envStore.posZ.push_back(pos.z);
+    envStore.animParam.push_back(0.0f);
+    envStore.running.push_back(0.0f);
+    envStore.type.push_back(type);
+    envStore.world.push_back(Mat4::identity());
+    envStore.worldDirty.push_back(1);
+    ++envStore.version;
+    return envStore.count++;
 }
 
-float distSquared(const Vector3f& a, const Vector3f& b) {
-    float dx = a.x - b.x;
-    float dy = a.y - b.y;
-    float dz = a.z - b.z;
-    return dx * dx + dy * dy + dz * dz;
+void removeEnvObject(int index) {
+    if (index < 0 || index >= envStore.count) return;
+
+    int last = envStore.count - 1;
+    envStore.posX[index] = envStore.posX[last];
+    envStore.posY[index] = envStore.posY[last];
+    envStore.posZ[index] = envStore.posZ[last];
+    envStore.animParam[index] = envStore.animParam[last];
+    envStore.running[index] = envStore.running[last];
+    envStore.type[index] = envStore.type[last];
+    envStore.world[index] = envStore.world[last];
+    envStore.worldDirty[index] = envStore.worldDirty[last];
+
+    envStore.posX.pop_back();
+    envStore.posY.pop_back();
+    envStore.posZ.pop_back();
+    envStore.animParam.pop_back();
+    envStore.running.pop_back();
+    envStore.type.pop_back();
+    envStore.world.pop_back();
+    envStore.worldDirty.pop_back();
+    envStore.count = last;
+    ++envStore.version;
 }
 
-// =========================
-// Drawing helpers
-// =========================
+void clearEnvObjects() {
+    envStore.posX.clear();
+    envStore.posY.clear();
+    envStore.posZ.clear();
+    envStore.animParam.clear();
+    envStore.running.clear();
+    envStore.type.clear();
+    envStore.world.clear();
+    envStore.worldDirty.clear();
+    envStore.count = 0;
+    ++envStore.version;
+}
 
-void setupLights() {
-    // Soft bluish ambient light to feel underwater
-    GLfloat ambient[] = { 0.1f, 0.15f, 0.25f, 1.0f };
-    GLfloat diffuse[] = { 0.4f, 0.5f, 0.8f, 1.0f };
-    GLfloat specular[] = { 0.8f, 0.9f, 1.0f, 1.0f };
-    GLfloat shininess[] = { 50.0f };
+// Replace every object at once: one bulk copy per field, all paused
+void assignEnvObjects(int n, const float* x, const float* y, const float* z, const int32_t* type) {
+    envStore.posX.assign(x, x + n);
+    envStore.posY.assign(y, y + n);
+    envStore.posZ.assign(z, z + n);
+    envStore.type.assign(type, type + n);
+    envStore.animParam.assign(n, 0.0f);
+    envStore.running.assign(n, 0.0f);
+    envStore.world.assign(n, Mat4::identity());
+    envStore.worldDirty.assign(n, 1);
+    envStore.count = n;
+    ++envStore.version;
+}
 
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specular);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
+bool isEnvAnimating(int index) {
+    return envStore.running[index] != 0.0f;
+}
 
-    GLfloat lightIntensity[] = { 0.6f, 0.7f, 1.0f, 1.0f };
-    GLfloat lightPosition[] = { 0.0f, 5.0f, 0.0f, 1.0f }; // overhead
-    glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, lightIntensity);
+void setEnvAnimating(int index, bool on) {
+    if (isEnvAnimating(index) != on) ++envStore.staticVersion;
+    envStore.running[index] = on ? 1.0f : 0.0f;
 }
 
-void setupCamera() {
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(60.0, 640.0 / 480.0, 0.1, 100.0);
+void toggleEnvAnimation(int index) {
+    if (index < envStore.count) setEnvAnimating(index, !isEnvAnimating(index));
+}
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    camera.look();
+void setAllEnvAnimations(bool on) {
+    for (int i = 0; i < envStore.count; ++i) setEnvAnimating(i, on);
 }
 
-// Seafloor
-void drawFloor() {
-    glPushMatrix();
-    glColor3f(0.1f, 0.2f, 0.25f); // dark sand/rocky floor
-    glTranslatef(0.0f, GROUND_Y - 0.01f, 0.0f);
-    glScalef(WORLD_HALF_SIZE * 2.0f, 0.02f, WORLD_HALF_SIZE * 2.0f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// Branch-free batch update: paused objects advance by step * 0. Written
+// against the simd wrappers so it is vectorized whatever the compiler's
+// auto-vectorizer does at -O2.
+void updateEnvAnimationRange(float dt, int begin, int end) {
+    float step = 60.0f * dt;
+    float* anim = envStore.animParam.data();
+    const float* run = envStore.running.data();
+
+    int i = begin;
+    const simdf vstep = simdSet(step);
+    for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH) {
+        simdStore(anim + i, simdAdd(simdLoad(anim + i), simdMul(vstep, simdLoad(run + i))));
+    }
+    for (; i < end; ++i) {
+        anim[i] += step * run[i];
+    }
 }
 
-// Boundary walls with animated lights (glowing perimeter of base)
-void drawWalls() {
-    float r = 0.2f + 0.2f * sinf(wallColorPhase);
-    float g = 0.4f + 0.3f * sinf(wallColorPhase + 2.0f);
-    float b = 0.7f + 0.3f * sinf(wallColorPhase + 4.0f);
+void updateEnvAnimations(float dt) {
+    updateEnvAnimationRange(dt, 0, envStore.count);
+}
 
-    glColor3f(r, g, b);
+// =========================
+// Levels
+// =========================
+// A level is the base's bounds, the diver spawn, the oxygen core and any
+// number of objects. Levels are written as text and compiled with
+// --compile-level into a binary file whose object arrays have the same
+// layout as EnvObjectStore's fields. Loading one is an mmap and a header
+// check: the level points straight into the mapping, which stays open as
+// its storage, and resetGame() fills the store from it with one bulk copy
+// per field. The store itself keeps its own arrays because the game adds,
+// removes and animates objects.
+//
+// Text form, one directive per line, '#' starts a comment:
+//   world <half size> <max height>
+//   oxygen <seconds>
+//   spawn <x> <y> <z>
+//   goal <x> <y> <z>
+//   object <tower|sonar|crates|drone|tanks> <x> <y> <z>
+//   scatter <count> <seed>      random objects inside the walls
+
+const char LEVEL_MAGIC[4] = { 'U', 'W', 'L', 'V' };
+const uint32_t LEVEL_VERSION = 1;
+
+const char* const ENV_TYPE_NAMES[NUM_ENV_TYPES] = { "tower", "sonar", "crates", "drone", "tanks" };
+
+// Binary layout, native byte order: this header, then numObjects floats
+// each of posX, posY and posZ, then numObjects int32 types
+struct LevelHeader {
+    char     magic[4];
+    uint32_t version;
+    float    worldHalfSize;
+    float    maxHeight;
+    float    spawn[3];
+    float    goal[3];
+    float    oxygenSeconds;
+    uint32_t numObjects;
+};
 
-    float thickness = 0.2f;
-    float height = 2.5f;
+// Editable form, built by the text parser and by the built-in level
+struct LevelSource {
+    LevelHeader header;
+    std::vector<float> posX, posY, posZ;
+    std::vector<int32_t> type;
+};
 
-    // +Z wall
-    glPushMatrix();
-    glTranslatef(0.0f, height / 2.0f, WORLD_HALF_SIZE);
-    glScalef(WORLD_HALF_SIZE * 2.0f, height, thickness);
-    glutSolidCube(1.0);
-    glPopMatrix();
+struct MappedFile {
+    const unsigned char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+};
 
-    // -Z wall
-    glPushMatrix();
-    glTranslatef(0.0f, height / 2.0f, -WORLD_HALF_SIZE);
-    glScalef(WORLD_HALF_SIZE * 2.0f, height, thickness);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// What resetGame() builds from; the arrays point into `file` or `source`
+struct Level {
+    LevelHeader header;
+    const float*   posX;
+    const float*   posY;
+    const float*   posZ;
+    const int32_t* type;
+    MappedFile  file;
+    LevelSource source;
+};
 
-    // +X wall
-    glPushMatrix();
-    glTranslatef(WORLD_HALF_SIZE, height / 2.0f, 0.0f);
-    glScalef(thickness, height, WORLD_HALF_SIZE * 2.0f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+Level level;
 
-    // -X wall
-    glPushMatrix();
-    glTranslatef(-WORLD_HALF_SIZE, height / 2.0f, 0.0f);
-    glScalef(thickness, height, WORLD_HALF_SIZE * 2.0f);
-    glutSolidCube(1.0);
-    glPopMatrix();
-}
+// Read-only view of a whole file; false (and nothing mapped) on failure
+bool mapFile(const char* path, MappedFile& f) {
+    f.data = NULL;
+    f.size = 0;
+#ifdef _WIN32
+    f.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f.file == INVALID_HANDLE_VALUE) return false;
 
-// Diver model: ≥6 primitives
-void drawDiver() {
-    glPushMatrix();
-    glTranslatef(diver.pos.x, diver.pos.y, diver.pos.z);
-    glRotatef(diver.rotY, 0, 1, 0);
-    glRotatef(diver.rotX, 1, 0, 0);
+    LARGE_INTEGER size;
+    f.mapping = NULL;
+    if (GetFileSizeEx(f.file, &size) && size.QuadPart > 0) {
+        f.mapping = CreateFileMappingA(f.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (f.mapping) f.data = (const unsigned char*)MapViewOfFile(f.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!f.data) {
+        if (f.mapping) CloseHandle(f.mapping);
+        CloseHandle(f.file);
+        return false;
+    }
+    f.size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);   // the mapping keeps the file
+    if (p == MAP_FAILED) return false;
 
-    // Suit torso
-    glPushMatrix();
-    glColor3f(0.15f, 0.4f, 0.8f);
-    glTranslatef(0.0f, 0.5f, 0.0f);
-    glScalef(0.4f, 0.6f, 0.25f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+    f.data = (const unsigned char*)p;
+    f.size = (size_t)st.st_size;
+#endif
+    return true;
+}
 
-    // Helmet (head)
-    glPushMatrix();
-    glColor3f(0.8f, 0.9f, 1.0f);
-    glTranslatef(0.0f, 0.95f, 0.05f);
-    glutSolidSphere(0.18, 20, 20);
-    glPopMatrix();
+void unmapFile(MappedFile& f) {
+    if (!f.data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(f.data);
+    CloseHandle(f.mapping);
+    CloseHandle(f.file);
+#else
+    munmap((void*)f.data, f.size);
+#endif
+    f.data = NULL;
+    f.size = 0;
+}
 
-    // Left arm
-    glPushMatrix();
-    glColor3f(0.15f, 0.4f, 0.8f);
-    glTranslatef(-0.3f, 0.5f, 0.0f);
-    glScalef(0.15f, 0.5f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+void initLevelHeader(LevelHeader& h) {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LEVEL_MAGIC, sizeof(h.magic));
+    h.version = LEVEL_VERSION;
+    h.worldHalfSize = 5.0f;
+    h.maxHeight = 3.0f;
+    h.oxygenSeconds = 60.0f;
+}
 
-    // Right arm
-    glPushMatrix();
-    glColor3f(0.15f, 0.4f, 0.8f);
-    glTranslatef(0.3f, 0.5f, 0.0f);
-    glScalef(0.15f, 0.5f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+void addLevelObject(LevelSource& src, int type, float x, float y, float z) {
+    src.posX.push_back(x);
+    src.posY.push_back(y);
+    src.posZ.push_back(z);
+    src.type.push_back(type);
+    src.header.numObjects = (uint32_t)src.type.size();
+}
 
-    // Left leg
-    glPushMatrix();
-    glColor3f(0.05f, 0.2f, 0.5f);
-    glTranslatef(-0.12f, 0.15f, 0.0f);
-    glScalef(0.15f, 0.5f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// Same scatter as --objects: an LCG over the floor inside the walls
+void scatterLevelObjects(LevelSource& src, int count, unsigned int seed) {
+    float extent = src.header.worldHalfSize - 0.5f;
+    for (int i = 0; i < count; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        float x = ((seed >> 8) & 0xFFFF) / 65535.0f;
+        seed = seed * 1664525u + 1013904223u;
+        float z = ((seed >> 8) & 0xFFFF) / 65535.0f;
+        addLevelObject(src, (int)src.type.size() % NUM_ENV_TYPES,
+            (x * 2.0f - 1.0f) * extent, 0.0f, (z * 2.0f - 1.0f) * extent);
+    }
+}
 
-    // Right leg
-    glPushMatrix();
-    glColor3f(0.05f, 0.2f, 0.5f);
-    glTranslatef(0.12f, 0.15f, 0.0f);
-    glScalef(0.15f, 0.5f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// The base the game always had
+void builtinLevel(LevelSource& src) {
+    initLevelHeader(src.header);
+    src.header.spawn[1] = GROUND_Y;
+    src.header.goal[0] = 2.0f;
+    src.header.goal[1] = 0.6f;
+    src.header.goal[2] = 2.0f;
+
+    src.posX.clear();
+    src.posY.clear();
+    src.posZ.clear();
+    src.type.clear();
+    addLevelObject(src, ENV_TOWER, -3.0f, 0.0f, -2.0f);
+    addLevelObject(src, ENV_SONAR, 3.0f, 0.0f, -3.0f);
+    addLevelObject(src, ENV_CRATES, -2.0f, 0.0f, 3.0f);
+    addLevelObject(src, ENV_DRONE, 2.5f, 0.2f, 0.0f);
+    addLevelObject(src, ENV_TANKS, 0.0f, 0.0f, -3.0f);
+}
 
-    glPopMatrix();
+// Header values the game cannot start a round with; the text parser
+// checks the same limits directive by directive
+bool levelHeaderValid(const LevelHeader& h) {
+    return h.worldHalfSize > 0.5f && h.maxHeight > GROUND_Y && h.oxygenSeconds > 0.0f;
 }
 
-// Oxygen core goal: ≥3 primitives, continuous animation
-void drawOxygenCore() {
-    if (oxygenCore.collected) return;
+bool parseLevelText(const char* path, LevelSource& src) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Cannot open level %s\n", path);
+        return false;
+    }
 
-    glPushMatrix();
-    glTranslatef(oxygenCore.pos.x, oxygenCore.pos.y, oxygenCore.pos.z);
-    glRotatef(oxygenCore.spinAngle, 0, 1, 0);
+    builtinLevel(src);
+    src.posX.clear();
+    src.posY.clear();
+    src.posZ.clear();
+    src.type.clear();
+    src.header.numObjects = 0;
+
+    LevelHeader& h = src.header;
+    char line[256], word[32], name[32];
+    int lineNo = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        ++lineNo;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        if (sscanf(line, "%31s", word) != 1) continue;
+
+        float x, y, z;
+        int count;
+        unsigned int seed;
+        if (strcmp(word, "world") == 0) {
+            ok = sscanf(line, "%*s %f %f", &h.worldHalfSize, &h.maxHeight) == 2 &&
+                h.worldHalfSize > 0.5f && h.maxHeight > GROUND_Y;
+        }
+        else if (strcmp(word, "oxygen") == 0) {
+            ok = sscanf(line, "%*s %f", &h.oxygenSeconds) == 1 && h.oxygenSeconds > 0.0f;
+        }
+        else if (strcmp(word, "spawn") == 0) {
+            ok = sscanf(line, "%*s %f %f %f", &h.spawn[0], &h.spawn[1], &h.spawn[2]) == 3;
+        }
+        else if (strcmp(word, "goal") == 0) {
+            ok = sscanf(line, "%*s %f %f %f", &h.goal[0], &h.goal[1], &h.goal[2]) == 3;
+        }
+        else if (strcmp(word, "object") == 0) {
+            ok = sscanf(line, "%*s %31s %f %f %f", name, &x, &y, &z) == 4;
+            int type = 0;
+            while (ok && type < NUM_ENV_TYPES && strcmp(name, ENV_TYPE_NAMES[type]) != 0) ++type;
+            ok = ok && type < NUM_ENV_TYPES;
+            if (ok) addLevelObject(src, type, x, y, z);
+        }
+        else if (strcmp(word, "scatter") == 0) {
+            ok = sscanf(line, "%*s %d %u", &count, &seed) == 2 && count >= 0;
+            if (ok) scatterLevelObjects(src, count, seed);
+        }
+        else {
+            ok = false;
+        }
+    }
+    fclose(f);
 
-    // Glowing center
-    glPushMatrix();
-    glColor3f(0.1f, 1.0f, 0.9f);
-    glutSolidSphere(0.25, 20, 20);
-    glPopMatrix();
+    if (!ok) printf("%s:%d: cannot read \"%s\"\n", path, lineNo, word);
+    return ok;
+}
 
-    // Ring 1
-    glPushMatrix();
-    glColor3f(0.2f, 0.8f, 0.9f);
-    glRotatef(90, 1, 0, 0);
-    glutSolidTorus(0.02, 0.35, 20, 20);
-    glPopMatrix();
+bool writeLevel(const char* path, const LevelSource& src) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        printf("Cannot write level %s\n", path);
+        return false;
+    }
 
-    // Ring 2
-    glPushMatrix();
-    glColor3f(0.2f, 0.8f, 0.9f);
-    glRotatef(90, 0, 0, 1);
-    glutSolidTorus(0.02, 0.35, 20, 20);
-    glPopMatrix();
+    size_t n = src.header.numObjects;
+    bool ok = fwrite(&src.header, sizeof(src.header), 1, f) == 1;
+    if (n > 0) {
+        ok = ok && fwrite(&src.posX[0], sizeof(float), n, f) == n;
+        ok = ok && fwrite(&src.posY[0], sizeof(float), n, f) == n;
+        ok = ok && fwrite(&src.posZ[0], sizeof(float), n, f) == n;
+        ok = ok && fwrite(&src.type[0], sizeof(int32_t), n, f) == n;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) printf("Cannot write level %s\n", path);
+    return ok;
+}
 
-    glPopMatrix();
+// Make `h` the current level's setup; the arrays are set by the caller
+void useLevelHeader(const LevelHeader& h) {
+    level.header = h;
+    worldHalfSize = h.worldHalfSize;
+    maxHeight = h.maxHeight;
 }
 
-// Major object A: Floodlight tower (≥5 primitives)
-void drawFloodlightTower() {
-    // Base platform
-    glPushMatrix();
-    glColor3f(0.2f, 0.6f, 0.7f);
-    glScalef(0.7f, 0.1f, 0.7f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+void useLevelSource() {
+    LevelSource& src = level.source;
+    useLevelHeader(src.header);
+    bool empty = src.header.numObjects == 0;
+    level.posX = empty ? NULL : &src.posX[0];
+    level.posY = empty ? NULL : &src.posY[0];
+    level.posZ = empty ? NULL : &src.posZ[0];
+    level.type = empty ? NULL : &src.type[0];
+}
 
-    // Vertical pole
-    glPushMatrix();
-    glColor3f(0.15f, 0.4f, 0.5f);
-    glTranslatef(0.0f, 0.7f, 0.0f);
-    glScalef(0.15f, 1.4f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// Binary levels are mapped; anything else is read as the text form.
+// Load before the GL resources: the floor and walls are built to size.
+bool loadLevel(const char* path) {
+    MappedFile f;
+    if (!mapFile(path, f)) {
+        printf("Cannot open level %s\n", path);
+        return false;
+    }
 
-    // Light arm
-    glPushMatrix();
-    glColor3f(0.3f, 0.7f, 0.9f);
-    glTranslatef(0.0f, 1.2f, 0.2f);
-    glScalef(0.8f, 0.1f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+    if (f.size < sizeof(LevelHeader) || memcmp(f.data, LEVEL_MAGIC, sizeof(LEVEL_MAGIC)) != 0) {
+        unmapFile(f);
+        LevelSource src;
+        if (!parseLevelText(path, src)) return false;
+        unmapFile(level.file);
+        std::swap(level.source, src);
+        useLevelSource();
+        return true;
+    }
 
-    // Light head 1
-    glPushMatrix();
-    glColor3f(0.9f, 0.95f, 1.0f);
-    glTranslatef(-0.25f, 1.2f, 0.35f);
-    glutSolidSphere(0.09, 16, 16);
-    glPopMatrix();
+    // The mapping is page aligned and the header a multiple of 4 bytes,
+    // so the arrays can be used in place
+    const LevelHeader* h = (const LevelHeader*)f.data;
+    size_t n = h->numObjects;
+    bool ok = h->version == LEVEL_VERSION && levelHeaderValid(*h) &&
+        n <= (f.size - sizeof(LevelHeader)) / (3 * sizeof(float) + sizeof(int32_t));
+    const float* arrays = (const float*)(f.data + sizeof(LevelHeader));
+    const int32_t* types = (const int32_t*)(arrays + 3 * n);
+    for (size_t i = 0; ok && i < n; ++i) ok = types[i] >= 0 && types[i] < NUM_ENV_TYPES;
+    if (!ok) {
+        printf("Level %s is not a version %u level or is damaged\n", path, LEVEL_VERSION);
+        unmapFile(f);
+        return false;
+    }
 
-    // Light head 2
-    glPushMatrix();
-    glColor3f(0.9f, 0.95f, 1.0f);
-    glTranslatef(0.25f, 1.2f, 0.35f);
-    glutSolidSphere(0.09, 16, 16);
-    glPopMatrix();
+    unmapFile(level.file);
+    level.file = f;
+    useLevelHeader(*h);
+    level.posX = arrays;
+    level.posY = arrays + n;
+    level.posZ = arrays + 2 * n;
+    level.type = types;
+    return true;
 }
 
-// Major object B: Sonar / comms array (≥5 primitives)
-void drawSonarArray() {
-    // Mast
-    glPushMatrix();
-    glColor3f(0.4f, 0.4f, 0.5f);
-    glTranslatef(0.0f, 0.6f, 0.0f);
-    glScalef(0.15f, 1.2f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+void initLevel() {
+    builtinLevel(level.source);
+    useLevelSource();
+}
 
-    // Horizontal boom
-    glPushMatrix();
-    glColor3f(0.2f, 0.3f, 0.4f);
-    glTranslatef(0.0f, 1.1f, 0.0f);
-    glScalef(1.4f, 0.08f, 0.15f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// =========================
+// Fixed-step simulation
+// =========================
 
-    // Dish 1
-    glPushMatrix();
-    glColor3f(0.1f, 0.5f, 0.8f);
-    glTranslatef(-0.55f, 1.1f, 0.0f);
-    glScalef(0.6f, 0.2f, 0.4f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// The simulation advances in fixed SIM_DT ticks from an accumulator, so
+// game logic does not depend on how fast frames are drawn. Rendering sits
+// between the previous and the latest tick (simClock.alpha) and
+// interpolates the diver position, core spin and env animParam.
+
+const float SIM_DT = 1.0f / 120.0f;
+const float MAX_FRAME_DT = 0.25f;   // longer hitches are dropped, not replayed
+
+struct SimClock {
+    double accumulator;
+    float  alpha;            // 0 = previous tick, 1 = latest tick
+    int    ticksThisFrame;
+    long   totalTicks;
+    double lastTickTime;     // nowSeconds() after the latest tick
+    long   inputApplied;     // input events consumed so far, plus ticks moved by held keys
+    double lastInputTime;    // when the newest applied key press was reported
+};
 
-    // Dish 2
-    glPushMatrix();
-    glColor3f(0.1f, 0.5f, 0.8f);
-    glTranslatef(0.55f, 1.1f, 0.0f);
-    glScalef(0.6f, 0.2f, 0.4f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+SimClock simClock;
 
-    // Control module
-    glPushMatrix();
-    glColor3f(0.5f, 0.6f, 0.7f);
-    glTranslatef(0.0f, 0.3f, 0.0f);
-    glScalef(0.5f, 0.25f, 0.5f);
-    glutSolidCube(1.0);
-    glPopMatrix();
-}
+// State at the start of the latest tick
+struct PrevSimState {
+    Vector3f diverPos;
+    float    spinAngle;
+    std::vector<float> animParam;   // grows only
+    unsigned int version;           // envStore.version the copy belongs to
+};
 
-// Regular object A: Supply crate cluster (≥3 primitives)
-void drawSupplyCrates() {
-    // Main crate
-    glPushMatrix();
-    glColor3f(0.45f, 0.3f, 0.2f);
-    glScalef(0.5f, 0.4f, 0.5f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+PrevSimState prevSim;
+
+void savePrevSimState() {
+    prevSim.diverPos = diver.pos;
+    prevSim.spinAngle = oxygenCore.spinAngle;
+    prevSim.animParam.assign(envStore.animParam.begin(), envStore.animParam.end());
+    prevSim.version = envStore.version;
+}
+
+float lerpf(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+// =========================
+// Utilities
+// =========================
+
+float clampf(float v, float minv, float maxv) {
+    if (v < minv) return minv;
+    if (v > maxv) return maxv;
+    return v;
+}
+
+float distSquared(const Vector3f& a, const Vector3f& b) {
+    float dx = a.x - b.x;
+    float dy = a.y - b.y;
+    float dz = a.z - b.z;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// Stable LSD radix sort of 64-bit keys on bytes firstByte..lastByte, 8 bits
+// a pass. A pass whose byte is the same in every key is skipped. `scratch`
+// holds at least n keys; the result always ends up in `keys`.
+void radixSortKeys(uint64_t* keys, uint64_t* scratch, int n, int firstByte, int lastByte) {
+    if (n < 2) return;
+
+    uint64_t* src = keys;
+    uint64_t* dst = scratch;
+    for (int byte = firstByte; byte <= lastByte; ++byte) {
+        int shift = byte * 8;
+        int count[256] = { 0 };
+        for (int i = 0; i < n; ++i) ++count[(src[i] >> shift) & 0xFF];
+        if (count[(src[0] >> shift) & 0xFF] == n) continue;
+
+        int start = 0;
+        for (int d = 0; d < 256; ++d) {
+            int c = count[d];
+            count[d] = start;
+            start += c;
+        }
+        for (int i = 0; i < n; ++i) dst[count[(src[i] >> shift) & 0xFF]++] = src[i];
+        std::swap(src, dst);
+    }
+    if (src != keys) memcpy(keys, src, n * sizeof(uint64_t));
+}
+
+// Monotonic wall clock for benchmarks (no GLUT needed)
+double nowSeconds() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time used by the whole process, for utilization reports
+double processCpuSeconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0.0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime; u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Worst-case oversleep of the OS timer (Windows after timeBeginPeriod(1))
+#ifdef _WIN32
+const double SLEEP_SLACK = 0.0012;
+#else
+const double SLEEP_SLACK = 0.0003;
+#endif
+
+// Sleep most of the way to an absolute nowSeconds() deadline, then yield
+// through the last stretch where timer slack would overshoot
+void sleepUntil(double deadline) {
+    for (;;) {
+        double remaining = deadline - nowSeconds();
+        if (remaining <= 0.0) return;
+        if (remaining > SLEEP_SLACK) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(remaining - SLEEP_SLACK));
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// =========================
+// Heap allocation accounting
+// =========================
+
+// Every operator new goes through here so the render loop can prove it is
+// allocation-free. GL objects created through the resource manager below
+// are counted apart, in glObjectsCreated. Every thread counts except the
+// sim thread, whose allocations are not the frame's; job chunks take the
+// flag of the thread that submitted them (see runJob()), so render work
+// on the workers is charged to the frame and sim work is not.
+std::atomic<long> totalAllocations(0);
+long glObjectsCreated = 0;       // GL thread only
+thread_local bool countAllocations = true;
+long frameAllocStart = 0, frameGLObjectsStart = 0;
+long lastFrameAllocations = 0;   // allocations made by the last Display()
+long lastFrameGLObjects = 0;     // GL objects it created
+int  framesRendered = 0;
+
+void noteAllocation() {
+    if (countAllocations) totalAllocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* countedAlloc(size_t size) {
+    noteAllocation();
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+// Size rounded up to the alignment, as aligned_alloc wants
+void* countedAlignedAlloc(size_t size, std::align_val_t align) {
+    noteAllocation();
+    size_t a = (size_t)align;
+    size = (size + a - 1) / a * a;
+#ifdef _WIN32
+    void* p = _aligned_malloc(size ? size : a, a);
+#else
+    void* p = aligned_alloc(a, size ? size : a);
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void alignedFree(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, std::align_val_t align) { return countedAlignedAlloc(size, align); }
+void* operator new[](size_t size, std::align_val_t align) { return countedAlignedAlloc(size, align); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { alignedFree(p); }
+
+void beginFrameAllocations() {
+    frameAllocStart = totalAllocations;
+    frameGLObjectsStart = glObjectsCreated;
+}
+
+void endFrameAllocations() {
+    lastFrameAllocations = totalAllocations - frameAllocStart;
+    lastFrameGLObjects = glObjectsCreated - frameGLObjectsStart;
+    ++framesRendered;
+
+#ifndef NDEBUG
+    // The first frames may still warm up lazily created state
+    static bool warned = false;
+    if (framesRendered > 2 && (lastFrameAllocations != 0 || lastFrameGLObjects != 0) && !warned) {
+        printf("Warning: frame %d made %ld heap allocations and %ld GL objects\n",
+            framesRendered, lastFrameAllocations, lastFrameGLObjects);
+        warned = true;
+    }
+#endif
+}
+
+// =========================
+// Job system
+// =========================
+// A small work-stealing pool for data-parallel loops over the env objects.
+// parallelFor() cuts a range into chunks and deals them out over one deque
+// per thread. Workers pop their own deque from the back and steal from the
+// front of the others when it runs dry. The calling thread helps until its
+// chunks are done, so callers see an ordinary blocking loop. Deques are
+// fixed rings: submitting never allocates.
+//
+// Chunk boundaries depend only on the item count and grain, never on the
+// thread count, so loops that keep per-chunk results and merge them in
+// chunk order produce the same output with any number of workers.
+
+typedef void (*JobFunc)(void* ctx, int begin, int end, int chunk);
+
+struct JobGroup {
+    std::atomic<int> pending;    // chunks not finished yet
+};
+
+struct Job {
+    JobFunc   fn;
+    void*     ctx;
+    int       begin, end, chunk;
+    JobGroup* group;
+    bool      countAllocations;   // the submitting thread's
+};
+
+const int MAX_JOB_THREADS = 64;
+const int MAX_JOB_CHUNKS = 256;  // per parallelFor, bounds per-chunk scratch
+const unsigned JOB_DEQUE_SIZE = 512;   // power of two
+
+struct JobDeque {
+    std::mutex lock;
+    Job jobs[JOB_DEQUE_SIZE];
+    unsigned top;                // thieves take from here
+    unsigned bottom;             // the owner pushes and pops here
+};
+
+struct JobSystem {
+    JobDeque deques[MAX_JOB_THREADS];   // [0] is shared by non-worker threads
+    std::thread workers[MAX_JOB_THREADS];
+    int numThreads;              // workers + the submitting thread
+    std::atomic<int> queued;     // jobs sitting in deques
+    std::atomic<bool> quit;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+};
+
+JobSystem jobs;
+int jobThreadsOption = 0;        // --jobs N, 0 = one per hardware thread
+thread_local int jobThreadIndex = 0;
+
+bool pushJob(int d, const Job& job) {
+    JobDeque& q = jobs.deques[d];
+    std::lock_guard<std::mutex> hold(q.lock);
+    if (q.bottom - q.top >= JOB_DEQUE_SIZE) return false;
+    q.jobs[q.bottom++ & (JOB_DEQUE_SIZE - 1)] = job;
+    jobs.queued.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool popJob(int d, Job& job, bool steal) {
+    JobDeque& q = jobs.deques[d];
+    std::lock_guard<std::mutex> hold(q.lock);
+    if (q.bottom == q.top) return false;
+    job = steal ? q.jobs[q.top++ & (JOB_DEQUE_SIZE - 1)] : q.jobs[--q.bottom & (JOB_DEQUE_SIZE - 1)];
+    jobs.queued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Own deque first, then steal round the others
+bool takeJob(Job& job) {
+    int self = jobThreadIndex;
+    if (popJob(self, job, false)) return true;
+    for (int k = 1; k < jobs.numThreads; ++k) {
+        if (popJob((self + k) % jobs.numThreads, job, true)) return true;
+    }
+    return false;
+}
+
+void runJob(const Job& job) {
+    bool counting = countAllocations;
+    countAllocations = job.countAllocations;
+    job.fn(job.ctx, job.begin, job.end, job.chunk);
+    countAllocations = counting;
+    job.group->pending.fetch_sub(1, std::memory_order_release);
+}
+
+void jobWorkerMain(int index) {
+    jobThreadIndex = index;
+    Job job;
+    while (!jobs.quit.load(std::memory_order_relaxed)) {
+        if (takeJob(job)) {
+            runJob(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> hold(jobs.sleepLock);
+        jobs.wake.wait(hold, [] { return jobs.quit.load() || jobs.queued.load() > 0; });
+    }
+}
+
+void shutdownJobSystem() {
+    {
+        std::lock_guard<std::mutex> hold(jobs.sleepLock);
+        jobs.quit.store(true);
+    }
+    jobs.wake.notify_all();
+    for (int i = 1; i < jobs.numThreads; ++i) jobs.workers[i].join();
+    jobs.numThreads = 1;
+}
+
+// threads <= 0 picks one per hardware thread. Safe to call again to resize
+// while no loop is running.
+void initJobSystem(int threads) {
+    static bool registered = false;
+    if (!registered) {
+        atexit(shutdownJobSystem);
+        registered = true;
+    }
+    if (jobs.numThreads > 1) shutdownJobSystem();
+
+    if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+    if (threads < 1) threads = 1;
+    if (threads > MAX_JOB_THREADS) threads = MAX_JOB_THREADS;
+
+    jobs.numThreads = threads;
+    jobs.quit.store(false);
+    for (int i = 1; i < threads; ++i) jobs.workers[i] = std::thread(jobWorkerMain, i);
+}
+
+int jobChunkCount(int count, int grain) {
+    int chunks = (count + grain - 1) / grain;
+    if (chunks > MAX_JOB_CHUNKS) chunks = MAX_JOB_CHUNKS;
+    return chunks < 1 ? 1 : chunks;
+}
+
+// Run fn over [0, count) in jobChunkCount(count, grain) chunks and wait for
+// all of them. Returns the chunk count. Without workers, or for a single
+// chunk, everything runs inline on the caller.
+int parallelFor(int count, int grain, JobFunc fn, void* ctx) {
+    if (count <= 0) return 0;
+    int chunks = jobChunkCount(count, grain);
+
+    if (chunks == 1 || jobs.numThreads <= 1) {
+        for (int c = 0; c < chunks; ++c) {
+            fn(ctx, (int)((long long)count * c / chunks), (int)((long long)count * (c + 1) / chunks), c);
+        }
+        return chunks;
+    }
+
+    JobGroup group;
+    group.pending.store(chunks, std::memory_order_relaxed);
+
+    // Deal the chunks out round-robin, starting with our own deque
+    for (int c = 0; c < chunks; ++c) {
+        Job job = { fn, ctx, (int)((long long)count * c / chunks), (int)((long long)count * (c + 1) / chunks), c, &group,
+            countAllocations };
+        if (!pushJob((jobThreadIndex + c) % jobs.numThreads, job)) runJob(job);
+    }
+    {
+        std::lock_guard<std::mutex> hold(jobs.sleepLock);
+    }
+    jobs.wake.notify_all();
+
+    // Help out until the last chunk of ours has finished
+    Job job;
+    while (group.pending.load(std::memory_order_acquire) > 0) {
+        if (takeJob(job)) runJob(job);
+        else std::this_thread::yield();
+    }
+    return chunks;
+}
+
+// =========================
+// Sim snapshots
+// =========================
+
+// Everything the renderer reads from the simulation, copied out after
+// ticks. The simulation owns the live globals; drawing code only reads
+// `scene`, so with the sim on its own thread the two never share mutable
+// state. Three slots form a lock-free triple buffer: the writer always
+// has a free slot to fill, the reader keeps the newest complete one, and
+// neither ever waits for the other.
+
+struct SimSnapshot {
+    GameState state;
+    float     oxygenTime;
+    float     wallColorPhase;
+    Camera    camera;
+    Player    diver;
+    Goal      core;
+    EnvObjectStore env;          // worldDirty is not copied
+
+    // State at the start of the latest tick, for interpolation
+    Vector3f  prevDiverPos;
+    float     prevSpinAngle;
+    std::vector<float> prevAnimParam;
+    bool      hasPrevAnim;       // prevAnimParam lines up with env
+
+    float     alpha;             // accumulator position (single-threaded)
+    double    tickTime;          // nowSeconds() after the latest tick
+    long      tick;
+    long      inputApplied;      // input events consumed so far
+    double    inputTime;         // report time of the newest key press it shows
+};
+
+const int SNAPSHOT_FRESH = 4;    // flag on `middle`: not yet picked up
+
+struct SnapshotBuffer {
+    SimSnapshot slots[3];
+    std::atomic<int> middle;     // slot handed over, | SNAPSHOT_FRESH
+    int writeSlot;               // owned by the sim side
+    int readSlot;                // owned by the render side
+};
+
+SnapshotBuffer snapshots = { {}, {1}, 0, 2 };
+const SimSnapshot* scene = &snapshots.slots[2];
+float renderAlpha = 0.0f;        // interpolation position for this frame
+bool  simThreadRunning = false;  // set before the sim thread starts
+
+// Env arrays only change wholesale when objects come and go. Otherwise
+// the slot, which may be two publishes old, needs the animated state and
+// the matrices of objects that are animating (all of them if any object
+// started or stopped since the slot was filled).
+void copyEnvForSnapshot(EnvObjectStore& dst, const EnvObjectStore& src) {
+    if (dst.version != src.version) {
+        dst.posX = src.posX;
+        dst.posY = src.posY;
+        dst.posZ = src.posZ;
+        dst.type = src.type;
+        dst.world = src.world;
+    }
+    else if (dst.staticVersion != src.staticVersion) {
+        dst.world = src.world;
+    }
+    else {
+        for (int i = 0; i < src.count; ++i) {
+            if (src.running[i] != 0.0f) dst.world[i] = src.world[i];
+        }
+    }
+
+    dst.animParam = src.animParam;
+    dst.running = src.running;
+    dst.count = src.count;
+    dst.version = src.version;
+    dst.staticVersion = src.staticVersion;
+}
+
+// Sim side: fill the free slot and hand it over
+void publishSnapshot() {
+    SimSnapshot& s = snapshots.slots[snapshots.writeSlot];
+    s.state = gameState;
+    s.oxygenTime = oxygenTime;
+    s.wallColorPhase = wallColorPhase;
+    s.camera = camera;
+    s.diver = diver;
+    s.core = oxygenCore;
+    copyEnvForSnapshot(s.env, envStore);
+
+    s.prevDiverPos = prevSim.diverPos;
+    s.prevSpinAngle = prevSim.spinAngle;
+    s.hasPrevAnim = prevSim.version == envStore.version;
+    if (s.hasPrevAnim) s.prevAnimParam = prevSim.animParam;
+
+    s.alpha = simClock.alpha;
+    s.tickTime = simClock.lastTickTime;
+    s.tick = simClock.totalTicks;
+    s.inputApplied = simClock.inputApplied;
+    s.inputTime = simClock.lastInputTime;
+
+    int old = snapshots.middle.exchange(snapshots.writeSlot | SNAPSHOT_FRESH, std::memory_order_acq_rel);
+    snapshots.writeSlot = old & 3;
+}
+
+// Render side: switch to the newest snapshot if one arrived
+bool acquireSnapshot() {
+    if (!(snapshots.middle.load(std::memory_order_acquire) & SNAPSHOT_FRESH)) return false;
+
+    int old = snapshots.middle.exchange(snapshots.readSlot, std::memory_order_acq_rel);
+    snapshots.readSlot = old & 3;
+    scene = &snapshots.slots[snapshots.readSlot];
+    return true;
+}
+
+// With the sim on its own clock, how far past the latest tick we are
+void updateRenderAlpha() {
+    if (simThreadRunning) {
+        float t = (float)((nowSeconds() - scene->tickTime) / SIM_DT);
+        renderAlpha = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+    }
+    else {
+        renderAlpha = scene->alpha;
+    }
+}
+
+Vector3f renderDiverPos() {
+    const Vector3f& p = scene->prevDiverPos;
+    const Vector3f& c = scene->diver.pos;
+    float t = renderAlpha;
+    return Vector3f(lerpf(p.x, c.x, t), lerpf(p.y, c.y, t), lerpf(p.z, c.z, t));
+}
+
+// Spin wraps at 360, so take the short way round
+float renderSpinAngle() {
+    float prev = scene->prevSpinAngle;
+    if (scene->core.spinAngle < prev - 180.0f) prev -= 360.0f;
+    return lerpf(prev, scene->core.spinAngle, renderAlpha);
+}
+
+// False when the object did not move between the two ticks
+bool renderAnimParam(int i, float& anim) {
+    if (!scene->hasPrevAnim) return false;
+    float prev = scene->prevAnimParam[i];
+    float cur = scene->env.animParam[i];
+    if (prev == cur) return false;
+    anim = lerpf(prev, cur, renderAlpha);
+    return true;
+}
+
+// =========================
+// GL extensions
+// =========================
+
+// Entry points beyond GL 1.1 are loaded at runtime; nothing here is
+// required, callers check the has* flags and fall back to fixed function.
+struct GLExtensions {
+    // Buffer objects (GL 1.5)
+    void (APIENTRY* GenBuffers)(GLsizei n, GLuint* buffers);
+    void (APIENTRY* DeleteBuffers)(GLsizei n, const GLuint* buffers);
+    void (APIENTRY* BindBuffer)(GLenum target, GLuint buffer);
+    void (APIENTRY* BufferData)(GLenum target, ptrdiff_t size, const void* data, GLenum usage);
+    void (APIENTRY* BufferSubData)(GLenum target, ptrdiff_t offset, ptrdiff_t size, const void* data);
+
+    // Shaders (GL 2.0)
+    GLuint (APIENTRY* CreateShader)(GLenum type);
+    void (APIENTRY* DeleteShader)(GLuint shader);
+    void (APIENTRY* ShaderSource)(GLuint shader, GLsizei count, const char* const* strings, const GLint* lengths);
+    void (APIENTRY* CompileShader)(GLuint shader);
+    void (APIENTRY* GetShaderiv)(GLuint shader, GLenum pname, GLint* params);
+    void (APIENTRY* GetShaderInfoLog)(GLuint shader, GLsizei maxLength, GLsizei* length, char* log);
+    GLuint (APIENTRY* CreateProgram)();
+    void (APIENTRY* DeleteProgram)(GLuint program);
+    void (APIENTRY* AttachShader)(GLuint program, GLuint shader);
+    void (APIENTRY* BindAttribLocation)(GLuint program, GLuint index, const char* name);
+    void (APIENTRY* LinkProgram)(GLuint program);
+    void (APIENTRY* GetProgramiv)(GLuint program, GLenum pname, GLint* params);
+    void (APIENTRY* GetProgramInfoLog)(GLuint program, GLsizei maxLength, GLsizei* length, char* log);
+    void (APIENTRY* UseProgram)(GLuint program);
+    GLint (APIENTRY* GetUniformLocation)(GLuint program, const char* name);
+    void (APIENTRY* Uniform1i)(GLint location, GLint value);
+    void (APIENTRY* VertexAttribPointer)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+    void (APIENTRY* EnableVertexAttribArray)(GLuint index);
+    void (APIENTRY* DisableVertexAttribArray)(GLuint index);
+
+    // Uniform buffers (GL 3.1)
+    GLuint (APIENTRY* GetUniformBlockIndex)(GLuint program, const char* name);
+    void (APIENTRY* UniformBlockBinding)(GLuint program, GLuint block, GLuint binding);
+    void (APIENTRY* BindBufferBase)(GLenum target, GLuint index, GLuint buffer);
+
+    // Texture buffers (GL 3.1)
+    void (APIENTRY* TexBuffer)(GLenum target, GLenum format, GLuint buffer);
+    void (APIENTRY* ActiveTexture)(GLenum unit);
+
+    // Instancing (GL 3.1 / 3.3)
+    void (APIENTRY* DrawArraysInstanced)(GLenum mode, GLint first, GLsizei count, GLsizei instances);
+    void (APIENTRY* VertexAttribDivisor)(GLuint index, GLuint divisor);
+
+    // Occlusion queries (GL 1.5), timer queries (GL 3.3 / ARB_timer_query)
+    void (APIENTRY* GenQueries)(GLsizei n, GLuint* ids);
+    void (APIENTRY* DeleteQueries)(GLsizei n, const GLuint* ids);
+    void (APIENTRY* BeginQuery)(GLenum target, GLuint id);
+    void (APIENTRY* EndQuery)(GLenum target);
+    void (APIENTRY* GetQueryObjectiv)(GLuint id, GLenum pname, GLint* params);
+    void (APIENTRY* GetQueryObjectui64v)(GLuint id, GLenum pname, unsigned long long* params);
+
+    int  versionMajor, versionMinor;
+    bool hasBuffers, hasShaders, hasUniformBuffers, hasTextureBuffers, hasInstancing, hasOcclusionQuery, hasTimerQuery;
+};
+
+GLExtensions ext;
+
+// Set while the EGL pbuffer context is current (see --offscreen)
+bool offscreenActive = false;
+
+void* getGLProc(const char* name) {
+#if OFFSCREEN_EGL
+    if (offscreenActive) return (void*)eglGetProcAddress(name);
+#endif
+#if defined(_WIN32)
+    return (void*)wglGetProcAddress(name);
+#elif defined(FREEGLUT)
+    return (void*)glutGetProcAddress(name);
+#else
+    return NULL;
+#endif
+}
+
+template <typename T>
+bool loadGLProc(T& fn, const char* name) {
+    fn = (T)getGLProc(name);
+    return fn != NULL;
+}
+
+// Needs a current context
+void loadGLExtensions() {
+    const char* version = (const char*)glGetString(GL_VERSION);
+    ext.versionMajor = ext.versionMinor = 0;
+    if (version) sscanf(version, "%d.%d", &ext.versionMajor, &ext.versionMinor);
+    int v = ext.versionMajor * 10 + ext.versionMinor;
+
+    bool ok = v >= 15;
+    ok = loadGLProc(ext.GenBuffers, "glGenBuffers") && ok;
+    ok = loadGLProc(ext.DeleteBuffers, "glDeleteBuffers") && ok;
+    ok = loadGLProc(ext.BindBuffer, "glBindBuffer") && ok;
+    ok = loadGLProc(ext.BufferData, "glBufferData") && ok;
+    ok = loadGLProc(ext.BufferSubData, "glBufferSubData") && ok;
+    ext.hasBuffers = ok;
+
+    ok = v >= 20;
+    ok = loadGLProc(ext.CreateShader, "glCreateShader") && ok;
+    ok = loadGLProc(ext.DeleteShader, "glDeleteShader") && ok;
+    ok = loadGLProc(ext.ShaderSource, "glShaderSource") && ok;
+    ok = loadGLProc(ext.CompileShader, "glCompileShader") && ok;
+    ok = loadGLProc(ext.GetShaderiv, "glGetShaderiv") && ok;
+    ok = loadGLProc(ext.GetShaderInfoLog, "glGetShaderInfoLog") && ok;
+    ok = loadGLProc(ext.CreateProgram, "glCreateProgram") && ok;
+    ok = loadGLProc(ext.DeleteProgram, "glDeleteProgram") && ok;
+    ok = loadGLProc(ext.AttachShader, "glAttachShader") && ok;
+    ok = loadGLProc(ext.BindAttribLocation, "glBindAttribLocation") && ok;
+    ok = loadGLProc(ext.LinkProgram, "glLinkProgram") && ok;
+    ok = loadGLProc(ext.GetProgramiv, "glGetProgramiv") && ok;
+    ok = loadGLProc(ext.GetProgramInfoLog, "glGetProgramInfoLog") && ok;
+    ok = loadGLProc(ext.UseProgram, "glUseProgram") && ok;
+    ok = loadGLProc(ext.GetUniformLocation, "glGetUniformLocation") && ok;
+    ok = loadGLProc(ext.Uniform1i, "glUniform1i") && ok;
+    ok = loadGLProc(ext.VertexAttribPointer, "glVertexAttribPointer") && ok;
+    ok = loadGLProc(ext.EnableVertexAttribArray, "glEnableVertexAttribArray") && ok;
+    ok = loadGLProc(ext.DisableVertexAttribArray, "glDisableVertexAttribArray") && ok;
+    ext.hasShaders = ok && ext.hasBuffers;
+
+    ok = v >= 31;
+    ok = loadGLProc(ext.GetUniformBlockIndex, "glGetUniformBlockIndex") && ok;
+    ok = loadGLProc(ext.UniformBlockBinding, "glUniformBlockBinding") && ok;
+    ok = loadGLProc(ext.BindBufferBase, "glBindBufferBase") && ok;
+    ext.hasUniformBuffers = ok && ext.hasShaders;
+
+    ok = v >= 31;
+    ok = loadGLProc(ext.TexBuffer, "glTexBuffer") && ok;
+    ok = loadGLProc(ext.ActiveTexture, "glActiveTexture") && ok;
+    ext.hasTextureBuffers = ok && ext.hasBuffers;
+
+    ok = v >= 33;
+    ok = loadGLProc(ext.DrawArraysInstanced, "glDrawArraysInstanced") && ok;
+    ok = loadGLProc(ext.VertexAttribDivisor, "glVertexAttribDivisor") && ok;
+    ext.hasInstancing = ok && ext.hasShaders;
+
+    ok = v >= 15;
+    ok = loadGLProc(ext.GenQueries, "glGenQueries") && ok;
+    ok = loadGLProc(ext.DeleteQueries, "glDeleteQueries") && ok;
+    ok = loadGLProc(ext.BeginQuery, "glBeginQuery") && ok;
+    ok = loadGLProc(ext.EndQuery, "glEndQuery") && ok;
+    ok = loadGLProc(ext.GetQueryObjectiv, "glGetQueryObjectiv") && ok;
+    ext.hasOcclusionQuery = ok;
+
+    ok = v >= 33;
+    ok = loadGLProc(ext.GetQueryObjectui64v, "glGetQueryObjectui64v") && ok;
+    ext.hasTimerQuery = ok && ext.hasOcclusionQuery;
+}
+
+// =========================
+// GL resources
+// =========================
+
+// Owns the long-lived GL objects used by the draw functions: display
+// lists, buffers and shader programs. Everything is created once after
+// glutCreateWindow (initResources) and released at exit
+// (releaseResources), so nothing is allocated in the render path.
+const int MAX_LIST_RANGES = 16;
+const int MAX_GL_OBJECTS = 32;
+const int MAX_GL_QUERIES = 128;
+
+struct ListRange {
+    GLuint  base;
+    GLsizei count;
+};
+
+struct GLResources {
+    ListRange lists[MAX_LIST_RANGES];
+    int       numListRanges;
+    GLuint    buffers[MAX_GL_OBJECTS];
+    int       numBuffers;
+    GLuint    programs[MAX_GL_OBJECTS];
+    int       numPrograms;
+    GLuint    queries[MAX_GL_QUERIES];
+    int       numQueries;
+    GLuint    textures[MAX_GL_OBJECTS];
+    int       numTextures;
+    bool      ready;
+};
+
+GLResources resources;
+
+void initResources() {
+    if (resources.ready) return;
+
+    loadGLExtensions();
+
+    resources.numListRanges = 0;
+    resources.numBuffers = 0;
+    resources.numPrograms = 0;
+    resources.numQueries = 0;
+    resources.numTextures = 0;
+    resources.ready = true;
+}
+
+// Create a buffer object that is freed with the other resources
+GLuint acquireBuffer() {
+    if (!resources.ready || !ext.hasBuffers || resources.numBuffers >= MAX_GL_OBJECTS) return 0;
+
+    GLuint buffer = 0;
+    ext.GenBuffers(1, &buffer);
+    ++glObjectsCreated;
+    resources.buffers[resources.numBuffers++] = buffer;
+    return buffer;
+}
+
+// Hand a linked program to the resource manager
+void adoptProgram(GLuint program) {
+    if (resources.numPrograms < MAX_GL_OBJECTS) {
+        resources.programs[resources.numPrograms++] = program;
+    }
+}
+
+// Create a texture object that is freed with the other resources
+GLuint acquireTexture() {
+    if (!resources.ready || resources.numTextures >= MAX_GL_OBJECTS) return 0;
+
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    ++glObjectsCreated;
+    resources.textures[resources.numTextures++] = texture;
+    return texture;
+}
+
+// Query objects freed with the other resources; all or nothing
+bool acquireQueries(GLsizei count, GLuint* out) {
+    if (!resources.ready || !ext.hasOcclusionQuery || resources.numQueries + count > MAX_GL_QUERIES) return false;
+
+    ext.GenQueries(count, out);
+    glObjectsCreated += count;
+    for (GLsizei i = 0; i < count; ++i) resources.queries[resources.numQueries++] = out[i];
+    return true;
+}
+
+// Reserve a block of display lists that is freed with the other resources
+GLuint acquireDisplayLists(GLsizei count) {
+    if (!resources.ready || resources.numListRanges >= MAX_LIST_RANGES) return 0;
+
+    GLuint base = glGenLists(count);
+    if (base == 0) return 0;
+    glObjectsCreated += count;
+
+    ListRange& range = resources.lists[resources.numListRanges++];
+    range.base = base;
+    range.count = count;
+    return base;
+}
+
+void releaseResources() {
+    if (!resources.ready) return;
+
+    for (int i = 0; i < resources.numListRanges; ++i) {
+        glDeleteLists(resources.lists[i].base, resources.lists[i].count);
+    }
+    resources.numListRanges = 0;
+
+    if (resources.numBuffers > 0) {
+        ext.DeleteBuffers(resources.numBuffers, resources.buffers);
+        resources.numBuffers = 0;
+    }
+    for (int i = 0; i < resources.numPrograms; ++i) {
+        ext.DeleteProgram(resources.programs[i]);
+    }
+    resources.numPrograms = 0;
+    if (resources.numQueries > 0) {
+        ext.DeleteQueries(resources.numQueries, resources.queries);
+        resources.numQueries = 0;
+    }
+    if (resources.numTextures > 0) {
+        glDeleteTextures(resources.numTextures, resources.textures);
+        resources.numTextures = 0;
+    }
+    resources.ready = false;
+}
+
+// =========================
+// Profiler
+// =========================
+// Hierarchical frame profiler for the render thread. A ProfileScope at the
+// top of a function records its CPU time, draw calls and triangles. Scopes
+// directly under renderFrame() also get a GL_TIME_ELAPSED query. Elapsed
+// queries cannot nest, so deeper scopes are CPU only. Query results are
+// read PROFILE_GPU_FRAMES frames later, so reading them never stalls.
+// Collection is off (one branch per scope) unless the overlay ('p',
+// --profile) or a trace (--trace file.json) is on. Everything is fixed
+// size, so the render loop stays allocation-free.
+
+// Per-frame counters, reset by renderFrame()
+struct RenderStats {
+    int  objectsDrawn;
+    int  objectsCulled;
+    int  drawCalls;
+    long triangles;
+    int  stateChanges;          // GL state calls issued through the cache
+    int  stateChangesSaved;     // and skipped as redundant
+    float overdraw;             // opaque samples per pixel, a few frames old
+    int  lights;                // clustered lights this frame
+    int  lightRefs;             // their entries over all cluster lists
+    int  particles;             // live particles drawn
+};
+
+RenderStats frameStats;
+
+const int PROFILE_MAX_SCOPES = 64;   // recorded per frame
+const int PROFILE_MAX_STATS = 32;    // distinct scope names
+const int PROFILE_GPU_FRAMES = 4;    // frames of queries in flight
+const int PROFILE_MAX_GPU = 16;      // timed scopes per frame
+const int PROFILE_HISTORY = 120;     // frame times kept for the rolling max
+const float PROFILE_SMOOTHING = 0.05f;   // weight of the newest frame
+
+struct ProfileRecord {
+    const char* name;
+    int    depth;
+    int    stat;                     // index into Profiler::stats
+    int    gpu;                      // query slot this frame, -1 = none
+    double start, end;               // nowSeconds()
+    int    drawCalls;                // at start, then during the scope
+    long   triangles;
+};
+
+// Running averages per scope name, in first-seen order
+struct ProfileStat {
+    const char* name;
+    int   depth;
+    float cpuMs, gpuMs;
+    float drawCalls, triangles;
+    float frameCpuMs;                // this frame's total, folded in at the end
+    int   frameDrawCalls;
+    long  frameTriangles;
+};
+
+struct GpuTimerFrame {
+    GLuint queries[PROFILE_MAX_GPU];
+    int    stat[PROFILE_MAX_GPU];
+    double cpuStart[PROFILE_MAX_GPU];   // where the trace places the GPU slice
+    int    count;
+};
+
+struct TraceEvent {
+    const char* name;
+    double start, duration;          // seconds
+    int    tid;                      // 1 = CPU, 2 = GPU
+    int    drawCalls;
+    long   triangles;
+};
+
+const size_t TRACE_MAX_EVENTS = 200000;
+
+struct Profiler {
+    bool enabled;
+    bool overlay;
+    int  depth;
+
+    ProfileRecord records[PROFILE_MAX_SCOPES];
+    int  numRecords;
+    ProfileStat stats[PROFILE_MAX_STATS];
+    int  numStats;
+
+    GpuTimerFrame gpu[PROFILE_GPU_FRAMES];
+    int  gpuFrame;                   // slot being filled this frame
+    long gpuFramesIssued;
+    bool gpuReady;
+
+    float frameMs;                   // smoothed interval between frames
+    float history[PROFILE_HISTORY];
+    int  historyPos;
+    double lastFrameEnd;
+
+    const char* tracePath;
+    std::vector<TraceEvent> trace;   // reserved once, never grows
+    double traceStart;
+};
+
+Profiler profiler;
+
+int profileStat(const char* name, int depth) {
+    for (int i = 0; i < profiler.numStats; ++i) {
+        if (profiler.stats[i].name == name) return i;
+    }
+    if (profiler.numStats >= PROFILE_MAX_STATS) return -1;
+
+    ProfileStat& s = profiler.stats[profiler.numStats];
+    memset(&s, 0, sizeof(s));
+    s.name = name;
+    s.depth = depth;
+    return profiler.numStats++;
+}
+
+struct ProfileScope {
+    int record;                      // -1 when not recording
+
+    explicit ProfileScope(const char* name) : record(-1) {
+        if (!profiler.enabled || profiler.numRecords >= PROFILE_MAX_SCOPES) return;
+
+        record = profiler.numRecords++;
+        ProfileRecord& r = profiler.records[record];
+        r.name = name;
+        r.depth = profiler.depth++;
+        r.stat = profileStat(name, r.depth);
+        r.drawCalls = frameStats.drawCalls;
+        r.triangles = frameStats.triangles;
+        r.gpu = -1;
+
+        GpuTimerFrame& g = profiler.gpu[profiler.gpuFrame];
+        if (r.depth == 1 && profiler.gpuReady && g.count < PROFILE_MAX_GPU) {
+            r.gpu = g.count++;
+            g.stat[r.gpu] = r.stat;
+            ext.BeginQuery(GL_TIME_ELAPSED, g.queries[r.gpu]);
+        }
+        r.start = nowSeconds();
+        if (r.gpu >= 0) g.cpuStart[r.gpu] = r.start;
+    }
+
+    ~ProfileScope() {
+        if (record < 0) return;
+
+        ProfileRecord& r = profiler.records[record];
+        r.end = nowSeconds();
+        if (r.gpu >= 0) ext.EndQuery(GL_TIME_ELAPSED);
+        r.drawCalls = frameStats.drawCalls - r.drawCalls;
+        r.triangles = frameStats.triangles - r.triangles;
+        --profiler.depth;
+    }
+};
+
+// Needs the GL resources; GPU columns stay empty without timer queries
+void initProfiler() {
+    profiler.gpuReady = ext.hasTimerQuery;
+    for (int f = 0; f < PROFILE_GPU_FRAMES && profiler.gpuReady; ++f) {
+        profiler.gpu[f].count = 0;
+        profiler.gpuReady = acquireQueries(PROFILE_MAX_GPU, profiler.gpu[f].queries);
+    }
+    profiler.lastFrameEnd = nowSeconds();
+}
+
+void setProfilerEnabled(bool on) {
+    profiler.enabled = on || profiler.tracePath != NULL;
+}
+
+void startTrace(const char* path) {
+    profiler.tracePath = path;
+    profiler.trace.reserve(TRACE_MAX_EVENTS);
+    profiler.traceStart = nowSeconds();
+    setProfilerEnabled(true);
+}
+
+void addTraceEvent(const char* name, double start, double duration, int tid, int drawCalls, long triangles) {
+    if (!profiler.tracePath || profiler.trace.size() >= TRACE_MAX_EVENTS) return;
+
+    TraceEvent e = { name, start, duration, tid, drawCalls, triangles };
+    profiler.trace.push_back(e);
+}
+
+float smooth(float average, float sample) {
+    return average + (sample - average) * PROFILE_SMOOTHING;
+}
+
+// Fold in the results of the oldest query frame before its slot is reused.
+// Blocks only if the GPU is PROFILE_GPU_FRAMES frames behind.
+void collectGpuTimers(GpuTimerFrame& g) {
+    for (int i = 0; i < g.count; ++i) {
+        unsigned long long ns = 0;
+        ext.GetQueryObjectui64v(g.queries[i], GL_QUERY_RESULT, &ns);
+        double seconds = ns * 1e-9;
+        if (g.stat[i] >= 0) {
+            ProfileStat& s = profiler.stats[g.stat[i]];
+            s.gpuMs = smooth(s.gpuMs, (float)(seconds * 1000.0));
+            addTraceEvent(s.name, g.cpuStart[i], seconds, 2, 0, 0);
+        }
+    }
+    g.count = 0;
+}
+
+// Call once per presented frame, after the swap (or glFinish offscreen)
+void endProfileFrame() {
+    double now = nowSeconds();
+    float frameMs = (float)((now - profiler.lastFrameEnd) * 1000.0);
+    profiler.lastFrameEnd = now;
+    if (!profiler.enabled) return;
+
+    profiler.frameMs = profiler.frameMs > 0.0f ? smooth(profiler.frameMs, frameMs) : frameMs;
+    profiler.history[profiler.historyPos] = frameMs;
+    profiler.historyPos = (profiler.historyPos + 1) % PROFILE_HISTORY;
+
+    for (int i = 0; i < profiler.numRecords; ++i) {
+        const ProfileRecord& r = profiler.records[i];
+        addTraceEvent(r.name, r.start, r.end - r.start, 1, r.drawCalls, r.triangles);
+        if (r.stat < 0) continue;
+
+        // A name can appear more than once per frame
+        ProfileStat& s = profiler.stats[r.stat];
+        s.frameCpuMs += (float)((r.end - r.start) * 1000.0);
+        s.frameDrawCalls += r.drawCalls;
+        s.frameTriangles += r.triangles;
+    }
+    for (int i = 0; i < profiler.numStats; ++i) {
+        ProfileStat& s = profiler.stats[i];
+        s.cpuMs = smooth(s.cpuMs, s.frameCpuMs);
+        s.drawCalls = smooth(s.drawCalls, (float)s.frameDrawCalls);
+        s.triangles = smooth(s.triangles, (float)s.frameTriangles);
+        s.frameCpuMs = 0.0f;
+        s.frameDrawCalls = 0;
+        s.frameTriangles = 0;
+    }
+    profiler.numRecords = 0;
+
+    if (profiler.gpuReady) {
+        ++profiler.gpuFramesIssued;
+        profiler.gpuFrame = (profiler.gpuFrame + 1) % PROFILE_GPU_FRAMES;
+        collectGpuTimers(profiler.gpu[profiler.gpuFrame]);
+    }
+}
+
+float profileMaxFrameMs() {
+    float worst = 0.0f;
+    for (int i = 0; i < PROFILE_HISTORY; ++i) worst = std::max(worst, profiler.history[i]);
+    return worst;
+}
+
+// Chrome trace event format (chrome://tracing, Perfetto): complete events
+// in microseconds. GPU slices have a duration but no GPU timestamp, so
+// they are drawn at the start of their CPU scope.
+bool writeTrace() {
+    if (!profiler.tracePath) return false;
+
+    FILE* f = fopen(profiler.tracePath, "w");
+    if (!f) {
+        printf("Cannot write trace %s\n", profiler.tracePath);
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU (render thread)\"}},\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU (time elapsed)\"}}");
+    for (size_t i = 0; i < profiler.trace.size(); ++i) {
+        const TraceEvent& e = profiler.trace[i];
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            e.name, e.tid, (e.start - profiler.traceStart) * 1e6, e.duration * 1e6);
+        if (e.tid == 1) fprintf(f, ",\"args\":{\"drawCalls\":%d,\"triangles\":%ld}", e.drawCalls, e.triangles);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    printf("Trace: %u events written to %s%s\n", (unsigned)profiler.trace.size(), profiler.tracePath,
+        profiler.trace.size() >= TRACE_MAX_EVENTS ? " (buffer full, later frames dropped)" : "");
+    return true;
+}
+
+void writeTraceAtExit() {
+    writeTrace();
+}
+
+// Per-scope table for headless runs
+void printProfile() {
+    printf("  profile (smoothed per frame):\n");
+    for (int i = 0; i < profiler.numStats; ++i) {
+        const ProfileStat& s = profiler.stats[i];
+        printf("    %*s%-*s cpu %7.3f ms", s.depth * 2, "", 30 - s.depth * 2, s.name, s.cpuMs);
+        if (profiler.gpuReady && s.depth == 1) printf("  gpu %7.3f ms", s.gpuMs);
+        printf("  %6.0f draws %9.0f tris\n", s.drawCalls, s.triangles);
+    }
+}
+
+// =========================
+// GL state cache
+// =========================
+
+// Shadow copies of the fixed-function state set during a frame: current
+// color, material, light 0, a few enable bits and the matrix mode. Setting
+// a value the shadow already holds issues no GL call, and frameStats
+// counts both outcomes. Anything that changes this state behind the
+// cache's back -- a display list, a draw with a color array, a shader's
+// attributes -- must invalidate the shadow it touched.
+
+enum CachedCap {
+    CAP_LIGHTING,
+    CAP_DEPTH_TEST,
+    CAP_TEXTURE_2D,
+    CAP_BLEND,
+    NUM_CACHED_CAPS
+};
+
+const GLenum CACHED_CAP_ENUMS[NUM_CACHED_CAPS] = { GL_LIGHTING, GL_DEPTH_TEST, GL_TEXTURE_2D, GL_BLEND };
+
+struct MaterialState {
+    GLfloat ambient[4];
+    GLfloat diffuse[4];
+    GLfloat specular[4];
+    GLfloat shininess;
+};
+
+struct GLStateCache {
+    bool    colorValid;
+    GLfloat color[3];
+    bool    materialValid;
+    MaterialState material;
+    bool    lightPositionValid;
+    GLfloat lightPosition[4];
+    Mat4    lightView;              // modelview the position was given under
+    bool    lightDiffuseValid;
+    GLfloat lightDiffuse[4];
+    int     caps[NUM_CACHED_CAPS];  // 1 on, 0 off, -1 unknown
+    GLenum  matrixMode;             // 0 = unknown
+    bool    programValid;
+    GLuint  program;
+};
+
+GLStateCache glState;
+bool useStateCache = true;   // false = every call reaches GL (--no-state-cache)
+
+// Nothing is known about a context that was just made current
+void invalidateGLState() {
+    glState.colorValid = false;
+    glState.materialValid = false;
+    glState.lightPositionValid = false;
+    glState.lightDiffuseValid = false;
+    for (int i = 0; i < NUM_CACHED_CAPS; ++i) glState.caps[i] = -1;
+    glState.matrixMode = 0;
+    glState.programValid = false;
+}
+
+// The current color is undefined after a display list that sets colors
+// and after drawing with GL_COLOR_ARRAY
+void invalidateColor() {
+    glState.colorValid = false;
+}
+
+// True when the `calls` GL calls can be skipped; counted either way
+bool stateRedundant(bool same, int calls) {
+    if (same && useStateCache) {
+        frameStats.stateChangesSaved += calls;
+        return true;
+    }
+    frameStats.stateChanges += calls;
+    return false;
+}
+
+void setColor(GLfloat r, GLfloat g, GLfloat b) {
+    GLStateCache& s = glState;
+    if (stateRedundant(s.colorValid && s.color[0] == r && s.color[1] == g && s.color[2] == b, 1)) return;
+
+    glColor3f(r, g, b);
+    s.color[0] = r;
+    s.color[1] = g;
+    s.color[2] = b;
+    s.colorValid = true;
+}
+
+// With GL_COLOR_MATERIAL on, ambient and diffuse follow glColor anyway;
+// they are still sent so the material is complete if it is turned off
+void setMaterial(const MaterialState& m) {
+    GLStateCache& s = glState;
+    if (stateRedundant(s.materialValid && memcmp(&s.material, &m, sizeof(m)) == 0, 4)) return;
+
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, m.ambient);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, m.diffuse);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, m.specular);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, &m.shininess);
+    s.material = m;
+    s.materialValid = true;
+}
+
+// GL stores the position in eye space, so it is only the same if the
+// modelview (`view`, which must be loaded) is too
+void setLightPosition(const GLfloat position[4], const Mat4& view) {
+    GLStateCache& s = glState;
+    bool same = s.lightPositionValid && memcmp(s.lightPosition, position, sizeof(s.lightPosition)) == 0 &&
+        memcmp(s.lightView.m, view.m, sizeof(view.m)) == 0;
+    if (stateRedundant(same, 1)) return;
+
+    glLightfv(GL_LIGHT0, GL_POSITION, position);
+    memcpy(s.lightPosition, position, sizeof(s.lightPosition));
+    s.lightView = view;
+    s.lightPositionValid = true;
+}
+
+void setLightDiffuse(const GLfloat diffuse[4]) {
+    GLStateCache& s = glState;
+    if (stateRedundant(s.lightDiffuseValid && memcmp(s.lightDiffuse, diffuse, sizeof(s.lightDiffuse)) == 0, 1)) return;
+
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
+    memcpy(s.lightDiffuse, diffuse, sizeof(s.lightDiffuse));
+    s.lightDiffuseValid = true;
+}
+
+void setCap(CachedCap cap, bool on) {
+    int& current = glState.caps[cap];
+    if (stateRedundant(current == (on ? 1 : 0), 1)) return;
+
+    if (on) glEnable(CACHED_CAP_ENUMS[cap]);
+    else glDisable(CACHED_CAP_ENUMS[cap]);
+    current = on ? 1 : 0;
+}
+
+void setMatrixMode(GLenum mode) {
+    if (stateRedundant(glState.matrixMode == mode, 1)) return;
+
+    glMatrixMode(mode);
+    glState.matrixMode = mode;
+}
+
+// 0 = fixed function, the only choice without shader support
+void setProgram(GLuint program) {
+    if (!ext.hasShaders) return;
+    if (stateRedundant(glState.programValid && glState.program == program, 1)) return;
+
+    ext.UseProgram(program);
+    glState.program = program;
+    glState.programValid = true;
+}
+
+// =========================
+// Primitive shapes
+// =========================
+
+// Vertex layout of captured meshes: model space triangles
+struct MeshVertex {
+    float pos[3];
+    float normal[3];
+    float color[3];
+};
+
+// While a capture is active the shapes append triangles to a CPU mesh
+// instead of issuing GL calls. Positions are baked with the current
+// modelview matrix and normals with its inverse transpose, so a model's
+// glTranslatef/glRotatef/glScalef chain is flattened into the mesh.
+struct ShapeCapture {
+    std::vector<MeshVertex>* out;
+    GLenum     mode;
+    int        count;         // vertices since emitBegin
+    MeshVertex window[3];     // last three vertices of the current primitive
+    float      matrix[16];
+    float      normalMatrix[9];
+    float      color[3];
+    float      normal[3];
+};
+
+ShapeCapture shapeCapture;
+
+// Tessellation scale of the level of detail being built (1 = full detail)
+float shapeDetail = 1.0f;
+
+int detailSegments(int n) {
+    int s = (int)(n * shapeDetail + 0.5f);
+    return s < 4 ? 4 : s;
+}
+
+void beginShapeCapture(std::vector<MeshVertex>* out) {
+    shapeCapture.out = out;
+}
+
+void endShapeCapture() {
+    shapeCapture.out = NULL;
+}
+
+void emitBegin(GLenum mode) {
+    if (!shapeCapture.out) {
+        glBegin(mode);
+        return;
+    }
+
+    ShapeCapture& sc = shapeCapture;
+    sc.mode = mode;
+    sc.count = 0;
+
+    glGetFloatv(GL_MODELVIEW_MATRIX, sc.matrix);
+    GLfloat color[4];
+    glGetFloatv(GL_CURRENT_COLOR, color);
+    sc.color[0] = color[0];
+    sc.color[1] = color[1];
+    sc.color[2] = color[2];
+
+    // Inverse transpose of the upper 3x3 = cofactor columns (scale dropped,
+    // normals are renormalized anyway)
+    const float* m = sc.matrix;
+    Vector3f c0(m[0], m[1], m[2]), c1(m[4], m[5], m[6]), c2(m[8], m[9], m[10]);
+    Vector3f n0 = c1.cross(c2), n1 = c2.cross(c0), n2 = c0.cross(c1);
+    float sign = (c0.x * n0.x + c0.y * n0.y + c0.z * n0.z) < 0.0f ? -1.0f : 1.0f;
+    float* nm = sc.normalMatrix;
+    nm[0] = n0.x * sign; nm[1] = n0.y * sign; nm[2] = n0.z * sign;
+    nm[3] = n1.x * sign; nm[4] = n1.y * sign; nm[5] = n1.z * sign;
+    nm[6] = n2.x * sign; nm[7] = n2.y * sign; nm[8] = n2.z * sign;
+}
+
+void emitNormal(float x, float y, float z) {
+    if (!shapeCapture.out) {
+        glNormal3f(x, y, z);
+        return;
+    }
+
+    shapeCapture.normal[0] = x;
+    shapeCapture.normal[1] = y;
+    shapeCapture.normal[2] = z;
+}
+
+void pushTriangle(const MeshVertex& a, const MeshVertex& b, const MeshVertex& c) {
+    shapeCapture.out->push_back(a);
+    shapeCapture.out->push_back(b);
+    shapeCapture.out->push_back(c);
+}
+
+void emitVertex(float x, float y, float z) {
+    if (!shapeCapture.out) {
+        glVertex3f(x, y, z);
+        return;
+    }
+
+    ShapeCapture& sc = shapeCapture;
+    const float* m = sc.matrix;
+    const float* nm = sc.normalMatrix;
+    const float* n = sc.normal;
+
+    MeshVertex v;
+    v.pos[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+    v.pos[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+    v.pos[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+
+    float nx = nm[0] * n[0] + nm[3] * n[1] + nm[6] * n[2];
+    float ny = nm[1] * n[0] + nm[4] * n[1] + nm[7] * n[2];
+    float nz = nm[2] * n[0] + nm[5] * n[1] + nm[8] * n[2];
+    float len = sqrtf(nx * nx + ny * ny + nz * nz);
+    if (len > 0.0f) len = 1.0f / len;
+    v.normal[0] = nx * len;
+    v.normal[1] = ny * len;
+    v.normal[2] = nz * len;
+
+    v.color[0] = sc.color[0];
+    v.color[1] = sc.color[1];
+    v.color[2] = sc.color[2];
+
+    // Assemble triangles from the window of previous vertices
+    int k = sc.count++;
+    const MeshVertex* w = sc.window;
+    if (sc.mode == GL_TRIANGLES && k % 3 == 2) {
+        pushTriangle(w[1], w[2], v);
+    }
+    else if (sc.mode == GL_QUADS && k % 4 == 3) {
+        // Split along the 1-3 diagonal like Mesa does, so large Gouraud
+        // lit quads (the floor) shade the same captured or not
+        pushTriangle(w[0], w[1], v);
+        pushTriangle(w[1], w[2], v);
+    }
+    else if (sc.mode == GL_QUAD_STRIP && k >= 3 && (k & 1)) {
+        pushTriangle(w[0], w[1], v);
+        pushTriangle(w[0], v, w[2]);
+    }
+
+    sc.window[0] = sc.window[1];
+    sc.window[1] = sc.window[2];
+    sc.window[2] = v;
+}
+
+void emitEnd() {
+    if (!shapeCapture.out) glEnd();
+}
+
+// Solid primitives with the same layout as the GLUT/GLU ones (centered
+// cube, sphere and torus around the Z axis, cylinder along +Z). They only
+// need a GL context, not a GLUT window, so the same models also render
+// offscreen, and they can be captured into CPU meshes.
+void solidCube(float size) {
+    float h = size * 0.5f;
+
+    emitBegin(GL_QUADS);
+    emitNormal(1.0f, 0.0f, 0.0f);
+    emitVertex(h, -h, -h); emitVertex(h, h, -h); emitVertex(h, h, h); emitVertex(h, -h, h);
+    emitNormal(-1.0f, 0.0f, 0.0f);
+    emitVertex(-h, -h, -h); emitVertex(-h, -h, h); emitVertex(-h, h, h); emitVertex(-h, h, -h);
+    emitNormal(0.0f, 1.0f, 0.0f);
+    emitVertex(-h, h, -h); emitVertex(-h, h, h); emitVertex(h, h, h); emitVertex(h, h, -h);
+    emitNormal(0.0f, -1.0f, 0.0f);
+    emitVertex(-h, -h, -h); emitVertex(h, -h, -h); emitVertex(h, -h, h); emitVertex(-h, -h, h);
+    emitNormal(0.0f, 0.0f, 1.0f);
+    emitVertex(-h, -h, h); emitVertex(h, -h, h); emitVertex(h, h, h); emitVertex(-h, h, h);
+    emitNormal(0.0f, 0.0f, -1.0f);
+    emitVertex(-h, -h, -h); emitVertex(-h, h, -h); emitVertex(h, h, -h); emitVertex(h, -h, -h);
+    emitEnd();
+}
+
+void solidSphere(float radius, int slices, int stacks) {
+    slices = detailSegments(slices);
+    stacks = detailSegments(stacks);
+
+    for (int i = 0; i < stacks; ++i) {
+        float phi0 = PI * i / stacks;
+        float phi1 = PI * (i + 1) / stacks;
+        float z0 = cosf(phi0), r0 = sinf(phi0);
+        float z1 = cosf(phi1), r1 = sinf(phi1);
+
+        emitBegin(GL_QUAD_STRIP);
+        for (int j = 0; j <= slices; ++j) {
+            float theta = 2.0f * PI * j / slices;
+            float c = cosf(theta), s = sinf(theta);
+
+            emitNormal(c * r0, s * r0, z0);
+            emitVertex(c * r0 * radius, s * r0 * radius, z0 * radius);
+            emitNormal(c * r1, s * r1, z1);
+            emitVertex(c * r1 * radius, s * r1 * radius, z1 * radius);
+        }
+        emitEnd();
+    }
+}
+
+void solidTorus(float innerRadius, float outerRadius, int sides, int rings) {
+    sides = detailSegments(sides);
+    rings = detailSegments(rings);
+
+    for (int i = 0; i < rings; ++i) {
+        float theta0 = 2.0f * PI * i / rings;
+        float theta1 = 2.0f * PI * (i + 1) / rings;
+        float c0 = cosf(theta0), s0 = sinf(theta0);
+        float c1 = cosf(theta1), s1 = sinf(theta1);
+
+        emitBegin(GL_QUAD_STRIP);
+        for (int j = 0; j <= sides; ++j) {
+            float phi = 2.0f * PI * j / sides;
+            float cp = cosf(phi), sp = sinf(phi);
+            float dist = outerRadius + innerRadius * cp;
+
+            emitNormal(c0 * cp, s0 * cp, sp);
+            emitVertex(c0 * dist, s0 * dist, innerRadius * sp);
+            emitNormal(c1 * cp, s1 * cp, sp);
+            emitVertex(c1 * dist, s1 * dist, innerRadius * sp);
+        }
+        emitEnd();
+    }
+}
+
+// Open cylinder from z = 0 to z = height, like gluCylinder
+void solidCylinder(float baseRadius, float topRadius, float height, int slices, int stacks) {
+    slices = detailSegments(slices);
+    stacks = detailSegments(stacks);
+
+    // Side normal tilts when the radius changes along the axis
+    float slope = (baseRadius - topRadius) / height;
+    float nLen = sqrtf(1.0f + slope * slope);
+
+    for (int i = 0; i < stacks; ++i) {
+        float t0 = (float)i / stacks, t1 = (float)(i + 1) / stacks;
+        float z0 = height * t0, z1 = height * t1;
+        float rad0 = baseRadius + (topRadius - baseRadius) * t0;
+        float rad1 = baseRadius + (topRadius - baseRadius) * t1;
+
+        emitBegin(GL_QUAD_STRIP);
+        for (int j = 0; j <= slices; ++j) {
+            float theta = 2.0f * PI * j / slices;
+            float c = cosf(theta), s = sinf(theta);
+
+            emitNormal(c / nLen, s / nLen, slope / nLen);
+            emitVertex(c * rad1, s * rad1, z1);
+            emitVertex(c * rad0, s * rad0, z0);
+        }
+        emitEnd();
+    }
+}
+
+// =========================
+// Drawing helpers
+// =========================
+
+// Camera view matrix for the frame being drawn
+Mat4 frameView = Mat4::identity();
+
+// Deep water blue: the clear color, and what the shaded path fogs toward
+const GLfloat WATER_COLOR[] = { 0.0f, 0.0f, 0.15f };
+
+// Soft bluish ambient light to feel underwater
+const MaterialState SCENE_MATERIAL = {
+    { 0.1f, 0.15f, 0.25f, 1.0f },
+    { 0.4f, 0.5f, 0.8f, 1.0f },
+    { 0.8f, 0.9f, 1.0f, 1.0f },
+    50.0f
+};
+
+const GLfloat LIGHT_DIFFUSE[] = { 0.6f, 0.7f, 1.0f, 1.0f };
+const GLfloat LIGHT_POSITION[] = { 0.0f, 5.0f, 0.0f, 1.0f }; // overhead
+const GLfloat LIGHT_MODEL_AMBIENT[] = { 0.2f, 0.2f, 0.2f, 1.0f }; // GL's default
+
+// Constant, so after the first frame only a moved camera re-sends anything
+void setupLights() {
+    ProfileScope prof("setupLights");
+
+    setMaterial(SCENE_MATERIAL);
+    setLightPosition(LIGHT_POSITION, frameView);
+    setLightDiffuse(LIGHT_DIFFUSE);
+}
+
+// =========================
+// View frustum
+// =========================
+
+// Six inward-facing planes (nx, ny, nz, d) in world space, built from the
+// camera vectors and the same projection as setupCamera()
+struct Frustum {
+    float planes[6][4];
+    Vector3f eye, forward;
+    float tanHalfFovX, tanHalfFovY;
+};
+
+Frustum viewFrustum;
+
+void setFrustumPlane(int i, float nx, float ny, float nz, const Vector3f& p) {
+    float len = sqrtf(nx * nx + ny * ny + nz * nz);
+    nx /= len; ny /= len; nz /= len;
+    viewFrustum.planes[i][0] = nx;
+    viewFrustum.planes[i][1] = ny;
+    viewFrustum.planes[i][2] = nz;
+    viewFrustum.planes[i][3] = -(nx * p.x + ny * p.y + nz * p.z);
+}
+
+void buildViewFrustum(const Mat4& view, const Vector3f& eye) {
+    // Rows of the view matrix are the camera's right, up and -forward axes
+    Vector3f r(view.m[0], view.m[4], view.m[8]);
+    Vector3f u(view.m[1], view.m[5], view.m[9]);
+    Vector3f f(-view.m[2], -view.m[6], -view.m[10]);
+
+    float tv = tanf(DEG2RAD(CAMERA_FOVY) * 0.5f);
+    float th = tv * viewportW / viewportH;
+
+    Vector3f nearPoint = eye + f * CAMERA_NEAR;
+    Vector3f farPoint = eye + f * CAMERA_FAR;
+
+    setFrustumPlane(0, f.x, f.y, f.z, nearPoint);
+    setFrustumPlane(1, -f.x, -f.y, -f.z, farPoint);
+    setFrustumPlane(2, f.x * th + r.x, f.y * th + r.y, f.z * th + r.z, eye);   // left
+    setFrustumPlane(3, f.x * th - r.x, f.y * th - r.y, f.z * th - r.z, eye);   // right
+    setFrustumPlane(4, f.x * tv + u.x, f.y * tv + u.y, f.z * tv + u.z, eye);   // bottom
+    setFrustumPlane(5, f.x * tv - u.x, f.y * tv - u.y, f.z * tv - u.z, eye);   // top
+
+    viewFrustum.eye = eye;
+    viewFrustum.forward = f;
+    viewFrustum.tanHalfFovX = th;
+    viewFrustum.tanHalfFovY = tv;
+}
+
+bool sphereInFrustum(float x, float y, float z, float radius) {
+    for (int i = 0; i < 6; ++i) {
+        const float* p = viewFrustum.planes[i];
+        if (p[0] * x + p[1] * y + p[2] * z + p[3] < -radius) return false;
+    }
+    return true;
+}
+
+// Distance of a point in front of the camera along the view direction
+float viewDepth(float x, float y, float z) {
+    const Frustum& fr = viewFrustum;
+    return (x - fr.eye.x) * fr.forward.x + (y - fr.eye.y) * fr.forward.y + (z - fr.eye.z) * fr.forward.z;
+}
+
+// View depth in [0, CAMERA_FAR] scaled to a `bits`-wide sort key
+unsigned int quantizeDepth(float depth, int bits) {
+    float t = clampf(depth / CAMERA_FAR, 0.0f, 1.0f);
+    return (unsigned int)(t * ((1 << bits) - 1));
+}
+
+// Orbit driven by the offscreen benchmark instead of the game camera
+Camera offscreenCamera;
+
+void setupCamera() {
+    ProfileScope prof("setupCamera");
+
+    setMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(CAMERA_FOVY, (double)viewportW / viewportH, CAMERA_NEAR, CAMERA_FAR);
+
+    const Camera& cam = offscreenActive ? offscreenCamera : scene->camera;
+    setMatrixMode(GL_MODELVIEW);
+    frameView = cam.viewMatrix();
+    glLoadMatrixf(frameView.m);
+
+    buildViewFrustum(frameView, cam.eye);
+}
+
+// Objects carry precomputed world matrices, so each draw replaces the
+// modelview with view * world instead of pushing a transform chain
+void loadWorldMatrix(const Mat4& world) {
+    Mat4 modelView = frameView * world;
+    glLoadMatrixf(modelView.m);
+}
+
+void loadViewMatrix() {
+    glLoadMatrixf(frameView.m);
+}
+
+// Seafloor geometry
+void drawFloorModel() {
+    glPushMatrix();
+    setColor(0.1f, 0.2f, 0.25f); // dark sand/rocky floor
+    glTranslatef(0.0f, GROUND_Y - 0.01f, 0.0f);
+    glScalef(worldHalfSize * 2.0f, 0.02f, worldHalfSize * 2.0f);
+    solidCube(1.0f);
+    glPopMatrix();
+}
+
+// Boundary wall geometry; color is set by drawWalls() so it can pulse
+void drawWallsModel() {
+    float thickness = 0.2f;
+    float height = 2.5f;
+
+    // +Z wall
+    glPushMatrix();
+    glTranslatef(0.0f, height / 2.0f, worldHalfSize);
+    glScalef(worldHalfSize * 2.0f, height, thickness);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // -Z wall
+    glPushMatrix();
+    glTranslatef(0.0f, height / 2.0f, -worldHalfSize);
+    glScalef(worldHalfSize * 2.0f, height, thickness);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // +X wall
+    glPushMatrix();
+    glTranslatef(worldHalfSize, height / 2.0f, 0.0f);
+    glScalef(thickness, height, worldHalfSize * 2.0f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // -X wall
+    glPushMatrix();
+    glTranslatef(-worldHalfSize, height / 2.0f, 0.0f);
+    glScalef(thickness, height, worldHalfSize * 2.0f);
+    solidCube(1.0f);
+    glPopMatrix();
+}
+
+// Diver model: ≥6 primitives
+void drawDiverModel() {
+    // Suit torso
+    glPushMatrix();
+    setColor(0.15f, 0.4f, 0.8f);
+    glTranslatef(0.0f, 0.5f, 0.0f);
+    glScalef(0.4f, 0.6f, 0.25f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Helmet (head)
+    glPushMatrix();
+    setColor(0.8f, 0.9f, 1.0f);
+    glTranslatef(0.0f, 0.95f, 0.05f);
+    solidSphere(0.18f, 20, 20);
+    glPopMatrix();
+
+    // Left arm
+    glPushMatrix();
+    setColor(0.15f, 0.4f, 0.8f);
+    glTranslatef(-0.3f, 0.5f, 0.0f);
+    glScalef(0.15f, 0.5f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Right arm
+    glPushMatrix();
+    setColor(0.15f, 0.4f, 0.8f);
+    glTranslatef(0.3f, 0.5f, 0.0f);
+    glScalef(0.15f, 0.5f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Left leg
+    glPushMatrix();
+    setColor(0.05f, 0.2f, 0.5f);
+    glTranslatef(-0.12f, 0.15f, 0.0f);
+    glScalef(0.15f, 0.5f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Right leg
+    glPushMatrix();
+    setColor(0.05f, 0.2f, 0.5f);
+    glTranslatef(0.12f, 0.15f, 0.0f);
+    glScalef(0.15f, 0.5f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+}
+
+// Oxygen core goal: ≥3 primitives, continuous animation
+void drawOxygenCoreModel() {
+    // Glowing center
+    glPushMatrix();
+    setColor(0.1f, 1.0f, 0.9f);
+    solidSphere(0.25f, 20, 20);
+    glPopMatrix();
+
+    // Ring 1
+    glPushMatrix();
+    setColor(0.2f, 0.8f, 0.9f);
+    glRotatef(90, 1, 0, 0);
+    solidTorus(0.02f, 0.35f, 20, 20);
+    glPopMatrix();
+
+    // Ring 2
+    glPushMatrix();
+    setColor(0.2f, 0.8f, 0.9f);
+    glRotatef(90, 0, 0, 1);
+    solidTorus(0.02f, 0.35f, 20, 20);
+    glPopMatrix();
+}
+
+// Major object A: Floodlight tower (≥5 primitives)
+void drawFloodlightTower() {
+    // Base platform
+    glPushMatrix();
+    setColor(0.2f, 0.6f, 0.7f);
+    glScalef(0.7f, 0.1f, 0.7f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Vertical pole
+    glPushMatrix();
+    setColor(0.15f, 0.4f, 0.5f);
+    glTranslatef(0.0f, 0.7f, 0.0f);
+    glScalef(0.15f, 1.4f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Light arm
+    glPushMatrix();
+    setColor(0.3f, 0.7f, 0.9f);
+    glTranslatef(0.0f, 1.2f, 0.2f);
+    glScalef(0.8f, 0.1f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Light head 1
+    glPushMatrix();
+    setColor(0.9f, 0.95f, 1.0f);
+    glTranslatef(-0.25f, 1.2f, 0.35f);
+    solidSphere(0.09f, 16, 16);
+    glPopMatrix();
+
+    // Light head 2
+    glPushMatrix();
+    setColor(0.9f, 0.95f, 1.0f);
+    glTranslatef(0.25f, 1.2f, 0.35f);
+    solidSphere(0.09f, 16, 16);
+    glPopMatrix();
+}
+
+// Major object B: Sonar / comms array (≥5 primitives)
+void drawSonarArray() {
+    // Mast
+    glPushMatrix();
+    setColor(0.4f, 0.4f, 0.5f);
+    glTranslatef(0.0f, 0.6f, 0.0f);
+    glScalef(0.15f, 1.2f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Horizontal boom
+    glPushMatrix();
+    setColor(0.2f, 0.3f, 0.4f);
+    glTranslatef(0.0f, 1.1f, 0.0f);
+    glScalef(1.4f, 0.08f, 0.15f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Dish 1
+    glPushMatrix();
+    setColor(0.1f, 0.5f, 0.8f);
+    glTranslatef(-0.55f, 1.1f, 0.0f);
+    glScalef(0.6f, 0.2f, 0.4f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Dish 2
+    glPushMatrix();
+    setColor(0.1f, 0.5f, 0.8f);
+    glTranslatef(0.55f, 1.1f, 0.0f);
+    glScalef(0.6f, 0.2f, 0.4f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Control module
+    glPushMatrix();
+    setColor(0.5f, 0.6f, 0.7f);
+    glTranslatef(0.0f, 0.3f, 0.0f);
+    glScalef(0.5f, 0.25f, 0.5f);
+    solidCube(1.0f);
+    glPopMatrix();
+}
+
+// Regular object A: Supply crate cluster (≥3 primitives)
+void drawSupplyCrates() {
+    // Main crate
+    glPushMatrix();
+    setColor(0.45f, 0.3f, 0.2f);
+    glScalef(0.5f, 0.4f, 0.5f);
+    solidCube(1.0f);
+    glPopMatrix();
 
     // Crate 2
     glPushMatrix();
-    glColor3f(0.6f, 0.45f, 0.3f);
-    glTranslatef(0.4f, 0.2f, 0.2f);
-    glScalef(0.3f, 0.3f, 0.3f);
-    glutSolidCube(1.0);
+    setColor(0.6f, 0.45f, 0.3f);
+    glTranslatef(0.4f, 0.2f, 0.2f);
+    glScalef(0.3f, 0.3f, 0.3f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Crate 3
+    glPushMatrix();
+    setColor(0.6f, 0.45f, 0.3f);
+    glTranslatef(-0.4f, 0.2f, -0.2f);
+    glScalef(0.3f, 0.3f, 0.3f);
+    solidCube(1.0f);
+    glPopMatrix();
+}
+
+// Regular object B: Repair drone (≥3 primitives)
+void drawRepairDrone() {
+    // Body
+    glPushMatrix();
+    setColor(0.7f, 0.7f, 0.9f);
+    glScalef(0.4f, 0.15f, 0.4f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Sensor eye
+    glPushMatrix();
+    setColor(0.1f, 0.9f, 0.9f);
+    glTranslatef(0.0f, 0.0f, 0.25f);
+    solidSphere(0.07f, 16, 16);
+    glPopMatrix();
+
+    // Rotor
+    glPushMatrix();
+    setColor(0.4f, 0.4f, 0.4f);
+    glTranslatef(0.2f, 0.1f, 0.2f);
+    glScalef(0.2f, 0.02f, 0.2f);
+    solidCube(1.0f);
+    glPopMatrix();
+}
+
+// Regular object C: Oxygen tank cluster (≥3 primitives)
+void drawOxygenTanks() {
+    // Base
+    glPushMatrix();
+    setColor(0.2f, 0.2f, 0.25f);
+    glScalef(0.7f, 0.05f, 0.7f);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Three tanks
+    glPushMatrix();
+    setColor(0.1f, 0.6f, 0.3f);
+    glTranslatef(-0.2f, 0.3f, 0.0f);
+    solidCylinder(0.12f, 0.12f, 0.8f, 20, 20);
+    glTranslatef(0.0f, 0.0f, 0.8f);
+    solidSphere(0.12f, 16, 16);
+    glPopMatrix();
+
+    glPushMatrix();
+    setColor(0.1f, 0.7f, 0.4f);
+    glTranslatef(0.0f, 0.3f, 0.0f);
+    solidCylinder(0.12f, 0.12f, 0.8f, 20, 20);
+    glTranslatef(0.0f, 0.0f, 0.8f);
+    solidSphere(0.12f, 16, 16);
+    glPopMatrix();
+
+    glPushMatrix();
+    setColor(0.1f, 0.6f, 0.3f);
+    glTranslatef(0.2f, 0.3f, 0.0f);
+    solidCylinder(0.12f, 0.12f, 0.8f, 20, 20);
+    glTranslatef(0.0f, 0.0f, 0.8f);
+    solidSphere(0.12f, 16, 16);
+    glPopMatrix();
+}
+
+// =========================
+// Mesh cache (display lists)
+// =========================
+
+// Every model is static geometry in its own local space, so it is compiled
+// once into a display list and replayed with a single glCallList per object
+// instead of re-tessellating the spheres/tori/cylinders every frame.
+enum MeshId {
+    MESH_FLOOR,
+    MESH_WALLS,
+    MESH_DIVER,
+    MESH_CORE,
+    MESH_TOWER,
+    MESH_SONAR,
+    MESH_CRATES,
+    MESH_DRONE,
+    MESH_TANKS,
+    NUM_MESHES
+};
+
+typedef void (*MeshBuildFunc)();
+
+const MeshBuildFunc meshBuilders[NUM_MESHES] = {
+    drawFloorModel,
+    drawWallsModel,
+    drawDiverModel,
+    drawOxygenCoreModel,
+    drawFloodlightTower,
+    drawSonarArray,
+    drawSupplyCrates,
+    drawRepairDrone,
+    drawOxygenTanks
+};
+
+// Levels of detail: curved primitives use this fraction of their segments
+const int   NUM_LODS = 3;
+const float LOD_DETAIL[NUM_LODS] = { 1.0f, 0.5f, 0.25f };
+
+GLuint meshLists[NUM_MESHES][NUM_LODS];
+bool   useMeshCache = true;   // false = immediate mode, for frame time A/B ('m')
+
+// CPU copies of every model (triangles) for the buffer-based renderers
+std::vector<MeshVertex> meshVertices[NUM_MESHES][NUM_LODS];
+int meshTriangles[NUM_MESHES][NUM_LODS];
+
+// Bounding sphere centered on the model's Y axis, so it stays valid under
+// any yaw: center (0, centerY, 0) in model space
+struct MeshBounds {
+    float centerY;
+    float radius;
+};
+
+MeshBounds meshBounds[NUM_MESHES];
+
+void computeMeshBounds(int id) {
+    const std::vector<MeshVertex>& mesh = meshVertices[id][0];
+    float minY = 0.0f, maxY = 0.0f;
+    for (size_t v = 0; v < mesh.size(); ++v) {
+        if (v == 0 || mesh[v].pos[1] < minY) minY = mesh[v].pos[1];
+        if (v == 0 || mesh[v].pos[1] > maxY) maxY = mesh[v].pos[1];
+    }
+
+    float cy = (minY + maxY) * 0.5f;
+    float r2 = 0.0f;
+    for (size_t v = 0; v < mesh.size(); ++v) {
+        const float* p = mesh[v].pos;
+        float d2 = p[0] * p[0] + (p[1] - cy) * (p[1] - cy) + p[2] * p[2];
+        if (d2 > r2) r2 = d2;
+    }
+
+    meshBounds[id].centerY = cy;
+    meshBounds[id].radius = sqrtf(r2);
+}
+
+void buildMeshCache() {
+    GLuint base = acquireDisplayLists(NUM_MESHES * NUM_LODS);
+    setMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+
+    for (int i = 0; i < NUM_MESHES; ++i) {
+        for (int lod = 0; lod < NUM_LODS; ++lod) {
+            shapeDetail = LOD_DETAIL[lod];
+
+            meshLists[i][lod] = (base != 0) ? base + i * NUM_LODS + lod : 0;
+            // Compiling runs none of the calls: the list must start from
+            // an unknown color, and the real color is unknown after it
+            if (meshLists[i][lod] != 0) {
+                invalidateColor();
+                glNewList(meshLists[i][lod], GL_COMPILE);
+                meshBuilders[i]();
+                glEndList();
+                invalidateColor();
+            }
+
+            glLoadIdentity();
+            setColor(1.0f, 1.0f, 1.0f);
+
+            meshVertices[i][lod].clear();
+            beginShapeCapture(&meshVertices[i][lod]);
+            meshBuilders[i]();
+            endShapeCapture();
+            meshTriangles[i][lod] = (int)meshVertices[i][lod].size() / 3;
+        }
+        computeMeshBounds(i);
+    }
+
+    shapeDetail = 1.0f;
     glPopMatrix();
+}
+
+// =========================
+// Culling and level of detail
+// =========================
+
+bool useCulling = true;   // --no-cull draws everything at full detail
+bool useRenderSort = true;   // false = draw in submission order ('f', --no-sort)
+
+// Screen-space radius (pixels) above which each LOD is used
+const float LOD_PIXELS[NUM_LODS - 1] = { 80.0f, 25.0f };
+
+// LOD for a mesh placed at (x, y, z), or -1 when it is outside the frustum.
+// Reads only the frustum, so job chunks can call it concurrently.
+int meshLod(MeshId id, float x, float y, float z) {
+    if (!useCulling) return 0;
+
+    const MeshBounds& b = meshBounds[id];
+    float cy = y + b.centerY;
+    if (!sphereInFrustum(x, cy, z, b.radius)) return -1;
+
+    // Projected radius from the distance along the view direction
+    const Frustum& fr = viewFrustum;
+    float depth = (x - fr.eye.x) * fr.forward.x + (cy - fr.eye.y) * fr.forward.y + (z - fr.eye.z) * fr.forward.z;
+    if (depth < CAMERA_NEAR) return 0;
+
+    float pixels = b.radius / (depth * fr.tanHalfFovY) * (viewportH * 0.5f);
+    int lod = 0;
+    while (lod < NUM_LODS - 1 && pixels < LOD_PIXELS[lod]) ++lod;
+    return lod;
+}
+
+// meshLod() plus the frame counters
+int selectLod(MeshId id, float x, float y, float z) {
+    int lod = meshLod(id, x, y, z);
+    if (lod < 0) ++frameStats.objectsCulled;
+    else ++frameStats.objectsDrawn;
+    return lod;
+}
+
+// Replay a cached model, or tessellate it in place when the cache is off
+void drawMesh(MeshId id, int lod = 0) {
+    frameStats.triangles += meshTriangles[id][lod];
+    ++frameStats.drawCalls;
+
+    if (useMeshCache && meshLists[id][lod] != 0) {
+        glCallList(meshLists[id][lod]);
+        invalidateColor();
+    }
+    else {
+        shapeDetail = LOD_DETAIL[lod];
+        meshBuilders[id]();
+        shapeDetail = 1.0f;
+    }
+}
+
+// =========================
+// Scene objects
+// =========================
+
+// Seafloor
+void drawFloor() {
+    ProfileScope prof("drawFloor");
+    loadViewMatrix();
+    drawMesh(MESH_FLOOR);
+}
+
+// Boundary walls with animated lights (glowing perimeter of base)
+void applyWallColor() {
+    float phase = scene->wallColorPhase;
+    float r = 0.2f + 0.2f * sinf(phase);
+    float g = 0.4f + 0.3f * sinf(phase + 2.0f);
+    float b = 0.7f + 0.3f * sinf(phase + 4.0f);
+
+    setColor(r, g, b);
+}
+
+void drawWalls() {
+    ProfileScope prof("drawWalls");
+    applyWallColor();
+    loadViewMatrix();
+    drawMesh(MESH_WALLS);
+}
+
+// Facing snaps, so only the position of the tick matrix is interpolated
+void drawDiver(int lod) {
+    ProfileScope prof("drawDiver");
+
+    Vector3f pos = renderDiverPos();
+    Mat4 world = scene->diver.world;
+    world.m[12] = pos.x;
+    world.m[13] = pos.y;
+    world.m[14] = pos.z;
+    loadWorldMatrix(world);
+    drawMesh(MESH_DIVER, lod);
+}
+
+// Always spinning, so its matrix is built per frame from the interpolated angle
+void drawOxygenCore(int lod) {
+    ProfileScope prof("drawOxygenCore");
+
+    const Goal& core = scene->core;
+    Mat4 world = Mat4::rotationY(renderSpinAngle());
+    world.m[12] = core.pos.x;
+    world.m[13] = core.pos.y;
+    world.m[14] = core.pos.z;
+    loadWorldMatrix(world);
+    drawMesh(MESH_CORE, lod);
+}
+
+// How each environment type is placed and animated from its animParam
+struct EnvTypeInfo {
+    MeshId mesh;
+    float  liftY;      // fixed height above the object position
+    float  bobAmp;     // vertical bob: bobAmp * sin(animParam)
+    float  yawScale;   // yaw in degrees: yawScale * animParam
+};
+
+const EnvTypeInfo envTypeInfo[NUM_ENV_TYPES] = {
+    { MESH_TOWER,  0.0f, 0.00f, 1.0f },   // floodlight tower: rotate slowly in Y to scan
+    { MESH_SONAR,  0.0f, 0.00f, 1.0f },   // sonar array: rotating comms
+    { MESH_CRATES, 0.0f, 0.08f, 0.0f },   // supply crates: gentle bobbing
+    { MESH_DRONE,  0.4f, 0.00f, 1.0f },   // repair drone: rotating drone
+    { MESH_TANKS,  0.0f, 0.05f, 0.5f }    // oxygen tanks: small bob + rotation
+};
+
+// =========================
+// World transforms
+// =========================
+
+// World matrices are rebuilt on the simulation side only when their inputs
+// change: the diver when it moves, and environment objects while they
+// animate or after being placed. Paused objects, the floor and the walls
+// are never recomputed. Objects that moved between the last two ticks get
+// an interpolated matrix per frame (prepareEnvRenderWorlds).
+
+void updateDiverWorld() {
+    diver.world = Mat4::translation(diver.pos.x, diver.pos.y, diver.pos.z) *
+        Mat4::rotationY(diver.rotY) * Mat4::rotationX(diver.rotX);
+}
+
+// Translation holds the lifted, bobbing position, so culling reads it
+// straight from m[12..14]
+void buildEnvWorld(const EnvObjectStore& env, int i, float anim, Mat4& w) {
+    const EnvTypeInfo& info = envTypeInfo[env.type[i]];
+    w = info.yawScale != 0.0f ? Mat4::rotationY(anim * info.yawScale) : Mat4::identity();
+    w.m[12] = env.posX[i];
+    w.m[13] = env.posY[i] + info.liftY + info.bobAmp * sinf(anim);
+    w.m[14] = env.posZ[i];
+}
+
+void updateWorldMatrixRange(int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+        if (envStore.running[i] != 0.0f || envStore.worldDirty[i]) {
+            buildEnvWorld(envStore, i, envStore.animParam[i], envStore.world[i]);
+            envStore.worldDirty[i] = 0;
+        }
+    }
+}
+
+void updateWorldMatrices() {
+    updateWorldMatrixRange(0, envStore.count);
+}
+
+// Objects per job chunk for the per-object loops; small scenes stay inline
+const int ENV_JOB_GRAIN = 2048;
+
+// Animation and matrices for one slice, while it is still in cache
+void envUpdateJob(void* ctx, int begin, int end, int chunk) {
+    (void)chunk;
+    updateEnvAnimationRange(*(const float*)ctx, begin, end);
+    updateWorldMatrixRange(begin, end);
+}
+
+void updateEnvObjects(float dt) {
+    parallelFor(envStore.count, ENV_JOB_GRAIN, envUpdateJob, &dt);
+}
+
+// Per-frame interpolated matrices for objects that moved last tick
+struct EnvRenderWorlds {
+    std::vector<Mat4>  world;          // grows only
+    std::vector<float> anim;           // interpolated animParam
+    std::vector<unsigned char> moved;  // 1 = use world/anim above
+};
+
+EnvRenderWorlds envRender;
+
+void envRenderWorldJob(void* ctx, int begin, int end, int chunk) {
+    (void)ctx;
+    (void)chunk;
+    for (int i = begin; i < end; ++i) {
+        float anim;
+        bool moved = renderAnimParam(i, anim);
+        envRender.moved[i] = moved ? 1 : 0;
+        if (!moved) continue;
+
+        envRender.anim[i] = anim;
+        buildEnvWorld(scene->env, i, anim, envRender.world[i]);
+    }
+}
+
+void prepareEnvRenderWorlds() {
+    ProfileScope prof("prepareEnvRenderWorlds");
+
+    int n = scene->env.count;
+    if ((int)envRender.moved.size() < n) {
+        envRender.world.resize(n);
+        envRender.anim.resize(n);
+        envRender.moved.resize(n);
+    }
+
+    parallelFor(n, ENV_JOB_GRAIN, envRenderWorldJob, NULL);
+}
+
+const Mat4& envDrawWorld(int i) {
+    return envRender.moved[i] ? envRender.world[i] : scene->env.world[i];
+}
+
+float envDrawAnim(int i) {
+    return envRender.moved[i] ? envRender.anim[i] : scene->env.animParam[i];
+}
+
+// Draw environment object by type, at the LOD cullEnvObjects() picked
+void drawEnvObject(int index, int lod) {
+    loadWorldMatrix(envDrawWorld(index));
+    drawMesh(envTypeInfo[scene->env.type[index]].mesh, lod);
+}
+
+// =========================
+// Static batching
+// =========================
+
+// Everything that does not move -- floor, walls and every paused env
+// object -- baked into world space in one vertex buffer. Env objects are
+// grouped into STATIC_CHUNKS x STATIC_CHUNKS tiles so a tile can still be
+// culled and given a LOD as a whole. The walls carry no vertex color: their
+// pulse is a single glColor per frame. Tiles are rebaked only when one of
+// their objects starts or stops animating, or when objects come and go.
+
+const int STATIC_CHUNKS = 8;
+const int NUM_STATIC_CHUNKS = STATIC_CHUNKS * STATIC_CHUNKS;
+
+struct StaticChunk {
+    std::vector<MeshVertex> vertices[NUM_LODS];
+    GLint first[NUM_LODS];       // offsets into the shared buffer
+    float boundsMin[3], boundsMax[3];
+    float center[3], radius;     // bounding sphere of the baked objects
+    float objectRadius;          // largest member mesh, drives the LOD
+    int   numObjects;
+    bool  dirty;
+};
+
+struct StaticBatch {
+    bool    ready;
+    GLuint  buffer;
+    GLint   floorFirst, wallsFirst;
+    GLsizei floorCount, wallsCount;
+    StaticChunk chunks[NUM_STATIC_CHUNKS];
+    std::vector<unsigned char> baked;   // per object, 1 = in its tile
+    std::vector<MeshVertex> merged;     // upload scratch, grows only
+    unsigned int storeVersion;          // envStore versions at the last bake
+    unsigned int staticVersion;
+    int     rebakes;                    // tiles rebaked since startup
+};
+
+StaticBatch staticBatch;
+bool useStaticBatch = true;   // false = floor, walls and paused objects drawn one by one ('g')
+
+bool staticBatchActive() {
+    return useStaticBatch && staticBatch.ready && useMeshCache;
+}
+
+int staticChunkOf(int i) {
+    const EnvObjectStore& env = scene->env;
+    float span = 2.0f * worldHalfSize;
+    int cx = (int)((env.posX[i] + worldHalfSize) / span * STATIC_CHUNKS);
+    int cz = (int)((env.posZ[i] + worldHalfSize) / span * STATIC_CHUNKS);
+    cx = cx < 0 ? 0 : (cx >= STATIC_CHUNKS ? STATIC_CHUNKS - 1 : cx);
+    cz = cz < 0 ? 0 : (cz >= STATIC_CHUNKS ? STATIC_CHUNKS - 1 : cz);
+    return cz * STATIC_CHUNKS + cx;
+}
+
+// Append object i, transformed by its world matrix, to its tile
+void bakeEnvObject(StaticChunk& chunk, int i) {
+    const EnvObjectStore& env = scene->env;
+    MeshId id = envTypeInfo[env.type[i]].mesh;
+    const float* m = env.world[i].m;
+
+    for (int lod = 0; lod < NUM_LODS; ++lod) {
+        const std::vector<MeshVertex>& mesh = meshVertices[id][lod];
+        std::vector<MeshVertex>& out = chunk.vertices[lod];
+        for (size_t v = 0; v < mesh.size(); ++v) {
+            const float* p = mesh[v].pos;
+            const float* nrm = mesh[v].normal;
+            MeshVertex w;
+            // World matrices are rotation + translation only, so the
+            // normal takes the upper 3x3 as-is
+            for (int k = 0; k < 3; ++k) {
+                w.pos[k] = m[k] * p[0] + m[4 + k] * p[1] + m[8 + k] * p[2] + m[12 + k];
+                w.normal[k] = m[k] * nrm[0] + m[4 + k] * nrm[1] + m[8 + k] * nrm[2];
+                w.color[k] = mesh[v].color[k];
+            }
+            out.push_back(w);
+        }
+    }
+
+    const MeshBounds& b = meshBounds[id];
+    float c[3] = { m[12], m[13] + b.centerY, m[14] };
+    for (int k = 0; k < 3; ++k) {
+        if (chunk.numObjects == 0 || c[k] - b.radius < chunk.boundsMin[k]) chunk.boundsMin[k] = c[k] - b.radius;
+        if (chunk.numObjects == 0 || c[k] + b.radius > chunk.boundsMax[k]) chunk.boundsMax[k] = c[k] + b.radius;
+    }
+    if (chunk.numObjects == 0 || b.radius > chunk.objectRadius) chunk.objectRadius = b.radius;
+    ++chunk.numObjects;
+}
+
+void rebuildStaticBatch() {
+    ProfileScope prof("rebuildStaticBatch");
+
+    const EnvObjectStore& env = scene->env;
+    int n = env.count;
+
+    // Adding or removing objects reshuffles indices, so everything goes;
+    // otherwise only tiles whose objects changed static status
+    if (staticBatch.storeVersion != env.version) {
+        staticBatch.baked.assign(n, 0);
+        for (int c = 0; c < NUM_STATIC_CHUNKS; ++c) staticBatch.chunks[c].dirty = true;
+    }
+    else {
+        for (int i = 0; i < n; ++i) {
+            bool isStatic = env.running[i] == 0.0f;
+            if (isStatic != (staticBatch.baked[i] != 0)) staticBatch.chunks[staticChunkOf(i)].dirty = true;
+        }
+    }
+
+    for (int c = 0; c < NUM_STATIC_CHUNKS; ++c) {
+        StaticChunk& chunk = staticBatch.chunks[c];
+        if (!chunk.dirty) continue;
+        for (int lod = 0; lod < NUM_LODS; ++lod) chunk.vertices[lod].clear();
+        chunk.numObjects = 0;
+        ++staticBatch.rebakes;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        StaticChunk& chunk = staticBatch.chunks[staticChunkOf(i)];
+        if (!chunk.dirty) continue;
+
+        bool isStatic = env.running[i] == 0.0f;
+        staticBatch.baked[i] = isStatic ? 1 : 0;
+        if (isStatic) bakeEnvObject(chunk, i);
+    }
+
+    for (int c = 0; c < NUM_STATIC_CHUNKS; ++c) {
+        StaticChunk& chunk = staticBatch.chunks[c];
+        if (!chunk.dirty) continue;
+        chunk.dirty = false;
+        if (chunk.numObjects == 0) continue;
+
+        float r2 = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            chunk.center[k] = (chunk.boundsMin[k] + chunk.boundsMax[k]) * 0.5f;
+            float h = chunk.boundsMax[k] - chunk.center[k];
+            r2 += h * h;
+        }
+        chunk.radius = sqrtf(r2);
+    }
+
+    // One upload: floor, walls, then every tile's LODs back to back
+    std::vector<MeshVertex>& all = staticBatch.merged;
+    const std::vector<MeshVertex>& floorMesh = meshVertices[MESH_FLOOR][0];
+    const std::vector<MeshVertex>& wallsMesh = meshVertices[MESH_WALLS][0];
+    all.clear();
+    staticBatch.floorFirst = 0;
+    staticBatch.floorCount = (GLsizei)floorMesh.size();
+    all.insert(all.end(), floorMesh.begin(), floorMesh.end());
+    staticBatch.wallsFirst = (GLint)all.size();
+    staticBatch.wallsCount = (GLsizei)wallsMesh.size();
+    all.insert(all.end(), wallsMesh.begin(), wallsMesh.end());
+    for (int c = 0; c < NUM_STATIC_CHUNKS; ++c) {
+        for (int lod = 0; lod < NUM_LODS; ++lod) {
+            const std::vector<MeshVertex>& v = staticBatch.chunks[c].vertices[lod];
+            staticBatch.chunks[c].first[lod] = (GLint)all.size();
+            all.insert(all.end(), v.begin(), v.end());
+        }
+    }
+
+    ext.BindBuffer(GL_ARRAY_BUFFER, staticBatch.buffer);
+    ext.BufferData(GL_ARRAY_BUFFER, all.size() * sizeof(MeshVertex), &all[0], GL_STATIC_DRAW);
+    ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+    staticBatch.storeVersion = env.version;
+    staticBatch.staticVersion = env.staticVersion;
+}
+
+void initStaticBatch() {
+    staticBatch.ready = false;
+    if (!ext.hasBuffers) {
+        printf("Static batching unavailable (GL %d.%d)\n", ext.versionMajor, ext.versionMinor);
+        return;
+    }
+
+    staticBatch.buffer = acquireBuffer();
+    if (staticBatch.buffer == 0) return;
+
+    staticBatch.storeVersion = scene->env.version - 1; // force the first bake
+    staticBatch.ready = true;
+}
+
+// LOD for a whole tile, judged at its center: nearer members get a bit
+// less detail than they would alone and farther ones a bit more
+int selectChunkLod(const StaticChunk& chunk) {
+    if (!useCulling) return 0;
+    if (!sphereInFrustum(chunk.center[0], chunk.center[1], chunk.center[2], chunk.radius)) return -1;
+
+    const Frustum& fr = viewFrustum;
+    float depth = (chunk.center[0] - fr.eye.x) * fr.forward.x + (chunk.center[1] - fr.eye.y) * fr.forward.y +
+        (chunk.center[2] - fr.eye.z) * fr.forward.z;
+    if (depth < CAMERA_NEAR) return 0;
+
+    float pixels = chunk.objectRadius / (depth * fr.tanHalfFovY) * (viewportH * 0.5f);
+    int lod = 0;
+    while (lod < NUM_LODS - 1 && pixels < LOD_PIXELS[lod]) ++lod;
+    return lod;
+}
+
+// Rebake the tiles whose objects changed; call before queueing them
+void updateStaticBatch() {
+    if (staticBatch.storeVersion != scene->env.version || staticBatch.staticVersion != scene->env.staticVersion) {
+        rebuildStaticBatch();
+    }
+}
+
+// The floor, the tiles and the walls are drawn from the one buffer,
+// between beginStaticArrays() and endStaticArrays()
+void beginStaticArrays() {
+    loadViewMatrix();
+    ext.BindBuffer(GL_ARRAY_BUFFER, staticBatch.buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, pos));
+    glNormalPointer(GL_FLOAT, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, normal));
+    glColorPointer(3, GL_FLOAT, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, color));
+}
+
+void drawStaticRange(GLint first, GLsizei count) {
+    glDrawArrays(GL_TRIANGLES, first, count);
+    frameStats.triangles += count / 3;
+    ++frameStats.drawCalls;
+}
+
+// Walls: shared geometry, per-frame color
+void drawStaticWalls() {
+    glDisableClientState(GL_COLOR_ARRAY);
+    invalidateColor();
+    applyWallColor();
+    drawStaticRange(staticBatch.wallsFirst, staticBatch.wallsCount);
+    glEnableClientState(GL_COLOR_ARRAY);
+}
+
+void endStaticArrays() {
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+    invalidateColor();
+}
+
+// =========================
+// Instanced rendering
+// =========================
+
+// Environment objects grouped by type and drawn with one instanced call per
+// type. Each instance is a vec4: position with lift and bob applied, and
+// yaw in degrees. The vertex shader reproduces the fixed-function lighting
+// of setupLights() so both paths look the same.
+const char* INSTANCED_VS =
+    "#version 120\n"
+    "attribute vec3 aPos;\n"
+    "attribute vec3 aNormal;\n"
+    "attribute vec3 aColor;\n"
+    "attribute vec4 aInstance;\n"
+    "varying vec3 vColor;\n"
+    "void main() {\n"
+    "    float a = radians(aInstance.w);\n"
+    "    float c = cos(a), s = sin(a);\n"
+    "    vec3 p = vec3(c * aPos.x + s * aPos.z, aPos.y, -s * aPos.x + c * aPos.z) + aInstance.xyz;\n"
+    "    vec3 n = vec3(c * aNormal.x + s * aNormal.z, aNormal.y, -s * aNormal.x + c * aNormal.z);\n"
+    "    vec4 eyePos = gl_ModelViewMatrix * vec4(p, 1.0);\n"
+    "    vec3 N = normalize(gl_NormalMatrix * n);\n"
+    "    vec3 L = normalize(gl_LightSource[0].position.xyz - eyePos.xyz);\n"
+    "    float diff = max(dot(N, L), 0.0);\n"
+    "    float spec = 0.0;\n"
+    "    if (diff > 0.0) {\n"
+    "        vec3 H = normalize(L + vec3(0.0, 0.0, 1.0));\n"
+    "        spec = pow(max(dot(N, H), 0.0), gl_FrontMaterial.shininess);\n"
+    "    }\n"
+    "    vColor = aColor * (gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb)\n"
+    "           + aColor * gl_LightSource[0].diffuse.rgb * diff\n"
+    "           + gl_FrontMaterial.specular.rgb * gl_LightSource[0].specular.rgb * spec;\n"
+    "    gl_Position = gl_ProjectionMatrix * eyePos;\n"
+    "}\n";
+
+const char* INSTANCED_FS =
+    "#version 120\n"
+    "varying vec3 vColor;\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4(vColor, 1.0);\n"
+    "}\n";
+
+enum InstancedAttrib {
+    ATTRIB_POS,
+    ATTRIB_NORMAL,
+    ATTRIB_COLOR,
+    ATTRIB_INSTANCE
+};
+
+// Instances are bucketed by (type, LOD); bucket = type * NUM_LODS + lod
+const int NUM_INSTANCE_BUCKETS = NUM_ENV_TYPES * NUM_LODS;
+
+struct InstancedRenderer {
+    bool    ready;
+    GLuint  program;
+    GLuint  meshBuffer;         // every env type mesh and LOD back to back
+    GLuint  instanceBuffer;
+    GLint   firstVertex[NUM_INSTANCE_BUCKETS];
+    GLsizei vertexCount[NUM_INSTANCE_BUCKETS];
+    int     bucketStart[NUM_INSTANCE_BUCKETS];
+    int     bucketCount[NUM_INSTANCE_BUCKETS];
+    int     numInstances;                 // visible instances this frame
+    std::vector<float> instanceData;      // grouped by bucket, grows only
+    std::vector<float> sortedData;        // depth sort scratch, grows only
+    std::vector<uint64_t> sortKeys, sortScratch;
+};
+
+InstancedRenderer instancing;
+bool useInstancing = true;   // false = one transform + glCallList per object ('n')
+
+// Per-object visibility for the frame, used by both env object paths.
+// Job chunks count their own buckets and the counts are merged in chunk
+// order, so instances come out in the same order as a serial pass.
+struct EnvVisibility {
+    std::vector<signed char> bucketOf;    // per object, -1 = culled or batched
+    std::vector<float> eyeDistSq;         // per object, scratch for the reach test
+    std::vector<int> drawOrder;           // visible objects by bucket, grows only
+    int chunks;
+    int chunkBucket[MAX_JOB_CHUNKS][NUM_INSTANCE_BUCKETS];  // counts, then write cursors
+    int chunkDrawn[MAX_JOB_CHUNKS];
+    int chunkCulled[MAX_JOB_CHUNKS];
+};
+
+EnvVisibility envVis;
+
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = ext.CreateShader(type);
+    ext.ShaderSource(shader, 1, &source, NULL);
+    ext.CompileShader(shader);
+
+    GLint status = 0;
+    ext.GetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        ext.GetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("Shader compile failed:\n%s\n", log);
+        ext.DeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Link a program from sources; attribute names are bound to locations
+// 0..numAttribs-1 in order. Returns 0 on failure.
+GLuint buildProgram(const char* vs, const char* fs, const char* const* attribs, int numAttribs) {
+    GLuint v = compileShader(GL_VERTEX_SHADER, vs);
+    GLuint f = compileShader(GL_FRAGMENT_SHADER, fs);
+    if (!v || !f) {
+        if (v) ext.DeleteShader(v);
+        if (f) ext.DeleteShader(f);
+        return 0;
+    }
+
+    GLuint program = ext.CreateProgram();
+    ext.AttachShader(program, v);
+    ext.AttachShader(program, f);
+    for (int i = 0; i < numAttribs; ++i) {
+        ext.BindAttribLocation(program, i, attribs[i]);
+    }
+    ext.LinkProgram(program);
+    ext.DeleteShader(v);
+    ext.DeleteShader(f);
+
+    GLint status = 0;
+    ext.GetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        ext.GetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("Shader link failed:\n%s\n", log);
+        ext.DeleteProgram(program);
+        return 0;
+    }
+
+    adoptProgram(program);
+    return program;
+}
+
+// Needs the mesh cache; leaves instancing.ready false when unsupported
+void initInstancedRenderer() {
+    instancing.ready = false;
+    if (!ext.hasInstancing) {
+        printf("Instancing unavailable (GL %d.%d), using fixed-function path\n",
+            ext.versionMajor, ext.versionMinor);
+        return;
+    }
+
+    const char* attribs[] = { "aPos", "aNormal", "aColor", "aInstance" };
+    instancing.program = buildProgram(INSTANCED_VS, INSTANCED_FS, attribs, 4);
+    if (!instancing.program) return;
+
+    // Concatenate the env type meshes (all LODs) into one static buffer
+    std::vector<MeshVertex> all;
+    for (int t = 0; t < NUM_ENV_TYPES; ++t) {
+        for (int lod = 0; lod < NUM_LODS; ++lod) {
+            const std::vector<MeshVertex>& mesh = meshVertices[envTypeInfo[t].mesh][lod];
+            int bucket = t * NUM_LODS + lod;
+            instancing.firstVertex[bucket] = (GLint)all.size();
+            instancing.vertexCount[bucket] = (GLsizei)mesh.size();
+            all.insert(all.end(), mesh.begin(), mesh.end());
+        }
+    }
+
+    instancing.meshBuffer = acquireBuffer();
+    instancing.instanceBuffer = acquireBuffer();
+    ext.BindBuffer(GL_ARRAY_BUFFER, instancing.meshBuffer);
+    ext.BufferData(GL_ARRAY_BUFFER, all.size() * sizeof(MeshVertex), &all[0], GL_STATIC_DRAW);
+    ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+    instancing.ready = true;
+}
+
+struct EnvCullParams {
+    bool  skipStatic;
+    float reachSq;      // squared; 0 when culling is off
+};
+
+// Farthest an object's position can be from the eye and still pass
+// meshLod()'s plane tests: the frustum's far corners plus the largest
+// bounding sphere, lifted by the largest lift, bob and mesh center offset
+float envCullReach() {
+    float radius = 0.0f, offset = 0.0f;
+    for (int t = 0; t < NUM_ENV_TYPES; ++t) {
+        const MeshBounds& b = meshBounds[envTypeInfo[t].mesh];
+        radius = fmaxf(radius, b.radius);
+        offset = fmaxf(offset, fabsf(b.centerY) + fabsf(envTypeInfo[t].liftY) + fabsf(envTypeInfo[t].bobAmp));
+    }
+
+    const Frustum& fr = viewFrustum;
+    float th = fr.tanHalfFovX, tv = fr.tanHalfFovY;
+    float corner = sqrtf(1.0f + th * th + tv * tv);
+    float sides = sqrtf(1.0f + th * th) + sqrtf(1.0f + tv * tv);
+    return (CAMERA_FAR + radius) * corner + radius * sides + offset + 1.0f;
+}
+
+// Cull and pick a LOD for one slice of the env objects. Distances to the
+// eye go through one SoA batch first, so objects out of reach skip the
+// matrix fetch and the six plane tests.
+void envCullJob(void* ctx, int begin, int end, int chunk) {
+    const EnvObjectStore& env = scene->env;
+    const EnvCullParams& params = *(const EnvCullParams*)ctx;
+    int counts[NUM_INSTANCE_BUCKETS] = { 0 };
+    int drawn = 0, culled = 0;
+
+    float* distSq = &envVis.eyeDistSq[0];
+    if (params.reachSq > 0.0f) {
+        distanceSqBatch(&env.posX[begin], &env.posY[begin], &env.posZ[begin], viewFrustum.eye,
+            distSq + begin, end - begin);
+    }
+
+    for (int i = begin; i < end; ++i) {
+        envVis.bucketOf[i] = -1;
+        if (params.skipStatic && env.running[i] == 0.0f) continue;
+        if (params.reachSq > 0.0f && distSq[i] > params.reachSq) {
+            ++culled;
+            continue;
+        }
+
+        int t = env.type[i];
+        const float* m = envDrawWorld(i).m;
+        int lod = meshLod(envTypeInfo[t].mesh, m[12], m[13], m[14]);
+        if (lod < 0) {
+            ++culled;
+            continue;
+        }
+
+        ++drawn;
+        envVis.bucketOf[i] = (signed char)(t * NUM_LODS + lod);
+        ++counts[t * NUM_LODS + lod];
+    }
+
+    for (int b = 0; b < NUM_INSTANCE_BUCKETS; ++b) envVis.chunkBucket[chunk][b] = counts[b];
+    envVis.chunkDrawn[chunk] = drawn;
+    envVis.chunkCulled[chunk] = culled;
+}
+
+// Objects in the static batch are skipped here and drawn with their tile
+void cullEnvObjects() {
+    ProfileScope prof("cullEnvObjects");
+
+    int n = scene->env.count;
+    if ((int)envVis.bucketOf.size() < n) {
+        envVis.bucketOf.resize(n);
+        envVis.eyeDistSq.resize(n);
+    }
+
+    EnvCullParams params;
+    params.skipStatic = staticBatchActive();
+    float reach = envCullReach();
+    params.reachSq = useCulling ? reach * reach : 0.0f;
+    envVis.chunks = parallelFor(n, ENV_JOB_GRAIN, envCullJob, &params);
+
+    for (int c = 0; c < envVis.chunks; ++c) {
+        frameStats.objectsDrawn += envVis.chunkDrawn[c];
+        frameStats.objectsCulled += envVis.chunkCulled[c];
+    }
+}
+
+// Bucket by bucket, chunk c starts after chunks 0..c-1. Turns the chunk
+// counts into write cursors; returns the number of visible objects.
+int envBucketOffsets(int* bucketStart, int* bucketCount) {
+    int start = 0;
+    for (int b = 0; b < NUM_INSTANCE_BUCKETS; ++b) {
+        bucketStart[b] = start;
+        for (int c = 0; c < envVis.chunks; ++c) {
+            int count = envVis.chunkBucket[c][b];
+            envVis.chunkBucket[c][b] = start;
+            start += count;
+        }
+        bucketCount[b] = start - bucketStart[b];
+    }
+    return start;
+}
+
+// Second half of the counting sort: each chunk copies its visible objects
+// to its own cursors within every bucket
+void instanceScatterJob(void* ctx, int begin, int end, int chunk) {
+    (void)ctx;
+    const EnvObjectStore& env = scene->env;
+    int* cursor = envVis.chunkBucket[chunk];
+    float* out = &instancing.instanceData[0];
+
+    for (int i = begin; i < end; ++i) {
+        int b = envVis.bucketOf[i];
+        if (b < 0) continue;
+
+        float* inst = out + 4 * cursor[b]++;
+        const float* m = envDrawWorld(i).m;
+        inst[0] = m[12];
+        inst[1] = m[13];
+        inst[2] = m[14];
+        inst[3] = envDrawAnim(i) * envTypeInfo[env.type[i]].yawScale;
+    }
+}
+
+// Front to back within each bucket, so a mesh's nearest instances reach
+// the depth buffer first. Keys are 16-bit depth above the instance's slot.
+void sortInstancesByDepth() {
+    ProfileScope prof("sortInstancesByDepth");
+
+    int total = instancing.numInstances;
+    if (total < 2) return;
+    if (instancing.sortedData.size() < instancing.instanceData.size()) {
+        instancing.sortedData.resize(instancing.instanceData.size());
+    }
+    if ((int)instancing.sortKeys.size() < total) {
+        instancing.sortKeys.resize(total);
+        instancing.sortScratch.resize(total);
+    }
+
+    const float* data = &instancing.instanceData[0];
+    float* sorted = &instancing.sortedData[0];
+    uint64_t* keys = &instancing.sortKeys[0];
+    for (int b = 0; b < NUM_INSTANCE_BUCKETS; ++b) {
+        int start = instancing.bucketStart[b], count = instancing.bucketCount[b];
+        for (int k = 0; k < count; ++k) {
+            const float* inst = data + 4 * (start + k);
+            keys[k] = ((uint64_t)quantizeDepth(viewDepth(inst[0], inst[1], inst[2]), 16) << 24) | (uint64_t)k;
+        }
+        radixSortKeys(keys, &instancing.sortScratch[0], count, 3, 4);
+
+        for (int k = 0; k < count; ++k) {
+            memcpy(sorted + 4 * (start + k), data + 4 * (start + (int)(keys[k] & 0xFFFFFF)), 4 * sizeof(float));
+        }
+    }
+    instancing.instanceData.swap(instancing.sortedData);
+}
+
+// Cull, pick a LOD and bucket the visible objects (counting sort) into
+// the instance array
+void buildInstanceData() {
+    ProfileScope prof("buildInstanceData");
+
+    int n = scene->env.count;
+    if ((int)instancing.instanceData.size() < n * 4) instancing.instanceData.resize(n * 4);
+
+    cullEnvObjects();
+    instancing.numInstances = envBucketOffsets(instancing.bucketStart, instancing.bucketCount);
+    parallelFor(n, ENV_JOB_GRAIN, instanceScatterJob, NULL);
+    if (useRenderSort) sortInstancesByDepth();
+}
+
+// Same counting sort, but of object indices for the one-at-a-time path
+void drawOrderScatterJob(void* ctx, int begin, int end, int chunk) {
+    (void)ctx;
+    int* cursor = envVis.chunkBucket[chunk];
+    int* out = &envVis.drawOrder[0];
+
+    for (int i = begin; i < end; ++i) {
+        int b = envVis.bucketOf[i];
+        if (b >= 0) out[cursor[b]++] = i;
+    }
+}
+
+// Orphan and refill the instance buffer once per frame
+void uploadInstances() {
+    ProfileScope prof("uploadInstances");
+
+    if (scene->env.count == 0) {
+        instancing.numInstances = 0;
+        return;
+    }
+
+    buildInstanceData();
+    if (instancing.numInstances == 0) return;
+
+    ptrdiff_t bytes = instancing.numInstances * 4 * sizeof(float);
+    ext.BindBuffer(GL_ARRAY_BUFFER, instancing.instanceBuffer);
+    ext.BufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    ext.BufferSubData(GL_ARRAY_BUFFER, 0, bytes, &instancing.instanceData[0]);
+    ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Buckets are drawn between beginInstanced() and endInstanced(), with
+// instancing.program or the scene shaders' instanced variant
+void beginInstanced(GLuint program) {
+    loadViewMatrix();
+    setProgram(program);
+
+    ext.BindBuffer(GL_ARRAY_BUFFER, instancing.meshBuffer);
+    ext.EnableVertexAttribArray(ATTRIB_POS);
+    ext.EnableVertexAttribArray(ATTRIB_NORMAL);
+    ext.EnableVertexAttribArray(ATTRIB_COLOR);
+    ext.VertexAttribPointer(ATTRIB_POS, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex),
+        (const void*)offsetof(MeshVertex, pos));
+    ext.VertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex),
+        (const void*)offsetof(MeshVertex, normal));
+    ext.VertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex),
+        (const void*)offsetof(MeshVertex, color));
+
+    ext.BindBuffer(GL_ARRAY_BUFFER, instancing.instanceBuffer);
+    ext.EnableVertexAttribArray(ATTRIB_INSTANCE);
+    ext.VertexAttribDivisor(ATTRIB_INSTANCE, 1);
+}
+
+void drawInstanceBucket(int b) {
+    ext.VertexAttribPointer(ATTRIB_INSTANCE, 4, GL_FLOAT, GL_FALSE, 0,
+        (const void*)(instancing.bucketStart[b] * 4 * sizeof(float)));
+    ext.DrawArraysInstanced(GL_TRIANGLES, instancing.firstVertex[b],
+        instancing.vertexCount[b], instancing.bucketCount[b]);
+    frameStats.triangles += (long)(instancing.vertexCount[b] / 3) * instancing.bucketCount[b];
+    ++frameStats.drawCalls;
+}
+
+void endInstanced() {
+    ext.VertexAttribDivisor(ATTRIB_INSTANCE, 0);
+    ext.DisableVertexAttribArray(ATTRIB_INSTANCE);
+    ext.DisableVertexAttribArray(ATTRIB_COLOR);
+    ext.DisableVertexAttribArray(ATTRIB_NORMAL);
+    ext.DisableVertexAttribArray(ATTRIB_POS);
+    ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+    invalidateColor();   // some drivers alias generic attributes onto gl_Color
+}
+
+// =========================
+// Clustered lighting
+// =========================
+
+// Besides the overhead light, the floodlight heads, every drone's sensor
+// eye and the oxygen core are lights of their own: far more than the 8
+// fixed-function lights, so they only exist on the scene shader path.
+// The view frustum is cut into CLUSTER_X x CLUSTER_Y screen tiles and
+// CLUSTER_Z depth slices (exponential, so near slices stay thin) and
+// every cluster gets the list of lights whose sphere reaches it. The
+// lists are built on the CPU each frame, one job per slice, then
+// compacted and handed to the fragment shader as texture buffers. A
+// fragment only walks the list of the cluster it falls in.
+
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 12;
+const int CLUSTER_Z = 24;
+const int NUM_CLUSTERS = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+const int MAX_CLUSTER_LIGHTS = 64;     // extra lights in a cluster are dropped
+const int MAX_SCENE_LIGHTS = 1024;
+const float CLUSTER_NEAR = 1.0f;       // slice 0 is everything nearer
+const int LIGHT_TEXELS = 3;            // RGBA32F texels per light
+
+const float SPOT_COS_INNER = 0.94f;    // 20 degrees
+const float SPOT_COS_OUTER = 0.85f;    // 32 degrees
+
+// Where a type carries its lights, in model space; dir is the spot axis,
+// zero for a point light
+struct LightMount {
+    float offset[3];
+    float dir[3];
+    float color[3];
+    float radius;
+};
+
+const int MAX_LIGHT_MOUNTS = 2;
+
+struct EnvLightMounts {
+    int count;
+    LightMount mounts[MAX_LIGHT_MOUNTS];
+};
+
+const EnvLightMounts envLightMounts[NUM_ENV_TYPES] = {
+    { 2, { { { -0.25f, 1.2f, 0.35f }, { 0.0f, -0.6f, 0.8f }, { 1.4f, 1.5f, 1.6f }, 5.0f },      // floodlight heads
+           { { 0.25f, 1.2f, 0.35f }, { 0.0f, -0.6f, 0.8f }, { 1.4f, 1.5f, 1.6f }, 5.0f } } },
+    { 0, {} },
+    { 0, {} },
+    { 1, { { { 0.0f, 0.0f, 0.25f }, { 0.0f, 0.0f, 0.0f }, { 0.15f, 1.2f, 1.2f }, 1.2f } } },   // drone eye
+    { 0, {} }
+};
+
+const float CORE_LIGHT_COLOR[] = { 0.15f, 1.5f, 1.35f };
+const float CORE_LIGHT_RADIUS = 3.0f;
+
+struct SceneLight {
+    float pos[3];           // world space
+    float radius;
+    float color[3];
+    float dir[3];           // world space spot axis
+    bool  spot;
+};
+
+// Slices a light's bounding sphere reaches, inclusive
+struct LightBounds {
+    short z0, z1;
+};
+
+struct LightClusters {
+    bool   ready;
+    GLuint lightBuffer, gridBuffer, indexBuffer;
+    GLuint lightTexture, gridTexture, indexTexture;
+
+    std::vector<SceneLight> candidates;   // visible lights, grows only
+    std::vector<uint64_t> sortKeys, sortScratch;
+    SceneLight  lights[MAX_SCENE_LIGHTS];
+    int         numLights;
+    LightBounds bounds[MAX_SCENE_LIGHTS];
+    float       lightData[MAX_SCENE_LIGHTS * LIGHT_TEXELS * 4];   // eye space
+
+    int      count[NUM_CLUSTERS];
+    uint16_t lists[NUM_CLUSTERS * MAX_CLUSTER_LIGHTS];
+    int      sliceTotal[CLUSTER_Z], sliceDropped[CLUSTER_Z], sliceStart[CLUSTER_Z];
+    uint32_t grid[NUM_CLUSTERS * 2];                               // offset, count
+    uint16_t indices[NUM_CLUSTERS * MAX_CLUSTER_LIGHTS];           // compacted lists
+    int      numIndices;
+    int      dropped;
+
+    float sliceScale, sliceBias;   // slice = log(depth) * scale + bias
+    float sliceNear[CLUSTER_Z + 1];
+};
+
+LightClusters clusters;
+bool useSceneLights = true;              // false = overhead light only ('y')
+int sceneLightLimit = MAX_SCENE_LIGHTS;  // nearest lights kept (--lights)
+
+// Buffer texture on its own unit, bound once: units 1..3 are reserved
+GLuint makeBufferTexture(GLuint buffer, GLenum format, int unit) {
+    GLuint texture = acquireTexture();
+    ext.ActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    ext.TexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    ext.ActiveTexture(GL_TEXTURE0);
+    return texture;
+}
+
+const int LIGHT_TEXTURE_UNIT = 1;
+const int GRID_TEXTURE_UNIT = 2;
+const int INDEX_TEXTURE_UNIT = 3;
+
+// Needs the GL resources
+bool initLightClusters() {
+    clusters.ready = false;
+    if (!ext.hasTextureBuffers) return false;
+
+    clusters.lightBuffer = acquireBuffer();
+    clusters.gridBuffer = acquireBuffer();
+    clusters.indexBuffer = acquireBuffer();
+    if (!clusters.lightBuffer || !clusters.gridBuffer || !clusters.indexBuffer) return false;
+
+    // Storage exists before the textures point at it
+    ext.BindBuffer(GL_TEXTURE_BUFFER, clusters.lightBuffer);
+    ext.BufferData(GL_TEXTURE_BUFFER, sizeof(clusters.lightData), NULL, GL_STREAM_DRAW);
+    ext.BindBuffer(GL_TEXTURE_BUFFER, clusters.gridBuffer);
+    ext.BufferData(GL_TEXTURE_BUFFER, sizeof(clusters.grid), NULL, GL_STREAM_DRAW);
+    ext.BindBuffer(GL_TEXTURE_BUFFER, clusters.indexBuffer);
+    ext.BufferData(GL_TEXTURE_BUFFER, sizeof(clusters.indices), NULL, GL_STREAM_DRAW);
+    ext.BindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    clusters.lightTexture = makeBufferTexture(clusters.lightBuffer, GL_RGBA32F, LIGHT_TEXTURE_UNIT);
+    clusters.gridTexture = makeBufferTexture(clusters.gridBuffer, GL_RG32UI, GRID_TEXTURE_UNIT);
+    clusters.indexTexture = makeBufferTexture(clusters.indexBuffer, GL_R16UI, INDEX_TEXTURE_UNIT);
+
+    clusters.sliceScale = CLUSTER_Z / logf(CAMERA_FAR / CLUSTER_NEAR);
+    clusters.sliceBias = -logf(CLUSTER_NEAR) * clusters.sliceScale;
+    clusters.sliceNear[0] = CAMERA_NEAR;
+    for (int s = 1; s < CLUSTER_Z; ++s) clusters.sliceNear[s] = expf((s - clusters.sliceBias) / clusters.sliceScale);
+    clusters.sliceNear[CLUSTER_Z] = 1e30f;   // the last slice takes everything beyond
+    clusters.numLights = 0;
+    clusters.ready = true;
+    return true;
+}
+
+bool sceneLightsActive() {
+    return useSceneLights && clusters.ready;
+}
+
+void addCandidateLight(const Mat4& world, const LightMount& mount) {
+    const float* m = world.m;
+    const float* o = mount.offset;
+    float x = m[0] * o[0] + m[4] * o[1] + m[8] * o[2] + m[12];
+    float y = m[1] * o[0] + m[5] * o[1] + m[9] * o[2] + m[13];
+    float z = m[2] * o[0] + m[6] * o[1] + m[10] * o[2] + m[14];
+    if (!sphereInFrustum(x, y, z, mount.radius)) return;
+
+    SceneLight l;
+    l.pos[0] = x;
+    l.pos[1] = y;
+    l.pos[2] = z;
+    l.radius = mount.radius;
+    memcpy(l.color, mount.color, sizeof(l.color));
+
+    const float* d = mount.dir;
+    l.spot = d[0] != 0.0f || d[1] != 0.0f || d[2] != 0.0f;
+    l.dir[0] = m[0] * d[0] + m[4] * d[1] + m[8] * d[2];
+    l.dir[1] = m[1] * d[0] + m[5] * d[1] + m[9] * d[2];
+    l.dir[2] = m[2] * d[0] + m[6] * d[1] + m[10] * d[2];
+    clusters.candidates.push_back(l);
+}
+
+// Lights whose sphere is in view; past sceneLightLimit the nearest win
+void gatherSceneLights() {
+    ProfileScope prof("gatherSceneLights");
+
+    const EnvObjectStore& env = scene->env;
+    if ((int)clusters.candidates.capacity() < 2 * env.count + 1) {
+        clusters.candidates.reserve(2 * env.count + 1);
+    }
+    clusters.candidates.clear();
+
+    const Goal& core = scene->core;
+    if (!core.collected) {
+        LightMount mount = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f },
+            { CORE_LIGHT_COLOR[0], CORE_LIGHT_COLOR[1], CORE_LIGHT_COLOR[2] }, CORE_LIGHT_RADIUS };
+        addCandidateLight(Mat4::translation(core.pos.x, core.pos.y, core.pos.z), mount);
+    }
+    for (int i = 0; i < env.count; ++i) {
+        const EnvLightMounts& mounts = envLightMounts[env.type[i]];
+        if (mounts.count == 0) continue;
+
+        const Mat4& world = envDrawWorld(i);
+        for (int k = 0; k < mounts.count; ++k) addCandidateLight(world, mounts.mounts[k]);
+    }
+
+    int n = (int)clusters.candidates.size();
+    int limit = std::min(sceneLightLimit, MAX_SCENE_LIGHTS);
+    const SceneLight* src = n > 0 ? &clusters.candidates[0] : NULL;
+    if (n <= limit) {
+        if (n > 0) memcpy(clusters.lights, src, n * sizeof(SceneLight));
+        clusters.numLights = n;
+        return;
+    }
+
+    if ((int)clusters.sortKeys.size() < n) {
+        clusters.sortKeys.resize(n);
+        clusters.sortScratch.resize(n);
+    }
+    uint64_t* keys = &clusters.sortKeys[0];
+    for (int i = 0; i < n; ++i) {
+        const SceneLight& l = src[i];
+        float nearest = viewDepth(l.pos[0], l.pos[1], l.pos[2]) - l.radius;
+        keys[i] = ((uint64_t)quantizeDepth(nearest, 16) << 24) | (uint64_t)i;
+    }
+    radixSortKeys(keys, &clusters.sortScratch[0], n, 3, 4);
+    for (int i = 0; i < limit; ++i) clusters.lights[i] = src[keys[i] & 0xFFFFFF];
+    clusters.numLights = limit;
+}
+
+int clusterSlice(float depth) {
+    if (depth <= CLUSTER_NEAR) return 0;
+    int s = (int)(logf(depth) * clusters.sliceScale + clusters.sliceBias);
+    return s < 0 ? 0 : (s >= CLUSTER_Z ? CLUSTER_Z - 1 : s);
+}
+
+int clusterTile(float ndc, int tiles) {
+    int t = (int)((ndc * 0.5f + 0.5f) * tiles);
+    return t < 0 ? 0 : (t >= tiles ? tiles - 1 : t);
+}
+
+// Eye-space texels for the shader and the slices each light reaches
+void prepareLights() {
+    const float* v = frameView.m;
+
+    for (int i = 0; i < clusters.numLights; ++i) {
+        const SceneLight& l = clusters.lights[i];
+        const float* p = l.pos;
+        float ex = v[0] * p[0] + v[4] * p[1] + v[8] * p[2] + v[12];
+        float ey = v[1] * p[0] + v[5] * p[1] + v[9] * p[2] + v[13];
+        float ez = v[2] * p[0] + v[6] * p[1] + v[10] * p[2] + v[14];
+
+        float* t = clusters.lightData + i * LIGHT_TEXELS * 4;
+        t[0] = ex;
+        t[1] = ey;
+        t[2] = ez;
+        t[3] = l.radius;
+        t[4] = l.color[0];
+        t[5] = l.color[1];
+        t[6] = l.color[2];
+        t[7] = l.spot ? SPOT_COS_OUTER : -2.0f;   // every direction passes
+        Vector3f d = Vector3f(v[0] * l.dir[0] + v[4] * l.dir[1] + v[8] * l.dir[2],
+            v[1] * l.dir[0] + v[5] * l.dir[1] + v[9] * l.dir[2],
+            v[2] * l.dir[0] + v[6] * l.dir[1] + v[10] * l.dir[2]).unit();
+        t[8] = d.x;
+        t[9] = d.y;
+        t[10] = d.z;
+        t[11] = l.spot ? SPOT_COS_INNER : -1.0f;
+
+        float depth = -ez;
+        clusters.bounds[i].z0 = (short)clusterSlice(depth - l.radius);
+        clusters.bounds[i].z1 = (short)clusterSlice(depth + l.radius);
+    }
+}
+
+// Screen tiles covered by the part of light i's sphere within [za, zb] of
+// depth. That part fits in an eye-space box whose half width is the
+// sphere's widest cross-section in the band; x / depth is monotonic over
+// the box, so its corners bound the rectangle.
+void lightTileRect(int i, float za, float zb, int& x0, int& x1, int& y0, int& y1) {
+    const float* t = clusters.lightData + i * LIGHT_TEXELS * 4;
+    float ex = t[0], ey = t[1], depth = -t[2], r = t[3];
+    float dz = depth < za ? za - depth : (depth > zb ? depth - zb : 0.0f);
+    float rr = sqrtf(std::max(r * r - dz * dz, 0.0f));
+
+    float tv = viewFrustum.tanHalfFovY;
+    float th = viewFrustum.tanHalfFovX;
+    float zmin = std::max(za, CAMERA_NEAR), zmax = std::max(zb, CAMERA_NEAR);
+    x0 = clusterTile(std::min((ex - rr) / zmin, (ex - rr) / zmax) / th, CLUSTER_X);
+    x1 = clusterTile(std::max((ex + rr) / zmin, (ex + rr) / zmax) / th, CLUSTER_X);
+    y0 = clusterTile(std::min((ey - rr) / zmin, (ey - rr) / zmax) / tv, CLUSTER_Y);
+    y1 = clusterTile(std::max((ey + rr) / zmin, (ey + rr) / zmax) / tv, CLUSTER_Y);
+}
+
+// Fill the lists of one slice's clusters; each job owns its slices
+void clusterSliceJob(void* ctx, int begin, int end, int chunk) {
+    (void)ctx;
+    (void)chunk;
+    for (int s = begin; s < end; ++s) {
+        int* count = clusters.count + s * CLUSTER_X * CLUSTER_Y;
+        memset(count, 0, CLUSTER_X * CLUSTER_Y * sizeof(int));
+        int dropped = 0;
+
+        for (int i = 0; i < clusters.numLights; ++i) {
+            const LightBounds& b = clusters.bounds[i];
+            if (s < b.z0 || s > b.z1) continue;
+
+            // The sphere's depth range clipped to the slice
+            const float* t = clusters.lightData + i * LIGHT_TEXELS * 4;
+            float depth = -t[2], r = t[3];
+            float za = std::max(depth - r, clusters.sliceNear[s]);
+            float zb = std::min(depth + r, clusters.sliceNear[s + 1]);
+            int x0, x1, y0, y1;
+            lightTileRect(i, za, zb, x0, x1, y0, y1);
+
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    int local = y * CLUSTER_X + x;
+                    int c = s * CLUSTER_X * CLUSTER_Y + local;
+                    if (count[local] < MAX_CLUSTER_LIGHTS) clusters.lists[c * MAX_CLUSTER_LIGHTS + count[local]++] = (uint16_t)i;
+                    else ++dropped;
+                }
+            }
+        }
+
+        int total = 0;
+        for (int k = 0; k < CLUSTER_X * CLUSTER_Y; ++k) total += count[k];
+        clusters.sliceTotal[s] = total;
+        clusters.sliceDropped[s] = dropped;
+    }
+}
+
+// Pack one slice's lists at its offset in the shared index array
+void clusterCompactJob(void* ctx, int begin, int end, int chunk) {
+    (void)ctx;
+    (void)chunk;
+    for (int s = begin; s < end; ++s) {
+        int offset = clusters.sliceStart[s];
+        for (int c = s * CLUSTER_X * CLUSTER_Y; c < (s + 1) * CLUSTER_X * CLUSTER_Y; ++c) {
+            int n = clusters.count[c];
+            clusters.grid[2 * c] = (uint32_t)offset;
+            clusters.grid[2 * c + 1] = (uint32_t)n;
+            memcpy(clusters.indices + offset, clusters.lists + c * MAX_CLUSTER_LIGHTS, n * sizeof(uint16_t));
+            offset += n;
+        }
+    }
+}
+
+// Once per frame after setupCamera(): gather, bin, compact and upload
+void buildLightClusters() {
+    if (!sceneLightsActive()) {
+        clusters.numLights = 0;
+        return;
+    }
+    ProfileScope prof("buildLightClusters");
+
+    gatherSceneLights();
+    prepareLights();
+
+    parallelFor(CLUSTER_Z, 1, clusterSliceJob, NULL);
+    int total = 0;
+    clusters.dropped = 0;
+    for (int s = 0; s < CLUSTER_Z; ++s) {
+        clusters.sliceStart[s] = total;
+        total += clusters.sliceTotal[s];
+        clusters.dropped += clusters.sliceDropped[s];
+    }
+    clusters.numIndices = total;
+    parallelFor(CLUSTER_Z, 1, clusterCompactJob, NULL);
+
+    frameStats.lights = clusters.numLights;
+    frameStats.lightRefs = total;
+
+    // Orphan and refill, like the instance buffer
+    ext.BindBuffer(GL_TEXTURE_BUFFER, clusters.lightBuffer);
+    ext.BufferData(GL_TEXTURE_BUFFER, sizeof(clusters.lightData), NULL, GL_STREAM_DRAW);
+    ext.BufferSubData(GL_TEXTURE_BUFFER, 0, clusters.numLights * LIGHT_TEXELS * 4 * sizeof(float), clusters.lightData);
+    ext.BindBuffer(GL_TEXTURE_BUFFER, clusters.gridBuffer);
+    ext.BufferData(GL_TEXTURE_BUFFER, sizeof(clusters.grid), NULL, GL_STREAM_DRAW);
+    ext.BufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(clusters.grid), clusters.grid);
+    ext.BindBuffer(GL_TEXTURE_BUFFER, clusters.indexBuffer);
+    ext.BufferData(GL_TEXTURE_BUFFER, sizeof(clusters.indices), NULL, GL_STREAM_DRAW);
+    ext.BufferSubData(GL_TEXTURE_BUFFER, 0, total * sizeof(uint16_t), clusters.indices);
+    ext.BindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// =========================
+// Scene shaders
+// =========================
+
+// The shaded path lights every opaque fragment, fogs it toward the water
+// color with distance and adds caustics (light focused by the waves
+// overhead, falling on upward-facing surfaces) in one fragment shader.
+// Everything that is the same for the whole frame lives in one uniform
+// block, refilled once per frame. The display lists, the matrix stack and
+// the HUD stay fixed function, so the shaders are GLSL 1.50 compatibility:
+// they read the built-in matrices and, outside the instanced variant, the
+// built-in vertex attributes. Without GL 3.2 the fixed-function lighting
+// is the fallback ('h', --fixed-function).
+
+const char* SCENE_VS =
+    "#version 150 compatibility\n"
+    "out vec3 vEyePos;\n"
+    "out vec3 vNormal;\n"
+    "out vec3 vColor;\n"
+    "void main() {\n"
+    "    vec4 eyePos = gl_ModelViewMatrix * gl_Vertex;\n"
+    "    vEyePos = eyePos.xyz;\n"
+    "    vNormal = gl_NormalMatrix * gl_Normal;\n"
+    "    vColor = gl_Color.rgb;\n"
+    "    gl_Position = gl_ProjectionMatrix * eyePos;\n"
+    "}\n";
+
+// Same instance layout as INSTANCED_VS
+const char* SCENE_INSTANCED_VS =
+    "#version 150 compatibility\n"
+    "in vec3 aPos;\n"
+    "in vec3 aNormal;\n"
+    "in vec3 aColor;\n"
+    "in vec4 aInstance;\n"
+    "out vec3 vEyePos;\n"
+    "out vec3 vNormal;\n"
+    "out vec3 vColor;\n"
+    "void main() {\n"
+    "    float a = radians(aInstance.w);\n"
+    "    float c = cos(a), s = sin(a);\n"
+    "    vec3 p = vec3(c * aPos.x + s * aPos.z, aPos.y, -s * aPos.x + c * aPos.z) + aInstance.xyz;\n"
+    "    vec3 n = vec3(c * aNormal.x + s * aNormal.z, aNormal.y, -s * aNormal.x + c * aNormal.z);\n"
+    "    vec4 eyePos = gl_ModelViewMatrix * vec4(p, 1.0);\n"
+    "    vEyePos = eyePos.xyz;\n"
+    "    vNormal = gl_NormalMatrix * n;\n"
+    "    vColor = aColor;\n"
+    "    gl_Position = gl_ProjectionMatrix * eyePos;\n"
+    "}\n";
+
+// Declared the same in every program that reads it, see FrameUniforms
+#define SCENE_FRAME_BLOCK \
+    "layout(std140) uniform FrameBlock {\n" \
+    "    mat4 eyeToWorld;\n" \
+    "    vec4 lightPosition;\n"      /* eye space */ \
+    "    vec4 ambient;\n" \
+    "    vec4 lightDiffuse;\n" \
+    "    vec4 specular;\n"           /* w = shininess */ \
+    "    vec4 fog;\n"                /* rgb = water color, w = density */ \
+    "    vec4 caustics;\n"           /* time, scale, strength */ \
+    "    vec4 clusterScale;\n"       /* 1 / tile size in pixels, slice scale and bias */ \
+    "    ivec4 clusterDims;\n"       /* x, y, z, lights */ \
+    "    vec4 points;\n"             /* x = pixels per world unit at eye distance 1 */ \
+    "};\n"
+
+// Lighting matches setupLights() with the material color from the vertex
+const char* SCENE_FS =
+    "#version 150 compatibility\n"
+    SCENE_FRAME_BLOCK
+    "uniform samplerBuffer uLights;\n"
+    "uniform usamplerBuffer uClusterGrid;\n"
+    "uniform usamplerBuffer uClusterLights;\n"
+    "in vec3 vEyePos;\n"
+    "in vec3 vNormal;\n"
+    "in vec3 vColor;\n"
+    "float caustic(vec2 p, float t) {\n"
+    "    vec2 q = p * caustics.y;\n"
+    "    float w = sin(q.x + 1.5 * sin(0.8 * q.y + t) + 0.7 * t)\n"
+    "            + sin(q.y + 1.5 * sin(0.9 * q.x - 0.8 * t) - 0.6 * t);\n"
+    "    float b = 1.0 - 0.5 * abs(w);\n"
+    "    b *= b * b;\n"
+    "    return b * b;\n"
+    "}\n"
+    "vec3 clusterLights(vec3 N) {\n"
+    "    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterScale.xy), clusterDims.xy - 1);\n"
+    "    int slice = int(clamp(log(max(-vEyePos.z, 1e-3)) * clusterScale.z + clusterScale.w, 0.0, float(clusterDims.z - 1)));\n"
+    "    int cluster = (slice * clusterDims.y + tile.y) * clusterDims.x + tile.x;\n"
+    "    uvec2 range = texelFetch(uClusterGrid, cluster).xy;\n"
+    "    vec3 sum = vec3(0.0);\n"
+    "    for (int k = 0; k < int(range.y); ++k) {\n"
+    "        int i = 3 * int(texelFetch(uClusterLights, int(range.x) + k).r);\n"
+    "        vec4 a = texelFetch(uLights, i);\n"           // position, radius
+    "        vec3 toLight = a.xyz - vEyePos;\n"
+    "        float d2 = dot(toLight, toLight);\n"
+    "        if (d2 >= a.w * a.w) continue;\n"
+    "        vec4 b = texelFetch(uLights, i + 1);\n"       // color, spot cos outer
+    "        vec4 c = texelFetch(uLights, i + 2);\n"       // spot axis, cos inner
+    "        vec3 L = toLight * inversesqrt(d2);\n"
+    "        float fall = 1.0 - d2 / (a.w * a.w);\n"
+    "        fall *= fall * smoothstep(b.w, c.w, dot(-L, c.xyz));\n"
+    "        sum += b.rgb * fall * max(dot(N, L), 0.0);\n"
+    "    }\n"
+    "    return sum;\n"
+    "}\n"
+    "void main() {\n"
+    "    vec3 N = normalize(vNormal);\n"
+    "    vec3 L = normalize(lightPosition.xyz - vEyePos);\n"
+    "    vec3 V = normalize(-vEyePos);\n"
+    "    float diff = max(dot(N, L), 0.0);\n"
+    "    float spec = diff > 0.0 ? pow(max(dot(N, normalize(L + V)), 0.0), specular.w) : 0.0;\n"
+    "    vec3 world = (eyeToWorld * vec4(vEyePos, 1.0)).xyz;\n"
+    "    float up = max((eyeToWorld * vec4(N, 0.0)).y, 0.0);\n"
+    "    float light = diff;\n"
+    "    if (up > 0.0) light += caustics.z * up * caustic(world.xz, caustics.x);\n"
+    "    vec3 lit = ambient.rgb + lightDiffuse.rgb * light;\n"
+    "    if (clusterDims.w > 0) lit += clusterLights(N);\n"
+    "    vec3 color = vColor * lit + specular.rgb * spec;\n"
+    "    float d = fog.w * length(vEyePos);\n"
+    "    gl_FragColor = vec4(mix(fog.rgb, color, exp(-d * d)), 1.0);\n"
+    "}\n";
+
+// std140 FrameBlock: vec4s and a mat4 need no padding
+struct FrameUniforms {
+    float eyeToWorld[16];
+    float lightPosition[4];
+    float ambient[4];
+    float lightDiffuse[4];
+    float specular[4];
+    float fog[4];
+    float caustics[4];
+    float clusterScale[4];
+    int   clusterDims[4];
+    float points[4];
+};
+
+const GLuint FRAME_BLOCK_BINDING = 0;
+const float FOG_DENSITY = 0.035f;       // exp2 fog, per unit of eye distance
+const float CAUSTIC_SCALE = 1.7f;       // pattern cells per world unit
+const float CAUSTIC_STRENGTH = 0.35f;   // added to N.L on surfaces facing up
+
+struct SceneShaders {
+    bool   ready;
+    GLuint program;              // lists and vertex arrays
+    GLuint instancedProgram;     // instanced env objects, 0 without instancing
+    GLuint frameBuffer;          // FrameUniforms
+    FrameUniforms frame;
+};
+
+SceneShaders sceneShaders;
+bool useSceneShaders = true;   // false = fixed-function lighting, no fog or caustics ('h')
+
+bool sceneShadersActive() {
+    return useSceneShaders && sceneShaders.ready;
+}
+
+// Link one variant, point its FrameBlock at the shared binding and its
+// light buffers at their texture units
+GLuint buildSceneProgram(const char* vs, const char* const* attribs, int numAttribs) {
+    GLuint program = buildProgram(vs, SCENE_FS, attribs, numAttribs);
+    if (!program) return 0;
+
+    GLuint block = ext.GetUniformBlockIndex(program, "FrameBlock");
+    if (block == GL_INVALID_INDEX) {
+        printf("Scene shader has no FrameBlock\n");
+        return 0;
+    }
+    ext.UniformBlockBinding(program, block, FRAME_BLOCK_BINDING);
+
+    setProgram(program);
+    ext.Uniform1i(ext.GetUniformLocation(program, "uLights"), LIGHT_TEXTURE_UNIT);
+    ext.Uniform1i(ext.GetUniformLocation(program, "uClusterGrid"), GRID_TEXTURE_UNIT);
+    ext.Uniform1i(ext.GetUniformLocation(program, "uClusterLights"), INDEX_TEXTURE_UNIT);
+    setProgram(0);
+    return program;
+}
+
+// Needs the GL resources; leaves sceneShaders.ready false when unsupported
+void initSceneShaders() {
+    sceneShaders.ready = false;
+    if (!ext.hasUniformBuffers || ext.versionMajor * 10 + ext.versionMinor < 32 || !initLightClusters()) {
+        printf("Scene shaders unavailable (GL %d.%d), using fixed-function lighting\n",
+            ext.versionMajor, ext.versionMinor);
+        return;
+    }
+
+    sceneShaders.program = buildSceneProgram(SCENE_VS, NULL, 0);
+    if (!sceneShaders.program) return;
+
+    sceneShaders.instancedProgram = 0;
+    if (instancing.ready) {
+        const char* attribs[] = { "aPos", "aNormal", "aColor", "aInstance" };
+        sceneShaders.instancedProgram = buildSceneProgram(SCENE_INSTANCED_VS, attribs, 4);
+        if (!sceneShaders.instancedProgram) return;
+    }
+
+    sceneShaders.frameBuffer = acquireBuffer();
+    ext.BindBuffer(GL_UNIFORM_BUFFER, sceneShaders.frameBuffer);
+    ext.BufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_STREAM_DRAW);
+    ext.BindBuffer(GL_UNIFORM_BUFFER, 0);
+    ext.BindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, sceneShaders.frameBuffer);
+
+    sceneShaders.ready = true;
+}
+
+void setVec4(float* out, float x, float y, float z, float w) {
+    out[0] = x;
+    out[1] = y;
+    out[2] = z;
+    out[3] = w;
+}
+
+// Once per frame, after setupCamera()
+void updateFrameUniforms() {
+    if (!sceneShadersActive()) return;
+    ProfileScope prof("updateFrameUniforms");
+
+    FrameUniforms& f = sceneShaders.frame;
+    const float* v = frameView.m;
+
+    // The view is a rotation and a translation: the inverse rotation is
+    // its transpose, and the camera sits at the eye
+    const Vector3f& eye = viewFrustum.eye;
+    setVec4(f.eyeToWorld + 0, v[0], v[4], v[8], 0.0f);
+    setVec4(f.eyeToWorld + 4, v[1], v[5], v[9], 0.0f);
+    setVec4(f.eyeToWorld + 8, v[2], v[6], v[10], 0.0f);
+    setVec4(f.eyeToWorld + 12, eye.x, eye.y, eye.z, 1.0f);
+
+    const GLfloat* p = LIGHT_POSITION;
+    setVec4(f.lightPosition, v[0] * p[0] + v[4] * p[1] + v[8] * p[2] + v[12],
+        v[1] * p[0] + v[5] * p[1] + v[9] * p[2] + v[13],
+        v[2] * p[0] + v[6] * p[1] + v[10] * p[2] + v[14], 1.0f);
+
+    // Light 0 keeps GL's black ambient, so only the light model's counts
+    setVec4(f.ambient, LIGHT_MODEL_AMBIENT[0], LIGHT_MODEL_AMBIENT[1], LIGHT_MODEL_AMBIENT[2], 1.0f);
+    setVec4(f.lightDiffuse, LIGHT_DIFFUSE[0], LIGHT_DIFFUSE[1], LIGHT_DIFFUSE[2], 1.0f);
+    const GLfloat* s = SCENE_MATERIAL.specular;   // light 0's specular is white
+    setVec4(f.specular, s[0], s[1], s[2], SCENE_MATERIAL.shininess);
+    setVec4(f.fog, WATER_COLOR[0], WATER_COLOR[1], WATER_COLOR[2], FOG_DENSITY);
+
+    float seconds = (float)((scene->tick + renderAlpha) * SIM_DT);
+    setVec4(f.caustics, seconds, CAUSTIC_SCALE, CAUSTIC_STRENGTH, 0.0f);
+
+    setVec4(f.clusterScale, (float)CLUSTER_X / viewportW, (float)CLUSTER_Y / viewportH,
+        clusters.sliceScale, clusters.sliceBias);
+    f.clusterDims[0] = CLUSTER_X;
+    f.clusterDims[1] = CLUSTER_Y;
+    f.clusterDims[2] = CLUSTER_Z;
+    f.clusterDims[3] = clusters.numLights;
+    setVec4(f.points, 0.5f * viewportH / viewFrustum.tanHalfFovY, 0.0f, 0.0f, 0.0f);
+
+    ext.BindBuffer(GL_UNIFORM_BUFFER, sceneShaders.frameBuffer);
+    ext.BufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &f);
+    ext.BindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// =========================
+// Particles
+// =========================
+
+// Bubbles from the diver's helmet while it rises or sinks and silt kicked
+// up where it moves along the floor. The pool is a fixed-capacity
+// structure of arrays: spawning never allocates, and a full pool drops
+// new particles instead of growing. Each frame one SIMD pass integrates
+// every slot up to the high-water mark (dead slots have alive = 0 and do
+// not move, so the pass has no branches), then a second pass retires
+// expired particles onto the free list and writes the live ones out as
+// point sprites, drawn in one call after the opaque pass. Both passes run
+// on the job system; chunks are merged in order, so the result does not
+// depend on the thread count. Particles are cosmetic: they live on the
+// render side, timed by the snapshot's sim clock, and never reach the
+// simulation or a replay.
+
+const int MAX_PARTICLES = 131072;
+const int PARTICLE_JOB_GRAIN = 8192;
+const unsigned int MAX_EMIT_EVENTS = 64;   // per frame, so a long hitch cannot flood the pool
+const float BUBBLE_SOURCE_Y = 1.0f;        // helmet height above diver.pos
+const float PARTICLE_FALLBACK_SIZE = 3.0f; // pixels, fixed-function points
+
+enum ParticleKind {
+    PARTICLE_BUBBLE,
+    PARTICLE_SILT,
+    NUM_PARTICLE_KINDS
+};
+
+struct ParticleKindInfo {
+    float size;          // world units across
+    float color[4];      // straight alpha
+    float life;          // seconds, +-25% per particle
+    float fadeTime;      // seconds before the end it fades out over
+    float buoyancy;      // upward acceleration; negative sinks
+    float drag;          // fraction of velocity lost per second, times dt < 1
+    float speed;         // initial spread
+    int   perEvent;      // spawned per emitter event
+};
+
+const ParticleKindInfo particleKinds[NUM_PARTICLE_KINDS] = {
+    { 0.07f, { 0.80f, 0.95f, 1.00f, 0.60f }, 3.0f, 0.5f, 2.0f, 1.5f, 0.25f, 2 },    // bubble
+    { 0.12f, { 0.50f, 0.45f, 0.33f, 0.35f }, 2.5f, 1.5f, -0.15f, 2.5f, 1.2f, 4 },   // silt
+};
+
+// One point sprite; color is premultiplied by alpha
+struct ParticleVertex {
+    float x, y, z, size;
+    unsigned char color[4];
+};
+
+enum ParticleAttrib {
+    PARTICLE_ATTRIB_POINT,
+    PARTICLE_ATTRIB_COLOR
+};
+
+struct ParticlePool {
+    alignas(32) float posX[MAX_PARTICLES];
+    alignas(32) float posY[MAX_PARTICLES];
+    alignas(32) float posZ[MAX_PARTICLES];
+    alignas(32) float velX[MAX_PARTICLES];
+    alignas(32) float velY[MAX_PARTICLES];
+    alignas(32) float velZ[MAX_PARTICLES];
+    alignas(32) float life[MAX_PARTICLES];       // seconds left
+    alignas(32) float buoyancy[MAX_PARTICLES];
+    alignas(32) float drag[MAX_PARTICLES];
+    alignas(32) float alive[MAX_PARTICLES];      // 1.0f live, 0.0f free
+    unsigned char kind[MAX_PARTICLES];
+
+    int freeList[MAX_PARTICLES];   // free slots below highWater, lowest first
+    int numFree, nextFree;         // entries, and the next one to hand out
+    int highWater;                 // every live slot is below this
+    int live;
+    int dropped;                   // spawns refused with the pool full, in total
+
+    ParticleVertex vertices[MAX_PARTICLES];
+    int numVertices;
+    int chunkLive[MAX_JOB_CHUNKS];   // counts, then write cursors
+    int chunkFree[MAX_JOB_CHUNKS];
+
+    unsigned int seed;
+    unsigned int bubblesSeen, siltSeen;   // emitter counts already spawned from
+    double lastTime;                      // sim seconds of the last update, < 0 = none yet
+
+    bool   ready;                  // program and buffer, shaded path only
+    GLuint program;
+    GLuint buffer;
+};
+
+ParticlePool particles;
+
+const char* PARTICLE_VS =
+    "#version 150 compatibility\n"
+    SCENE_FRAME_BLOCK
+    "in vec4 aPoint;\n"           // position, size
+    "in vec4 aColor;\n"
+    "out vec4 vColor;\n"
+    "void main() {\n"
+    "    vec4 eyePos = gl_ModelViewMatrix * vec4(aPoint.xyz, 1.0);\n"
+    "    gl_Position = gl_ProjectionMatrix * eyePos;\n"
+    "    gl_PointSize = max(aPoint.w * points.x / max(-eyePos.z, 0.1), 1.0);\n"
+    "    float d = fog.w * length(eyePos.xyz);\n"
+    "    vColor = aColor * exp(-d * d);\n"   // what lies behind is fogged already
+    "}\n";
+
+// Soft round sprite, premultiplied
+const char* PARTICLE_FS =
+    "#version 150 compatibility\n"
+    "in vec4 vColor;\n"
+    "void main() {\n"
+    "    vec2 p = gl_PointCoord * 2.0 - 1.0;\n"
+    "    float r2 = dot(p, p);\n"
+    "    if (r2 > 1.0) discard;\n"
+    "    gl_FragColor = vColor * (1.0 - r2 * r2);\n"
+    "}\n";
+
+float particleRandom() {
+    particles.seed = particles.seed * 1664525u + 1013904223u;
+    return ((particles.seed >> 8) & 0xFFFF) / 65536.0f;
+}
+
+// Empties the pool and skips whatever the emitters counted so far.
+// Builds the sprite program when the scene shaders are up, so call it
+// after initSceneShaders(); without them the points are fixed function.
+void initParticles() {
+    ParticlePool& p = particles;
+    p.numFree = p.nextFree = p.highWater = p.live = p.dropped = 0;
+    p.numVertices = 0;
+    p.seed = 12345u;
+    p.bubblesSeen = diver.bubbleEvents;
+    p.siltSeen = diver.siltEvents;
+    p.lastTime = -1.0;
+    memset(p.alive, 0, sizeof(p.alive));
+
+    p.ready = false;
+    if (!sceneShaders.ready) return;
+
+    const char* attribs[] = { "aPoint", "aColor" };
+    p.program = buildProgram(PARTICLE_VS, PARTICLE_FS, attribs, 2);
+    if (!p.program) return;
+    GLuint block = ext.GetUniformBlockIndex(p.program, "FrameBlock");
+    if (block == GL_INVALID_INDEX) return;
+    ext.UniformBlockBinding(p.program, block, FRAME_BLOCK_BINDING);
+
+    p.buffer = acquireBuffer();
+    p.ready = true;
+}
+
+bool particleShadersActive() {
+    return particles.ready && sceneShadersActive();
+}
+
+// A free slot, lowest first, or a new one above the high-water mark; the
+// particle is dropped when the pool is full
+int spawnParticle(int kind, float x, float y, float z, float vx, float vy, float vz) {
+    ParticlePool& p = particles;
+    int slot;
+    if (p.nextFree < p.numFree) slot = p.freeList[p.nextFree++];
+    else if (p.highWater < MAX_PARTICLES) slot = p.highWater++;
+    else {
+        ++p.dropped;
+        return -1;
+    }
+
+    const ParticleKindInfo& info = particleKinds[kind];
+    p.posX[slot] = x;
+    p.posY[slot] = y;
+    p.posZ[slot] = z;
+    p.velX[slot] = vx;
+    p.velY[slot] = vy;
+    p.velZ[slot] = vz;
+    p.life[slot] = info.life * (0.75f + 0.5f * particleRandom());
+    p.buoyancy[slot] = info.buoyancy * (0.8f + 0.4f * particleRandom());
+    p.drag[slot] = info.drag;
+    p.alive[slot] = 1.0f;
+    p.kind[slot] = (unsigned char)kind;
+    ++p.live;
+    return slot;
+}
+
+// Somewhere along the diver's last tick, so fast moves leave a trail
+// rather than clumps
+void emitAlongDiver(int kind, unsigned int events) {
+    const Vector3f& a = scene->prevDiverPos;
+    const Vector3f& b = scene->diver.pos;
+    const ParticleKindInfo& info = particleKinds[kind];
+
+    for (unsigned int e = 0; e < events; ++e) {
+        for (int k = 0; k < info.perEvent; ++k) {
+            float t = particleRandom();
+            float x = lerpf(a.x, b.x, t), z = lerpf(a.z, b.z, t);
+            float s = info.speed;
+            if (kind == PARTICLE_BUBBLE) {
+                spawnParticle(kind, x + (particleRandom() - 0.5f) * 0.1f, lerpf(a.y, b.y, t) + BUBBLE_SOURCE_Y,
+                    z + (particleRandom() - 0.5f) * 0.1f, (particleRandom() - 0.5f) * s, s, (particleRandom() - 0.5f) * s);
+            }
+            else {
+                // Outward and a little up, then settling
+                float angle = particleRandom() * 2.0f * PI;
+                float r = s * (0.3f + 0.7f * particleRandom());
+                spawnParticle(kind, x, GROUND_Y + 0.02f, z, cosf(angle) * r, 0.3f * s * particleRandom(),
+                    sinf(angle) * r);
+            }
+        }
+    }
+}
+
+// New emitter events in the snapshot since the last frame
+void emitDiverParticles() {
+    ParticlePool& p = particles;
+    const Player& d = scene->diver;
+
+    unsigned int bubbles = d.bubbleEvents - p.bubblesSeen;
+    unsigned int silt = d.siltEvents - p.siltSeen;
+    p.bubblesSeen = d.bubbleEvents;
+    p.siltSeen = d.siltEvents;
+
+    emitAlongDiver(PARTICLE_BUBBLE, std::min(bubbles, MAX_EMIT_EVENTS));
+    emitAlongDiver(PARTICLE_SILT, std::min(silt, MAX_EMIT_EVENTS));
+}
+
+// One explicit Euler step for slots [begin, end): drag takes its share of
+// the velocity, buoyancy accelerates y and nothing sinks below the floor.
+// A dead slot's step is dt * 0, which leaves it exactly as it was.
+void integrateParticles(float dt, int begin, int end) {
+    ParticlePool& p = particles;
+    int i = begin;
+    const simdf vdt = simdSet(dt), one = simdSet(1.0f), floorY = simdSet(GROUND_Y);
+    for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH) {
+        simdf step = simdMul(vdt, simdLoad(p.alive + i));
+        simdf damp = simdSub(one, simdMul(step, simdLoad(p.drag + i)));
+        simdf vx = simdMul(simdLoad(p.velX + i), damp);
+        simdf vy = simdAdd(simdMul(simdLoad(p.velY + i), damp), simdMul(step, simdLoad(p.buoyancy + i)));
+        simdf vz = simdMul(simdLoad(p.velZ + i), damp);
+        simdStore(p.velX + i, vx);
+        simdStore(p.velY + i, vy);
+        simdStore(p.velZ + i, vz);
+        simdStore(p.posX + i, simdAdd(simdLoad(p.posX + i), simdMul(vx, step)));
+        simdStore(p.posY + i, simdMax(simdAdd(simdLoad(p.posY + i), simdMul(vy, step)), floorY));
+        simdStore(p.posZ + i, simdAdd(simdLoad(p.posZ + i), simdMul(vz, step)));
+        simdStore(p.life + i, simdSub(simdLoad(p.life + i), step));
+    }
+    for (; i < end; ++i) {
+        float step = dt * p.alive[i];
+        float damp = 1.0f - step * p.drag[i];
+        p.velX[i] *= damp;
+        p.velY[i] = p.velY[i] * damp + step * p.buoyancy[i];
+        p.velZ[i] *= damp;
+        p.posX[i] += p.velX[i] * step;
+        p.posY[i] = std::max(p.posY[i] + p.velY[i] * step, GROUND_Y);
+        p.posZ[i] += p.velZ[i] * step;
+        p.life[i] -= step;
+    }
+}
+
+// Integrate, retire what expired and count what is left
+void particleIntegrateJob(void* ctx, int begin, int end, int chunk) {
+    integrateParticles(*(const float*)ctx, begin, end);
+
+    ParticlePool& p = particles;
+    int live = 0;
+    for (int i = begin; i < end; ++i) {
+        if (p.alive[i] == 0.0f) continue;
+        if (p.life[i] <= 0.0f) p.alive[i] = 0.0f;
+        else ++live;
+    }
+    p.chunkLive[chunk] = live;
+    p.chunkFree[chunk] = (end - begin) - live;
+}
+
+// Live particles to sprites and free slots to the free list, each chunk
+// from its own cursors
+void particleWriteJob(void* ctx, int begin, int end, int chunk) {
+    (void)ctx;
+    ParticlePool& p = particles;
+    ParticleVertex* out = p.vertices + p.chunkLive[chunk];
+    int* freeOut = p.freeList + p.chunkFree[chunk];
+
+    for (int i = begin; i < end; ++i) {
+        if (p.alive[i] == 0.0f) {
+            *freeOut++ = i;
+            continue;
+        }
+
+        const ParticleKindInfo& info = particleKinds[p.kind[i]];
+        float a = info.color[3] * std::min(p.life[i] / info.fadeTime, 1.0f);
+        out->x = p.posX[i];
+        out->y = p.posY[i];
+        out->z = p.posZ[i];
+        out->size = info.size;
+        out->color[0] = (unsigned char)(info.color[0] * a * 255.0f + 0.5f);
+        out->color[1] = (unsigned char)(info.color[1] * a * 255.0f + 0.5f);
+        out->color[2] = (unsigned char)(info.color[2] * a * 255.0f + 0.5f);
+        out->color[3] = (unsigned char)(a * 255.0f + 0.5f);
+        ++out;
+    }
+}
+
+// Advance the pool by dt and rebuild the sprites and the free list. The
+// work is bounded by the high-water mark, which drops back as the top of
+// the pool empties.
+void stepParticles(float dt) {
+    ParticlePool& p = particles;
+    int n = p.highWater;
+    int chunks = parallelFor(n, PARTICLE_JOB_GRAIN, particleIntegrateJob, &dt);
+
+    int live = 0, numFree = 0;
+    for (int c = 0; c < chunks; ++c) {
+        int l = p.chunkLive[c], f = p.chunkFree[c];
+        p.chunkLive[c] = live;
+        p.chunkFree[c] = numFree;
+        live += l;
+        numFree += f;
+    }
+    parallelFor(n, PARTICLE_JOB_GRAIN, particleWriteJob, NULL);
+
+    // Free slots at the top come off the pool instead
+    while (p.highWater > 0 && p.alive[p.highWater - 1] == 0.0f) --p.highWater;
+    while (numFree > 0 && p.freeList[numFree - 1] >= p.highWater) --numFree;
+
+    p.live = p.numVertices = live;
+    p.numFree = numFree;
+    p.nextFree = 0;
+}
+
+// Emit, step by the sim time since the last frame and upload. Paused or
+// ended rounds leave the particles where they are.
+void updateParticles() {
+    ProfileScope prof("updateParticles");
+    ParticlePool& p = particles;
+
+    double now = (scene->tick + renderAlpha) * SIM_DT;
+    float dt = p.lastTime < 0.0 ? 0.0f : clampf((float)(now - p.lastTime), 0.0f, MAX_FRAME_DT);
+    p.lastTime = now;
+
+    emitDiverParticles();
+    stepParticles(dt);
+    frameStats.particles = p.numVertices;
+
+    if (!particleShadersActive() || p.numVertices == 0) return;
+    ptrdiff_t bytes = p.numVertices * sizeof(ParticleVertex);
+    ext.BindBuffer(GL_ARRAY_BUFFER, p.buffer);
+    ext.BufferData(GL_ARRAY_BUFFER, sizeof(p.vertices), NULL, GL_STREAM_DRAW);
+    ext.BufferSubData(GL_ARRAY_BUFFER, 0, bytes, p.vertices);
+    ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Every sprite in one draw, blended over the opaque scene without writing
+// depth. Premultiplied alpha lets bright bubbles and dull silt share the
+// blend function; they are not sorted.
+void drawParticles() {
+    ParticlePool& p = particles;
+    if (p.numVertices == 0) return;
+
+    loadViewMatrix();
+    setCap(CAP_LIGHTING, false);
+    setCap(CAP_BLEND, true);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_FALSE);
+
+    if (particleShadersActive()) {
+        setProgram(p.program);
+        glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+        glEnable(GL_POINT_SPRITE);
+        ext.BindBuffer(GL_ARRAY_BUFFER, p.buffer);
+        ext.EnableVertexAttribArray(PARTICLE_ATTRIB_POINT);
+        ext.EnableVertexAttribArray(PARTICLE_ATTRIB_COLOR);
+        ext.VertexAttribPointer(PARTICLE_ATTRIB_POINT, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleVertex),
+            (const void*)offsetof(ParticleVertex, x));
+        ext.VertexAttribPointer(PARTICLE_ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ParticleVertex),
+            (const void*)offsetof(ParticleVertex, color));
+        glDrawArrays(GL_POINTS, 0, p.numVertices);
+        ext.DisableVertexAttribArray(PARTICLE_ATTRIB_COLOR);
+        ext.DisableVertexAttribArray(PARTICLE_ATTRIB_POINT);
+        ext.BindBuffer(GL_ARRAY_BUFFER, 0);
+        glDisable(GL_POINT_SPRITE);
+        glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    }
+    else {
+        setProgram(0);
+        glPointSize(PARTICLE_FALLBACK_SIZE);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(ParticleVertex), &p.vertices[0].x);
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(ParticleVertex), p.vertices[0].color);
+        glDrawArrays(GL_POINTS, 0, p.numVertices);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glPointSize(1.0f);
+    }
+    invalidateColor();
+
+    glDepthMask(GL_TRUE);
+    setCap(CAP_BLEND, false);
+    setCap(CAP_LIGHTING, true);
+    ++frameStats.drawCalls;
+}
+
+// =========================
+// Text rendering (HUD)
+// =========================
+
+// Text is drawn from a glyph atlas: at startup every printable character
+// of the GLUT bitmap font is rasterized once, read back and uploaded as
+// an alpha texture. A TextBatch holds a few lines of text and their quads.
+// The quads are rebuilt only when a line's string changes, and the batch
+// draws in one call however many characters it holds. Without the atlas
+// (no window, or the read-back came out empty) the same batches fall back
+// to glutBitmapCharacter.
+
+// Set once a GLUT window exists; bitmap fonts are unavailable offscreen
+bool glutActive = false;
+
+void* const TEXT_FONT = GLUT_BITMAP_HELVETICA_18;
+const int FIRST_GLYPH = 32;
+const int NUM_GLYPHS = 95;          // ' ' .. '~'
+const int GLYPH_COLUMNS = 16;
+const int GLYPH_CELL_H = 24;        // line height of Helvetica 18
+const int GLYPH_BASELINE = 6;       // cell rows below the baseline
+const int GLYPH_PAD = 2;            // room for glyphs that start left of the pen
+
+struct GlyphAtlas {
+    bool   ready;
+    GLuint texture;
+    int    cellW;
+    int    texW, texH;
+    int    advance[NUM_GLYPHS];     // pixels
+    float  u0[NUM_GLYPHS], v0[NUM_GLYPHS];
+};
+
+GlyphAtlas glyphAtlas;
+
+int nextPowerOfTwo(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Needs the window's context, before the first frame: the glyphs are
+// drawn into the back buffer and read straight back
+void buildGlyphAtlas() {
+    if (!glutActive) return;
+
+    int maxAdvance = 0;
+    for (int g = 0; g < NUM_GLYPHS; ++g) {
+        glyphAtlas.advance[g] = glutBitmapWidth(TEXT_FONT, FIRST_GLYPH + g);
+        maxAdvance = std::max(maxAdvance, glyphAtlas.advance[g]);
+    }
+    int cellW = maxAdvance + 2 * GLYPH_PAD;
+    int rows = (NUM_GLYPHS + GLYPH_COLUMNS - 1) / GLYPH_COLUMNS;
+    int width = GLYPH_COLUMNS * cellW, height = rows * GLYPH_CELL_H;
+    if (width > VIEWPORT_W || height > VIEWPORT_H) return;
+
+    glViewport(0, 0, VIEWPORT_W, VIEWPORT_H);
+    setMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, VIEWPORT_W, 0, VIEWPORT_H, -1, 1);
+    setMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    setCap(CAP_LIGHTING, false);
+    setCap(CAP_DEPTH_TEST, false);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    setColor(1.0f, 1.0f, 1.0f);
+
+    for (int g = 0; g < NUM_GLYPHS; ++g) {
+        glRasterPos2i((g % GLYPH_COLUMNS) * cellW + GLYPH_PAD, (g / GLYPH_COLUMNS) * GLYPH_CELL_H + GLYPH_BASELINE);
+        glutBitmapCharacter(TEXT_FONT, FIRST_GLYPH + g);
+    }
+
+    // Red channel becomes alpha, rows kept bottom-up like GL textures
+    int texW = nextPowerOfTwo(width), texH = nextPowerOfTwo(height);
+    std::vector<unsigned char> rgb((size_t)width * height * 3);
+    std::vector<unsigned char> alpha((size_t)texW * texH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &rgb[0]);
+    bool any = false;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            unsigned char a = rgb[((size_t)y * width + x) * 3];
+            alpha[(size_t)y * texW + x] = a;
+            any = any || a != 0;
+        }
+    }
+
+    glClearColor(WATER_COLOR[0], WATER_COLOR[1], WATER_COLOR[2], 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    setCap(CAP_DEPTH_TEST, true);
+    setCap(CAP_LIGHTING, true);
+    if (!any) {
+        printf("Glyph atlas read-back was empty, using bitmap text\n");
+        return;
+    }
+
+    glyphAtlas.texture = acquireTexture();
+    if (glyphAtlas.texture == 0) return;
+
+    glBindTexture(GL_TEXTURE_2D, glyphAtlas.texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, texW, texH, 0, GL_ALPHA, GL_UNSIGNED_BYTE, &alpha[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (int g = 0; g < NUM_GLYPHS; ++g) {
+        glyphAtlas.u0[g] = (float)((g % GLYPH_COLUMNS) * cellW) / texW;
+        glyphAtlas.v0[g] = (float)((g / GLYPH_COLUMNS) * GLYPH_CELL_H) / texH;
+    }
+    glyphAtlas.cellW = cellW;
+    glyphAtlas.texW = texW;
+    glyphAtlas.texH = texH;
+    glyphAtlas.ready = true;
+}
+
+const int TEXT_MAX_LINES = 24;
+const int TEXT_MAX_CHARS = 96;
+
+struct TextLine {
+    char  text[TEXT_MAX_CHARS];
+    float x, y;                     // 0..1 across the viewport, baseline
+};
+
+// Quads as x, y, u, v per corner
+struct TextBatch {
+    TextLine lines[TEXT_MAX_LINES];
+    int   numLines;
+    bool  dirty;
+    float verts[TEXT_MAX_LINES * TEXT_MAX_CHARS * 16];
+    int   numVerts;
+};
+
+TextBatch hudText, endScreenText;
+
+void setTextLine(TextBatch& batch, int line, const char* text, float x, float y) {
+    if (line >= TEXT_MAX_LINES) return;
+
+    TextLine& l = batch.lines[line];
+    if (line < batch.numLines && l.x == x && l.y == y && strcmp(l.text, text) == 0) return;
+
+    snprintf(l.text, sizeof(l.text), "%s", text);
+    l.x = x;
+    l.y = y;
+    if (line >= batch.numLines) batch.numLines = line + 1;
+    batch.dirty = true;
+}
+
+// Drop lines from `count` on
+void truncateText(TextBatch& batch, int count) {
+    if (count >= batch.numLines) return;
+    batch.numLines = count;
+    batch.dirty = true;
+}
+
+void buildTextQuads(TextBatch& batch) {
+    const GlyphAtlas& at = glyphAtlas;
+    float du = (float)at.cellW / at.texW, dv = (float)GLYPH_CELL_H / at.texH;
+    float* v = batch.verts;
+
+    for (int i = 0; i < batch.numLines; ++i) {
+        const TextLine& l = batch.lines[i];
+
+        // Whole pixels, so the nearest-filtered glyphs land texel for pixel
+        float penX = floorf(l.x * viewportW + 0.5f) - GLYPH_PAD;
+        float y0 = floorf(l.y * viewportH + 0.5f) - GLYPH_BASELINE;
+        float y1 = y0 + GLYPH_CELL_H;
+
+        for (const char* c = l.text; *c; ++c) {
+            int g = (unsigned char)*c - FIRST_GLYPH;
+            if (g < 0 || g >= NUM_GLYPHS) continue;
+
+            float x0 = penX, x1 = penX + at.cellW;
+            float u0 = at.u0[g], u1 = u0 + du, v0 = at.v0[g], v1 = v0 + dv;
+            float quad[16] = { x0, y0, u0, v0,  x1, y0, u1, v0,  x1, y1, u1, v1,  x0, y1, u0, v1 };
+            memcpy(v, quad, sizeof(quad));
+            v += 16;
+            penX += at.advance[g];
+        }
+    }
+
+    batch.numVerts = (int)(v - batch.verts) / 4;
+    batch.dirty = false;
+}
+
+// Leaves the projection in pixels; the next frame's setupCamera() resets it
+void drawTextBatch(TextBatch& batch) {
+    if (!glutActive || batch.numLines == 0) return;
+
+    setMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, viewportW, 0, viewportH, -1, 1);
+    setMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    setCap(CAP_LIGHTING, false);
+    setCap(CAP_DEPTH_TEST, false);
+    setColor(1.0f, 1.0f, 1.0f);
+
+    if (!glyphAtlas.ready) {
+        for (int i = 0; i < batch.numLines; ++i) {
+            const TextLine& l = batch.lines[i];
+            glRasterPos2f(l.x * viewportW, l.y * viewportH);
+            for (const char* c = l.text; *c; ++c) glutBitmapCharacter(TEXT_FONT, *c);
+        }
+    }
+    else {
+        if (batch.dirty) buildTextQuads(batch);
+
+        setCap(CAP_TEXTURE_2D, true);
+        glBindTexture(GL_TEXTURE_2D, glyphAtlas.texture);
+        setCap(CAP_BLEND, true);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(2, GL_FLOAT, 4 * sizeof(float), batch.verts);
+        glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(float), batch.verts + 2);
+
+        glDrawArrays(GL_QUADS, 0, batch.numVerts);
+        ++frameStats.drawCalls;
+
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        setCap(CAP_BLEND, false);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        setCap(CAP_TEXTURE_2D, false);
+    }
+
+    setCap(CAP_DEPTH_TEST, true);
+    setCap(CAP_LIGHTING, true);
+}
+
+// Profiler overlay ('p'): rolling frame time, then one line per scope,
+// indented by depth, from line `first` of the HUD on. Shows the averages
+// as of the previous frame. Returns the next free line.
+int setProfilerLines(int first) {
+    char line[TEXT_MAX_CHARS];
+    int n = first;
+    float y = 0.85f;
+    const float lineHeight = 0.04f;
+
+    snprintf(line, sizeof(line), "frame %.2f ms (max %.2f)  draws %d  tris %ld  state %d (%d saved)  overdraw %.2f",
+        profiler.frameMs, profileMaxFrameMs(), frameStats.drawCalls, frameStats.triangles,
+        frameStats.stateChanges, frameStats.stateChangesSaved, frameStats.overdraw);
+    setTextLine(hudText, n++, line, 0.02f, y);
+    y -= lineHeight;
+    snprintf(line, sizeof(line), "lights %d  particles %d", frameStats.lights, frameStats.particles);
+    setTextLine(hudText, n++, line, 0.02f, y);
+
+    for (int i = 0; i < profiler.numStats && y > lineHeight && n < TEXT_MAX_LINES; ++i) {
+        const ProfileStat& s = profiler.stats[i];
+        y -= lineHeight;
+        if (profiler.gpuReady && s.depth == 1) {
+            snprintf(line, sizeof(line), "%*s%s  %.2f / gpu %.2f ms", s.depth * 2, "", s.name, s.cpuMs, s.gpuMs);
+        }
+        else {
+            snprintf(line, sizeof(line), "%*s%s  %.2f ms", s.depth * 2, "", s.name, s.cpuMs);
+        }
+        setTextLine(hudText, n++, line, 0.02f, y);
+    }
+    return n;
+}
+
+// What the HUD lines currently show, so they are only reformatted when
+// the value at display precision changes
+struct HudValues {
+    int oxygenTenths;
+    int coreTenths;
+};
+
+HudValues hudShown = { -1, -1 };
+
+void drawHUD() {
+    ProfileScope prof("drawHUD");
+    if (!glutActive) return;
+
+    char buffer[TEXT_MAX_CHARS];
+
+    // Oxygen timer
+    float o2 = scene->oxygenTime;
+    int tenths = (int)((o2 > 0.0f ? o2 : 0.0f) * 10.0f + 0.5f);
+    if (tenths != hudShown.oxygenTenths) {
+        hudShown.oxygenTenths = tenths;
+        snprintf(buffer, sizeof(buffer), "O2 Left: %d.%d", tenths / 10, tenths % 10);
+        setTextLine(hudText, 0, buffer, 0.02f, 0.95f);
+    }
+
+    // Distance from the diver to the oxygen core
+    const Vector3f& d = scene->diver.pos;
+    const Vector3f& c = scene->core.pos;
+    float dist = sqrtf((c.x - d.x) * (c.x - d.x) + (c.y - d.y) * (c.y - d.y) + (c.z - d.z) * (c.z - d.z));
+    tenths = (int)(dist * 10.0f + 0.5f);
+    if (tenths != hudShown.coreTenths) {
+        hudShown.coreTenths = tenths;
+        snprintf(buffer, sizeof(buffer), "Core: %d.%d m", tenths / 10, tenths % 10);
+        setTextLine(hudText, 1, buffer, 0.75f, 0.95f);
+    }
+
+    truncateText(hudText, profiler.overlay ? setProfilerLines(2) : 2);
+    drawTextBatch(hudText);
+}
+
+// =========================
+// Collision broadphase
+// =========================
+
+// Collision volume per env type: a vertical cylinder around the object's
+// Y axis (yaw-invariant, so rotating models need no update), sized from
+// the model dimensions. Heights are relative to the object position.
+struct EnvCollider {
+    float radius;
+    float minY, maxY;
+};
+
+const EnvCollider envColliders[NUM_ENV_TYPES] = {
+    { 0.45f, 0.0f, 1.30f },   // floodlight tower: base plate and pole
+    { 0.35f, 0.0f, 1.20f },   // sonar array: control module and mast
+    { 0.60f, 0.0f, 0.45f },   // supply crates
+    { 0.35f, 0.3f, 0.60f },   // repair drone: hovers at +0.4
+    { 0.50f, 0.0f, 0.45f }    // oxygen tanks
+};
+
+const float DIVER_HEIGHT = 1.15f;   // feet to top of helmet
+const float GRID_CELL_SIZE = 1.0f;  // world units per grid cell
+
+// Uniform grid over the env objects' XZ footprint. Each object is listed
+// in every cell its collider overlaps (CSR layout: cellStart/cellItems),
+// so a query only looks at the cells under the diver. Rebuilt lazily when
+// the store's version changes; objects themselves never move.
+struct EnvGrid {
+    float minX, minZ;
+    int   cellsX, cellsZ;
+    std::vector<int> cellStart;     // cellsX * cellsZ + 1 offsets
+    std::vector<int> cellItems;
+    std::vector<unsigned int> stamp;  // per object, dedups multi-cell hits
+    unsigned int queryStamp;
+    unsigned int builtVersion;
+    bool built;
+};
+
+EnvGrid envGrid;
+
+int gridCellX(float x) {
+    int c = (int)floorf((x - envGrid.minX) / GRID_CELL_SIZE);
+    return c < 0 ? 0 : (c >= envGrid.cellsX ? envGrid.cellsX - 1 : c);
+}
+
+int gridCellZ(float z) {
+    int c = (int)floorf((z - envGrid.minZ) / GRID_CELL_SIZE);
+    return c < 0 ? 0 : (c >= envGrid.cellsZ ? envGrid.cellsZ - 1 : c);
+}
+
+void rebuildEnvGrid() {
+    int n = envStore.count;
+    EnvGrid& g = envGrid;
+
+    // Bounds from the objects themselves so larger bases just grow the grid
+    float minX = -worldHalfSize, maxX = worldHalfSize;
+    float minZ = -worldHalfSize, maxZ = worldHalfSize;
+    for (int i = 0; i < n; ++i) {
+        minX = fminf(minX, envStore.posX[i]);
+        maxX = fmaxf(maxX, envStore.posX[i]);
+        minZ = fminf(minZ, envStore.posZ[i]);
+        maxZ = fmaxf(maxZ, envStore.posZ[i]);
+    }
+    g.minX = minX - GRID_CELL_SIZE;
+    g.minZ = minZ - GRID_CELL_SIZE;
+    g.cellsX = (int)((maxX - minX) / GRID_CELL_SIZE) + 3;
+    g.cellsZ = (int)((maxZ - minZ) / GRID_CELL_SIZE) + 3;
+
+    int numCells = g.cellsX * g.cellsZ;
+    g.cellStart.assign(numCells + 1, 0);
+
+    // Counting pass, prefix sum, then fill
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            float r = envColliders[envStore.type[i]].radius;
+            int x0 = gridCellX(envStore.posX[i] - r), x1 = gridCellX(envStore.posX[i] + r);
+            int z0 = gridCellZ(envStore.posZ[i] - r), z1 = gridCellZ(envStore.posZ[i] + r);
+
+            for (int cz = z0; cz <= z1; ++cz) {
+                for (int cx = x0; cx <= x1; ++cx) {
+                    int cell = cz * g.cellsX + cx;
+                    if (pass == 0) ++g.cellStart[cell + 1];
+                    else g.cellItems[g.cellStart[cell]++] = i;
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (int c = 0; c < numCells; ++c) g.cellStart[c + 1] += g.cellStart[c];
+            g.cellItems.resize(g.cellStart[numCells]);
+        }
+        else {
+            // The fill advanced every start to the next cell's start
+            for (int c = numCells; c > 0; --c) g.cellStart[c] = g.cellStart[c - 1];
+            g.cellStart[0] = 0;
+        }
+    }
+
+    g.stamp.assign(n, 0);
+    g.queryStamp = 0;
+    g.builtVersion = envStore.version;
+    g.built = true;
+}
+
+// Diver (feet at p, horizontal radius) against env object i. On overlap
+// returns true and the XZ vector that pushes the diver out.
+bool overlapEnvObject(int i, const Vector3f& p, float radius, float& pushX, float& pushZ) {
+    const EnvCollider& c = envColliders[envStore.type[i]];
+    float baseY = envStore.posY[i];
+    if (p.y > baseY + c.maxY || p.y + DIVER_HEIGHT < baseY + c.minY) return false;
+
+    float dx = p.x - envStore.posX[i];
+    float dz = p.z - envStore.posZ[i];
+    float rSum = radius + c.radius;
+    float d2 = dx * dx + dz * dz;
+    if (d2 >= rSum * rSum) return false;
+
+    float d = sqrtf(d2);
+    if (d < 0.0001f) {
+        pushX = rSum;   // dead center: pick a direction
+        pushZ = 0.0f;
+    }
+    else {
+        pushX = dx / d * (rSum - d);
+        pushZ = dz / d * (rSum - d);
+    }
+    return true;
+}
+
+// Test the objects in the cells under a diver at p; returns the overlaps
+// found and, with resolve, applies each push-out to p
+int queryEnvGrid(Vector3f& p, float radius, bool resolve) {
+    if (!envGrid.built || envGrid.builtVersion != envStore.version) rebuildEnvGrid();
+
+    EnvGrid& g = envGrid;
+    if (++g.queryStamp == 0) {
+        g.stamp.assign(g.stamp.size(), 0);
+        g.queryStamp = 1;
+    }
+
+    int x0 = gridCellX(p.x - radius), x1 = gridCellX(p.x + radius);
+    int z0 = gridCellZ(p.z - radius), z1 = gridCellZ(p.z + radius);
+    int hits = 0;
+
+    for (int cz = z0; cz <= z1; ++cz) {
+        for (int cx = x0; cx <= x1; ++cx) {
+            int cell = cz * g.cellsX + cx;
+            for (int k = g.cellStart[cell]; k < g.cellStart[cell + 1]; ++k) {
+                int i = g.cellItems[k];
+                if (g.stamp[i] == g.queryStamp) continue;
+                g.stamp[i] = g.queryStamp;
+
+                float pushX, pushZ;
+                if (overlapEnvObject(i, p, radius, pushX, pushZ)) {
+                    ++hits;
+                    if (resolve) {
+                        p.x += pushX;
+                        p.z += pushZ;
+                    }
+                }
+            }
+        }
+    }
+    return hits;
+}
+
+// Reference all-pairs scan, used by the broadphase benchmark
+int queryEnvBruteForce(const Vector3f& p, float radius) {
+    int hits = 0;
+    float pushX, pushZ;
+    for (int i = 0; i < envStore.count; ++i) {
+        if (overlapEnvObject(i, p, radius, pushX, pushZ)) ++hits;
+    }
+    return hits;
+}
+
+// Push the diver out of every env object it ended up inside
+void resolveEnvCollisions() {
+    queryEnvGrid(diver.pos, diver.radius, true);
+}
+
+// =========================
+// Game logic
+// =========================
+
+void clampDiverToWorld() {
+    diver.pos.x = clampf(diver.pos.x, -worldHalfSize + 0.3f, worldHalfSize - 0.3f);
+    diver.pos.z = clampf(diver.pos.z, -worldHalfSize + 0.3f, worldHalfSize - 0.3f);
+    diver.pos.y = clampf(diver.pos.y, GROUND_Y, maxHeight);
+
+    diver.onGround = (fabs(diver.pos.y - GROUND_Y) < 0.001f);
+}
+
+void checkGoalCollision() {
+    if (oxygenCore.collected) return;
+    float rSum = diver.radius + oxygenCore.radius;
+    if (distSquared(diver.pos, oxygenCore.pos) <= rSum * rSum) {
+        oxygenCore.collected = true;
+        if (gameState == GAME_PLAYING && oxygenTime > 0.0f) {
+            gameState = GAME_WIN;
+        }
+    }
+}
+
+const unsigned int SILT_LANDING_EVENTS = 12;   // a landing kicks up a plume
+
+// Handle diver translation plus required rotations
+void moveDiver(float dx, float dy, float dz) {
+    bool wasOnGround = diver.onGround;
+    float startY = diver.pos.y;
+
+    diver.pos.x += dx;
+    diver.pos.y += dy;
+    diver.pos.z += dz;
+
+    // Update yaw if there is horizontal movement
+    if (fabs(dx) > 0.0001f || fabs(dz) > 0.0001f) {
+        diver.rotY = RAD2DEG(atan2f(-dx, dz));
+    }
+
+    clampDiverToWorld();
+
+    // Solid environment objects, then the walls again in case a push-out
+    // moved the diver past them
+    resolveEnvCollisions();
+    clampDiverToWorld();
+
+    // Ground/air tilt rules
+    if (diver.onGround) {
+        diver.rotX = 0.0f;
+    }
+    else if (wasOnGround && !diver.onGround) {
+        diver.rotX = 25.0f;
+    }
+    updateDiverWorld();
+
+    // Bubbles while rising or sinking, silt while on the floor
+    if (diver.pos.y != startY) ++diver.bubbleEvents;
+    if (diver.onGround) diver.siltEvents += wasOnGround ? 1 : SILT_LANDING_EVENTS;
+
+    checkGoalCollision();
+}
+
+// Movement keys act for as long as they are held, at a fixed speed per
+// tick, so how fast the diver or camera moves no longer depends on the
+// OS key-repeat rate. Presses of the other keys are one-shot actions.
+// All of this is simulation state: in windowed runs the key events
+// arrive through the input queue below.
+
+const float DIVER_SPEED = 5.0f;          // units per second
+const float CAMERA_SPEED = 3.0f;         // units per second
+const float CAMERA_TURN_SPEED = 60.0f;   // degrees per second
+
+// ASCII keys at their code, GLUT special keys at SPECIAL_KEY_BASE + code
+const int SPECIAL_KEY_BASE = 256;
+std::bitset<512> heldKeys;
+
+float heldAxis(int positive, int negative) {
+    return (heldKeys[positive] ? 1.0f : 0.0f) - (heldKeys[negative] ? 1.0f : 0.0f);
+}
+
+// One-shot actions on a key press. Touches no GL/GLUT state, so scripted
+// input can drive it in headless runs exactly like the keyboard does.
+void handleGameKey(unsigned char key) {
+    if (gameState != GAME_PLAYING) return;
+
+    // Toggle environment animations (z, x, c, v, b)
+    if (key == 'z') {
+        toggleEnvAnimation(0);
+    }
+    else if (key == 'x') {
+        toggleEnvAnimation(1);
+    }
+    else if (key == 'c') {
+        toggleEnvAnimation(2);
+    }
+    else if (key == 'v') {
+        toggleEnvAnimation(3);
+    }
+    else if (key == 'b') {
+        toggleEnvAnimation(4);
+    }
+
+    // Camera preset views (security cams)
+    if (key == '1') { // front view
+        camera.eye = Vector3f(0.0f, 3.0f, 10.0f);
+        camera.center = Vector3f(0.0f, 0.5f, 0.0f);
+        camera.up = Vector3f(0.0f, 1.0f, 0.0f);
+    }
+    else if (key == '2') { // side view
+        camera.eye = Vector3f(10.0f, 3.0f, 0.0f);
+        camera.center = Vector3f(0.0f, 0.5f, 0.0f);
+        camera.up = Vector3f(0.0f, 1.0f, 0.0f);
+    }
+    else if (key == '3') { // top sonar view
+        camera.eye = Vector3f(0.0f, 15.0f, 0.01f);
+        camera.center = Vector3f(0.0f, 0.0f, 0.0f);
+        camera.up = Vector3f(0.0f, 0.0f, -1.0f);
+    }
+}
+
+// False for a repeat of a key that is already down
+bool keyDown(int code) {
+    if (heldKeys[code]) return false;
+    heldKeys.set(code);
+    if (code < SPECIAL_KEY_BASE) handleGameKey((unsigned char)code);
+    return true;
+}
+
+void keyUp(int code) {
+    heldKeys.reset(code);
+}
+
+// Camera controls from original lab solution, scaled per tick
+void CameraKeyboard(unsigned char key, float d) {
+    switch (key) {
+    case 'w':
+        camera.moveY(d);
+        break;
+    case 's':
+        camera.moveY(-d);
+        break;
+    case 'a':
+        camera.moveX(d);
+        break;
+    case 'd':
+        camera.moveX(-d);
+        break;
+    case 'q':
+        camera.moveZ(d);
+        break;
+    case 'e':
+        camera.moveZ(-d);
+        break;
+    default:
+        break;
+    }
+}
+
+void CameraSpecial(int key, float a) {
+    switch (key) {
+    case GLUT_KEY_UP:
+        camera.rotateX(a);
+        break;
+    case GLUT_KEY_DOWN:
+        camera.rotateX(-a);
+        break;
+    case GLUT_KEY_LEFT:
+        camera.rotateY(a);
+        break;
+    case GLUT_KEY_RIGHT:
+        camera.rotateY(-a);
+        break;
+    }
+}
+
+// Called once per tick; true if anything moved
+bool applyHeldKeys(float dt) {
+    bool moved = false;
+
+    // Diver: one move along the combined direction, so diagonals are
+    // not faster than straight lines
+    float vx = heldAxis('l', 'j');
+    float vy = heldAxis('u', 'o');
+    float vz = heldAxis('i', 'k');
+    float len2 = vx * vx + vy * vy + vz * vz;
+    if (len2 > 0.0f) {
+        float step = DIVER_SPEED * dt / sqrtf(len2);
+        moveDiver(vx * step, vy * step, vz * step);
+        moved = true;
+    }
+
+    const char cameraKeys[] = "wsadqe";
+    for (int k = 0; k < 6; ++k) {
+        if (!heldKeys[(unsigned char)cameraKeys[k]]) continue;
+        CameraKeyboard(cameraKeys[k], CAMERA_SPEED * dt);
+        moved = true;
+    }
+
+    const int arrows[] = { GLUT_KEY_UP, GLUT_KEY_DOWN, GLUT_KEY_LEFT, GLUT_KEY_RIGHT };
+    for (int k = 0; k < 4; ++k) {
+        if (!heldKeys[SPECIAL_KEY_BASE + arrows[k]]) continue;
+        CameraSpecial(arrows[k], CAMERA_TURN_SPEED * dt);
+        moved = true;
+    }
+
+    return moved;
+}
+
+// Advance the game by an explicit time step: held-key movement, oxygen
+// timer, core spin, wall lights and environment animations. No GL context required.
+void stepSimulation(float dt) {
+    if (gameState != GAME_PLAYING) return;
+
+    // Diver and camera movement from held keys
+    if (applyHeldKeys(dt)) ++simClock.inputApplied;
+
+    // Oxygen timer
+    oxygenTime -= dt;
+    if (oxygenTime <= 0.0f && !oxygenCore.collected) {
+        oxygenTime = 0.0f;
+        gameState = GAME_LOSE;
+    }
+
+    // Oxygen core animation
+    oxygenCore.spinAngle += 60.0f * dt;
+    if (oxygenCore.spinAngle > 360.0f) oxygenCore.spinAngle -= 360.0f;
+
+    // Wall light phase
+    wallColorPhase += 1.5f * dt;
+
+    // Animate environment objects and rebuild their matrices
+    updateEnvObjects(dt);
+}
+
+// Called after a tick that ended the round; unattended runs use it to
+// start the next one
+void (*roundOverHook)() = NULL;
+
+// Called before every tick; replay playback feeds its key events here
+void (*tickInputHook)() = NULL;
+
+// One fixed tick, shared by the frame accumulator and the sim thread
+void runSimTick() {
+    if (tickInputHook) tickInputHook();
+    savePrevSimState();
+    stepSimulation(SIM_DT);
+    ++simClock.totalTicks;
+    simClock.lastTickTime = nowSeconds();
+
+    if (roundOverHook && gameState != GAME_PLAYING) roundOverHook();
+}
+
+// Run as many fixed ticks as the elapsed frame time covers, then hand the
+// result to the renderer
+void advanceSimulation(float frameDt) {
+    if (frameDt > MAX_FRAME_DT) frameDt = MAX_FRAME_DT;
+    simClock.accumulator += frameDt;
+    simClock.ticksThisFrame = 0;
+
+    while (simClock.accumulator >= SIM_DT) {
+        simClock.accumulator -= SIM_DT;   // before the tick: a reset zeroes it
+        runSimTick();
+        ++simClock.ticksThisFrame;
+    }
+
+    simClock.alpha = (float)(simClock.accumulator / SIM_DT);
+    publishSnapshot();
+}
+
+// =========================
+// Rendering the end screens
+// =========================
+
+void drawEndScreen(const char* msg) {
+    ProfileScope prof("drawEndScreen");
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    setTextLine(endScreenText, 0, msg, 0.4f, 0.5f);
+    drawTextBatch(endScreenText);
+}
+
+// =========================
+// Frame scheduler
+// =========================
+
+// Paces the idle loop to a target frame rate by sleeping rather than
+// spinning. In dirty-only mode a tick only requests a redraw when
+// something visible changed: end screens are drawn once, and with every
+// env object paused the scene redraws when the HUD timer text changes
+// (10 Hz) or on input. CPU use and frame-interval jitter are printed
+// every REPORT_SECONDS.
+
+const double REPORT_SECONDS = 5.0;
+
+struct FrameScheduler {
+    int    targetFps;        // 0 = no cap
+    bool   vsync;
+    bool   dirtyOnly;
+    double nextFrame;        // start of the next frame slot
+
+    // What the last presented frame showed
+    int    shownState;
+    int    shownHudTenths;
+    long   shownInput;
+    double shownInputTime;
+    unsigned int runningVersion, runningStaticVersion;
+    bool   anyRunning;       // cached, recounted when the scene's env changes
+
+    // Current report window
+    double reportStart, reportCpuStart, lastPresent;
+    long   reportStartTick;
+    int    framesShown, framesSkipped;
+    double sumInterval, sumIntervalSq, maxInterval;
+    int    latencySamples;   // key presses that reached the screen
+    double sumLatency, maxLatency;
+};
+
+FrameScheduler scheduler;
+
+void resetScheduleReport() {
+    scheduler.reportStart = nowSeconds();
+    scheduler.reportCpuStart = processCpuSeconds();
+    scheduler.lastPresent = 0.0;
+    scheduler.reportStartTick = scene->tick;
+    scheduler.framesShown = scheduler.framesSkipped = 0;
+    scheduler.sumInterval = scheduler.sumIntervalSq = scheduler.maxInterval = 0.0;
+    scheduler.latencySamples = 0;
+    scheduler.sumLatency = scheduler.maxLatency = 0.0;
+}
+
+void initScheduler(int targetFps, bool vsync, bool dirtyOnly) {
+    scheduler.targetFps = targetFps;
+    scheduler.vsync = vsync;
+    scheduler.dirtyOnly = dirtyOnly;
+    scheduler.nextFrame = nowSeconds();
+    scheduler.shownState = -1;
+    scheduler.shownHudTenths = -1;
+    scheduler.shownInput = -1;
+    scheduler.shownInputTime = scene->inputTime;
+    scheduler.runningVersion = scene->env.version - 1;
+    resetScheduleReport();
+
+#ifdef _WIN32
+    timeBeginPeriod(1);   // 1 ms sleep granularity for the pacer
+#endif
+}
+
+// Swap interval through whichever extension the platform has; needs the
+// window's context
+void applySwapInterval() {
+    typedef int (APIENTRY * SwapIntervalProc)(int);
+    const char* names[] = { "wglSwapIntervalEXT", "glXSwapIntervalMESA", "glXSwapIntervalSGI" };
+    for (int i = 0; i < 3; ++i) {
+        SwapIntervalProc fn = NULL;
+        if (loadGLProc(fn, names[i])) {
+            fn(scheduler.vsync ? 1 : 0);
+            return;
+        }
+    }
+    if (scheduler.vsync) printf("Vsync control unavailable, relying on the frame pacer\n");
+}
+
+// Block until this tick's frame slot. Falling more than a frame behind
+// restarts the schedule instead of bursting to catch up.
+void paceFrame() {
+    if (scheduler.targetFps <= 0) return;
+
+    double period = 1.0 / scheduler.targetFps;
+    sleepUntil(scheduler.nextFrame);
+
+    double now = nowSeconds();
+    scheduler.nextFrame += period;
+    if (now - scheduler.nextFrame > period) scheduler.nextFrame = now + period;
+}
+
+int hudTenths() {
+    return (int)(scene->oxygenTime * 10.0f);
+}
+
+bool anyEnvAnimating() {
+    const EnvObjectStore& env = scene->env;
+    if (scheduler.runningVersion != env.version ||
+        scheduler.runningStaticVersion != env.staticVersion) {
+        scheduler.anyRunning = false;
+        for (int i = 0; i < env.count && !scheduler.anyRunning; ++i) {
+            scheduler.anyRunning = env.running[i] != 0.0f;
+        }
+        scheduler.runningVersion = env.version;
+        scheduler.runningStaticVersion = env.staticVersion;
+    }
+    return scheduler.anyRunning;
+}
+
+// Dirty-only mode: does the latest snapshot differ from what the last
+// frame showed?
+bool sceneChanged() {
+    if (scene->state != scheduler.shownState) return true;
+    if (scene->inputApplied != scheduler.shownInput) return true;
+    if (scene->state != GAME_PLAYING) return false;
+    return anyEnvAnimating() || hudTenths() != scheduler.shownHudTenths;
+}
+
+// Called after every swap
+void notePresentedFrame() {
+    double now = nowSeconds();
+    if (scheduler.lastPresent > 0.0) {
+        double interval = now - scheduler.lastPresent;
+        scheduler.sumInterval += interval;
+        scheduler.sumIntervalSq += interval * interval;
+        if (interval > scheduler.maxInterval) scheduler.maxInterval = interval;
+    }
+    scheduler.lastPresent = now;
+    ++scheduler.framesShown;
+
+    scheduler.shownState = scene->state;
+    scheduler.shownHudTenths = hudTenths();
+    scheduler.shownInput = scene->inputApplied;
+
+    // Input-to-photon: from GLUT reporting the newest key press to the swap
+    // of the first frame built from a snapshot that applied it
+    if (scene->inputTime != scheduler.shownInputTime) {
+        double latency = now - scene->inputTime;
+        scheduler.sumLatency += latency;
+        if (latency > scheduler.maxLatency) scheduler.maxLatency = latency;
+        ++scheduler.latencySamples;
+        scheduler.shownInputTime = scene->inputTime;
+    }
+}
+
+void reportSchedule() {
+    double now = nowSeconds();
+    double wall = now - scheduler.reportStart;
+    if (wall < REPORT_SECONDS) return;
+
+    double cpu = processCpuSeconds() - scheduler.reportCpuStart;
+    int intervals = scheduler.framesShown - 1;
+    double mean = 0.0, jitter = 0.0;
+    if (intervals > 0) {
+        mean = scheduler.sumInterval / intervals;
+        double var = scheduler.sumIntervalSq / intervals - mean * mean;
+        jitter = var > 0.0 ? sqrt(var) : 0.0;
+    }
+
+    printf("frames: %.1f fps (target %d%s), %ld ticks, %d skipped, interval %.2f ms, "
+        "jitter %.2f ms, max %.2f ms, cpu %.0f%%\n",
+        scheduler.framesShown / wall, scheduler.targetFps, scheduler.vsync ? ", vsync" : "",
+        scene->tick - scheduler.reportStartTick, scheduler.framesSkipped, mean * 1000.0, jitter * 1000.0,
+        scheduler.maxInterval * 1000.0, cpu / wall * 100.0);
+    if (scheduler.latencySamples > 0) {
+        printf("input: %d presses shown, latency %.1f ms avg, %.1f ms max\n", scheduler.latencySamples,
+            scheduler.sumLatency / scheduler.latencySamples * 1000.0, scheduler.maxLatency * 1000.0);
+    }
+    resetScheduleReport();
+}
+
+// =========================
+// Render queue
+// =========================
+
+// Each frame the scene is gathered into items with a 64-bit key, sorted,
+// then drawn in key order:
+//
+//   63..60  pass      opaque first, then particles, then the overlay (HUD)
+//   59..50  depth     view depth in 1024 steps, nearest first
+//   49..40  material  vertex setup shared by a run of items
+//   39..24  mesh
+//   23..0   slot      the item's place in the queue
+//
+// Drawing opaque items front to back lets the depth test throw away hidden
+// fragments before they are lit. With sorting off ('f', --no-sort) the key is just pass
+// and slot, which is the old fixed order. The sort is stable, so items
+// with equal keys keep the order they were queued in.
+
+enum RenderPass {
+    PASS_OPAQUE,
+    PASS_TRANSPARENT,
+    PASS_OVERLAY
+};
+
+// What a run of items has bound; each change costs a setup and a teardown
+enum RenderMaterial {
+    MATERIAL_NONE,
+    MATERIAL_STATIC,      // the static batch's vertex arrays
+    MATERIAL_INSTANCED,   // the instancing program
+    MATERIAL_LISTS,       // display lists or immediate mode
+    MATERIAL_PARTICLES,
+    MATERIAL_OVERLAY
+};
+
+enum RenderItemKind {
+    ITEM_STATIC_FLOOR,
+    ITEM_STATIC_TILE,
+    ITEM_STATIC_WALLS,
+    ITEM_FLOOR,
+    ITEM_WALLS,
+    ITEM_ENV_OBJECT,
+    ITEM_INSTANCES,
+    ITEM_CORE,
+    ITEM_DIVER,
+    ITEM_PARTICLES,
+    ITEM_HUD
+};
+
+const unsigned char ITEM_MATERIAL[] = {
+    MATERIAL_STATIC, MATERIAL_STATIC, MATERIAL_STATIC,
+    MATERIAL_LISTS, MATERIAL_LISTS, MATERIAL_LISTS,
+    MATERIAL_INSTANCED,
+    MATERIAL_LISTS, MATERIAL_LISTS,
+    MATERIAL_PARTICLES,
+    MATERIAL_OVERLAY
+};
+
+const int KEY_DEPTH_BITS = 10;
+const unsigned int FAR_DEPTH = (1u << KEY_DEPTH_BITS) - 1;
+const uint64_t KEY_SLOT_MASK = 0xFFFFFF;
+const int MESH_STATIC_TILE = NUM_MESHES;   // baked tiles share no mesh
+
+struct RenderItem {
+    unsigned char kind;
+    unsigned char lod;
+    int index;            // tile, env object or instance bucket
+};
+
+struct RenderQueue {
+    std::vector<RenderItem> items;        // in queue order, grows only
+    std::vector<uint64_t> keys, scratch;
+    int count;
+};
+
+RenderQueue renderQueue;
+
+void pushRenderItem(int kind, int index, int lod, unsigned int depth, int mesh) {
+    int slot = renderQueue.count++;
+    RenderItem& item = renderQueue.items[slot];
+    item.kind = (unsigned char)kind;
+    item.lod = (unsigned char)lod;
+    item.index = index;
+
+    uint64_t pass = kind == ITEM_HUD ? PASS_OVERLAY : (kind == ITEM_PARTICLES ? PASS_TRANSPARENT : PASS_OPAQUE);
+    uint64_t key = (pass << 60) | (uint64_t)slot;
+    if (useRenderSort) {
+        key |= ((uint64_t)depth << 50) | ((uint64_t)ITEM_MATERIAL[kind] << 40) | ((uint64_t)mesh << 24);
+    }
+    renderQueue.keys[slot] = key;
+}
+
+unsigned int itemDepth(float x, float y, float z) {
+    return quantizeDepth(viewDepth(x, y, z), KEY_DEPTH_BITS);
+}
+
+// Seen from inside the base everything is in front of the walls. From
+// outside (the offscreen orbit) the near wall hides much of the scene, so
+// they go by their closest point.
+unsigned int wallsDepth() {
+    const float wallHeight = 2.5f;   // as in drawWallsModel()
+    const Vector3f& eye = viewFrustum.eye;
+    float w = worldHalfSize;
+    if (fabsf(eye.x) < w && fabsf(eye.z) < w) return FAR_DEPTH;
+
+    return itemDepth(clampf(eye.x, -w, w), clampf(eye.y, 0.0f, wallHeight), clampf(eye.z, -w, w));
+}
+
+// Floor, walls and, when batched, the baked tiles. Nothing is ever below
+// the floor, so it always goes last.
+void queueStaticGeometry() {
+    unsigned int walls = wallsDepth();
+    if (!staticBatchActive()) {
+        pushRenderItem(ITEM_FLOOR, 0, 0, FAR_DEPTH, MESH_FLOOR);
+        pushRenderItem(ITEM_WALLS, 0, 0, walls, MESH_WALLS);
+        return;
+    }
+
+    updateStaticBatch();
+    pushRenderItem(ITEM_STATIC_FLOOR, 0, 0, FAR_DEPTH, MESH_FLOOR);
+    for (int c = 0; c < NUM_STATIC_CHUNKS; ++c) {
+        const StaticChunk& chunk = staticBatch.chunks[c];
+        if (chunk.numObjects == 0) continue;
+
+        int lod = selectChunkLod(chunk);
+        if (lod < 0) {
+            frameStats.objectsCulled += chunk.numObjects;
+            continue;
+        }
+        frameStats.objectsDrawn += chunk.numObjects;
+
+        // By the nearest point of the tile's bounding sphere
+        float depth = viewDepth(chunk.center[0], chunk.center[1], chunk.center[2]) - chunk.radius;
+        pushRenderItem(ITEM_STATIC_TILE, c, lod, quantizeDepth(depth, KEY_DEPTH_BITS), MESH_STATIC_TILE);
+    }
+    pushRenderItem(ITEM_STATIC_WALLS, 0, 0, walls, MESH_WALLS);
+}
+
+// Visibility runs in parallel either way. Instanced, a bucket is one item
+// placed by its nearest instance; otherwise every visible object is an
+// item, queued by type and LOD so the unsorted order keeps each mesh's
+// display list back to back.
+void queueEnvObjects() {
+    int n = scene->env.count;
+    if (n == 0) return;
+
+    if (useInstancing && instancing.ready) {
+        uploadInstances();
+        for (int b = 0; b < NUM_INSTANCE_BUCKETS; ++b) {
+            if (instancing.bucketCount[b] == 0) continue;
+
+            const float* inst = &instancing.instanceData[4 * instancing.bucketStart[b]];
+            pushRenderItem(ITEM_INSTANCES, b, b % NUM_LODS, itemDepth(inst[0], inst[1], inst[2]),
+                envTypeInfo[b / NUM_LODS].mesh);
+        }
+        return;
+    }
+
+    if ((int)envVis.drawOrder.size() < n) envVis.drawOrder.resize(n);
+
+    cullEnvObjects();
+    int bucketStart[NUM_INSTANCE_BUCKETS], bucketCount[NUM_INSTANCE_BUCKETS];
+    int visible = envBucketOffsets(bucketStart, bucketCount);
+    parallelFor(n, ENV_JOB_GRAIN, drawOrderScatterJob, NULL);
+
+    for (int k = 0; k < visible; ++k) {
+        int i = envVis.drawOrder[k];
+        const float* m = envDrawWorld(i).m;
+        pushRenderItem(ITEM_ENV_OBJECT, i, envVis.bucketOf[i] % NUM_LODS, itemDepth(m[12], m[13], m[14]),
+            envTypeInfo[scene->env.type[i]].mesh);
+    }
+}
+
+void queueCoreAndDiver() {
+    const Goal& core = scene->core;
+    if (!core.collected) {
+        int lod = selectLod(MESH_CORE, core.pos.x, core.pos.y, core.pos.z);
+        if (lod >= 0) pushRenderItem(ITEM_CORE, 0, lod, itemDepth(core.pos.x, core.pos.y, core.pos.z), MESH_CORE);
+    }
+
+    Vector3f pos = renderDiverPos();
+    int lod = selectLod(MESH_DIVER, pos.x, pos.y, pos.z);
+    if (lod >= 0) pushRenderItem(ITEM_DIVER, 0, lod, itemDepth(pos.x, pos.y, pos.z), MESH_DIVER);
+}
+
+// Needs the camera for this frame
+void buildRenderQueue() {
+    ProfileScope prof("buildRenderQueue");
+
+    // Floor, walls, every tile and object, core, diver, particles and HUD at most
+    int capacity = NUM_STATIC_CHUNKS + std::max(scene->env.count, NUM_INSTANCE_BUCKETS) + 6;
+    if ((int)renderQueue.items.size() < capacity) {
+        renderQueue.items.resize(capacity);
+        renderQueue.keys.resize(capacity);
+        renderQueue.scratch.resize(capacity);
+    }
+
+    renderQueue.count = 0;
+    queueStaticGeometry();
+    queueEnvObjects();
+    queueCoreAndDiver();
+    if (particles.numVertices > 0) pushRenderItem(ITEM_PARTICLES, 0, 0, 0, 0);
+    pushRenderItem(ITEM_HUD, 0, 0, 0, 0);
+}
+
+// Only the bytes above the slot; those all equal are skipped
+void sortRenderQueue() {
+    ProfileScope prof("sortRenderQueue");
+    radixSortKeys(&renderQueue.keys[0], &renderQueue.scratch[0], renderQueue.count, 3, 7);
+}
+
+// Samples that pass the depth test in the opaque pass, per pixel: 1.0 if
+// every pixel were written once, the rest is overdraw. Results are read
+// OVERDRAW_FRAMES - 1 frames late so the CPU never waits on the GPU.
+const int OVERDRAW_FRAMES = 4;
+
+struct OverdrawQueries {
+    bool   ready;
+    bool   active;
+    GLuint queries[OVERDRAW_FRAMES];
+    int    pixels[OVERDRAW_FRAMES];   // viewport size when each was issued
+    int    next;          // slot for this frame's query
+    int    inFlight;
+};
+
+OverdrawQueries overdraw;
+
+// Needs the GL resources; frameStats.overdraw stays 0 without queries
+void initOverdrawQueries() {
+    overdraw.ready = acquireQueries(OVERDRAW_FRAMES, overdraw.queries);
+    overdraw.active = false;
+    overdraw.next = overdraw.inFlight = 0;
+    frameStats.overdraw = 0.0f;
+}
+
+void beginOverdrawQuery() {
+    if (!overdraw.ready) return;
+    ext.BeginQuery(GL_SAMPLES_PASSED, overdraw.queries[overdraw.next]);
+    overdraw.pixels[overdraw.next] = viewportW * viewportH;
+    overdraw.active = true;
+}
+
+void endOverdrawQuery() {
+    if (!overdraw.active) return;
+    ext.EndQuery(GL_SAMPLES_PASSED);
+    overdraw.active = false;
+    overdraw.next = (overdraw.next + 1) % OVERDRAW_FRAMES;
+
+    // The next slot is reused by the next frame: collect its result now
+    if (++overdraw.inFlight == OVERDRAW_FRAMES) {
+        GLint samples = 0;
+        ext.GetQueryObjectiv(overdraw.queries[overdraw.next], GL_QUERY_RESULT, &samples);
+        frameStats.overdraw = (float)samples / overdraw.pixels[overdraw.next];
+        --overdraw.inFlight;
+    }
+}
+
+// The shaded path swaps the fixed-function lighting for its programs
+void beginMaterial(int material) {
+    bool shaded = sceneShadersActive();
+    if (material == MATERIAL_STATIC) {
+        setProgram(shaded ? sceneShaders.program : 0);
+        beginStaticArrays();
+    }
+    else if (material == MATERIAL_LISTS) {
+        setProgram(shaded ? sceneShaders.program : 0);
+    }
+    else if (material == MATERIAL_INSTANCED) {
+        beginInstanced(shaded && sceneShaders.instancedProgram ? sceneShaders.instancedProgram : instancing.program);
+    }
+    else if (material == MATERIAL_PARTICLES) {
+        endOverdrawQuery();
+    }
+    else if (material == MATERIAL_OVERLAY) {
+        endOverdrawQuery();
+        setProgram(0);
+    }
+}
+
+void endMaterial(int material) {
+    if (material == MATERIAL_STATIC) endStaticArrays();
+    else if (material == MATERIAL_INSTANCED) endInstanced();
+}
+
+void drawRenderItem(const RenderItem& item) {
+    switch (item.kind) {
+    case ITEM_STATIC_FLOOR:
+        drawStaticRange(staticBatch.floorFirst, staticBatch.floorCount);
+        break;
+    case ITEM_STATIC_TILE: {
+        const StaticChunk& chunk = staticBatch.chunks[item.index];
+        drawStaticRange(chunk.first[item.lod], (GLsizei)chunk.vertices[item.lod].size());
+        break;
+    }
+    case ITEM_STATIC_WALLS:
+        drawStaticWalls();
+        break;
+    case ITEM_FLOOR:
+        drawFloor();
+        break;
+    case ITEM_WALLS:
+        drawWalls();
+        break;
+    case ITEM_ENV_OBJECT:
+        drawEnvObject(item.index, item.lod);
+        break;
+    case ITEM_INSTANCES:
+        drawInstanceBucket(item.index);
+        break;
+    case ITEM_CORE:
+        drawOxygenCore(item.lod);
+        break;
+    case ITEM_DIVER:
+        drawDiver(item.lod);
+        break;
+    case ITEM_PARTICLES:
+        drawParticles();
+        break;
+    case ITEM_HUD:
+        drawHUD();
+        break;
+    }
+}
 
-    // Crate 3
-    glPushMatrix();
-    glColor3f(0.6f, 0.45f, 0.3f);
-    glTranslatef(-0.4f, 0.2f, -0.2f);
-    glScalef(0.3f, 0.3f, 0.3f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// Setup is switched only where the material changes between items
+void drawRenderQueue() {
+    ProfileScope prof("drawRenderQueue");
+
+    beginOverdrawQuery();
+    int material = MATERIAL_NONE;
+    for (int k = 0; k < renderQueue.count; ++k) {
+        const RenderItem& item = renderQueue.items[renderQueue.keys[k] & KEY_SLOT_MASK];
+        int next = ITEM_MATERIAL[item.kind];
+        if (next != material) {
+            endMaterial(material);
+            beginMaterial(next);
+            material = next;
+        }
+        drawRenderItem(item);
+    }
+    endMaterial(material);
+    endOverdrawQuery();
+    setProgram(0);
 }
 
-// Regular object B: Repair drone (≥3 primitives)
-void drawRepairDrone() {
-    // Body
-    glPushMatrix();
-    glColor3f(0.7f, 0.7f, 0.9f);
-    glScalef(0.4f, 0.15f, 0.4f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+// =========================
+// GLUT callbacks
+// =========================
 
-    // Sensor eye
-    glPushMatrix();
-    glColor3f(0.1f, 0.9f, 0.9f);
-    glTranslatef(0.0f, 0.0f, 0.25f);
-    glutSolidSphere(0.07, 16, 16);
-    glPopMatrix();
+// Draw one full frame into the current context (window or offscreen)
+void renderFrame() {
+    frameStats.objectsDrawn = 0;
+    frameStats.objectsCulled = 0;
+    frameStats.drawCalls = 0;
+    frameStats.triangles = 0;
+    frameStats.stateChanges = 0;
+    frameStats.stateChangesSaved = 0;
+    frameStats.lights = 0;
+    frameStats.lightRefs = 0;
+    frameStats.particles = 0;
 
-    // Rotor
-    glPushMatrix();
-    glColor3f(0.4f, 0.4f, 0.4f);
-    glTranslatef(0.2f, 0.1f, 0.2f);
-    glScalef(0.2f, 0.02f, 0.2f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+    ProfileScope prof("renderFrame");
+
+    acquireSnapshot();
+    updateRenderAlpha();
+
+    if (scene->state == GAME_WIN) {
+        drawEndScreen("GAME WIN");
+        return;
+    }
+    if (scene->state == GAME_LOSE) {
+        drawEndScreen("GAME LOSE");
+        return;
+    }
+
+    prepareEnvRenderWorlds();
+    updateParticles();
+    setupCamera();
+    setupLights();
+    if (sceneShadersActive()) buildLightClusters();
+    updateFrameUniforms();
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    buildRenderQueue();
+    sortRenderQueue();
+    drawRenderQueue();
 }
 
-// Regular object C: Oxygen tank cluster (≥3 primitives)
-void drawOxygenTanks() {
-    // Base
-    glPushMatrix();
-    glColor3f(0.2f, 0.2f, 0.25f);
-    glScalef(0.7f, 0.05f, 0.7f);
-    glutSolidCube(1.0);
-    glPopMatrix();
+void Display() {
+    beginFrameAllocations();
 
-    // Three tanks
-    GLUquadric* quad = gluNewQuadric();
+    renderFrame();
+    {
+        ProfileScope prof("swap");
+        glutSwapBuffers();
+    }
 
-    glPushMatrix();
-    glColor3f(0.1f, 0.6f, 0.3f);
-    glTranslatef(-0.2f, 0.3f, 0.0f);
-    gluCylinder(quad, 0.12, 0.12, 0.8, 20, 20);
-    glTranslatef(0.0f, 0.0f, 0.8f);
-    glutSolidSphere(0.12, 16, 16);
-    glPopMatrix();
+    endFrameAllocations();
+    notePresentedFrame();
+    endProfileFrame();
+}
 
-    glPushMatrix();
-    glColor3f(0.1f, 0.7f, 0.4f);
-    glTranslatef(0.0f, 0.3f, 0.0f);
-    gluCylinder(quad, 0.12, 0.12, 0.8, 20, 20);
-    glTranslatef(0.0f, 0.0f, 0.8f);
-    glutSolidSphere(0.12, 16, 16);
-    glPopMatrix();
+// =========================
+// Replay
+// =========================
+// --record <file> logs every key event the simulation applies, stamped
+// with the tick it was applied before, plus the setup resetGame() starts
+// from. Ticks are fixed-step, so feeding the same events in at the same
+// ticks reproduces the session exactly. --replay <file> runs it headless
+// as fast as the sim goes; adding --offscreen renders it for frame time
+// comparisons. An FNV-1a checksum of the game state after the last
+// recorded tick is kept in the file and checked on playback, so a build
+// whose simulation drifted shows up as a mismatch.
+
+const char REPLAY_MAGIC[4] = { 'U', 'W', 'R', 'P' };
+const uint32_t REPLAY_VERSION = 1;
+
+// File layout, native byte order: header, then numEvents events
+struct ReplayHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t envObjectTarget;   // resetGame() setup
+    uint32_t numEvents;
+    uint64_t endTick;           // ticks the session ran
+    uint64_t startChecksum;     // state after resetGame()
+    uint64_t endChecksum;       // state after endTick ticks
+    float    simDt;
+    uint32_t reserved;
+};
 
-    glPushMatrix();
-    glColor3f(0.1f, 0.6f, 0.3f);
-    glTranslatef(0.2f, 0.3f, 0.0f);
-    gluCylinder(quad, 0.12, 0.12, 0.8, 20, 20);
-    glTranslatef(0.0f, 0.0f, 0.8f);
-    glutSolidSphere(0.12, 16, 16);
-    glPopMatrix();
+struct ReplayEvent {
+    uint32_t tick;              // applied before this tick ran
+    uint16_t key;               // heldKeys code
+    uint8_t  down;              // 1 = press, 0 = release
+    uint8_t  reserved;
+};
+
+enum ReplayMode { REPLAY_OFF, REPLAY_RECORD, REPLAY_PLAYBACK };
+
+struct Replay {
+    ReplayMode   mode;
+    const char*  path;
+    ReplayHeader header;
+    std::vector<ReplayEvent> events;
+    long     baseTick;          // simClock.totalTicks at tick 0
+    size_t   next;              // playback cursor
+    bool     ended;             // playback reached endTick
+    uint64_t endChecksum;       // playback state at endTick
+};
+
+Replay replay;
+
+const uint64_t FNV_OFFSET = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+
+uint64_t fnv1a(uint64_t h, const void* data, size_t bytes) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < bytes; ++i) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+uint64_t hashVector(uint64_t h, const Vector3f& v) {
+    const float f[3] = { v.x, v.y, v.z };
+    return fnv1a(h, f, sizeof(f));
+}
+
+// Everything the simulation carries from tick to tick, field by field so
+// struct padding never reaches the hash. Derived state (matrices) is left out.
+uint64_t gameStateChecksum() {
+    uint64_t h = FNV_OFFSET;
+
+    const int32_t state = (int32_t)gameState;
+    h = fnv1a(h, &state, sizeof(state));
+    h = fnv1a(h, &oxygenTime, sizeof(oxygenTime));
+    h = fnv1a(h, &wallColorPhase, sizeof(wallColorPhase));
+
+    h = hashVector(h, diver.pos);
+    h = fnv1a(h, &diver.rotY, sizeof(diver.rotY));
+    h = fnv1a(h, &diver.rotX, sizeof(diver.rotX));
+    const unsigned char flags[2] = { (unsigned char)diver.onGround, (unsigned char)oxygenCore.collected };
+    h = fnv1a(h, flags, sizeof(flags));
+    h = fnv1a(h, &oxygenCore.spinAngle, sizeof(oxygenCore.spinAngle));
+
+    h = hashVector(h, camera.eye);
+    h = hashVector(h, camera.center);
+    h = hashVector(h, camera.up);
+
+    const EnvObjectStore& env = envStore;
+    const int32_t count = env.count;
+    h = fnv1a(h, &count, sizeof(count));
+    if (count > 0) {
+        h = fnv1a(h, &env.posX[0], count * sizeof(float));
+        h = fnv1a(h, &env.posY[0], count * sizeof(float));
+        h = fnv1a(h, &env.posZ[0], count * sizeof(float));
+        h = fnv1a(h, &env.animParam[0], count * sizeof(float));
+        h = fnv1a(h, &env.running[0], count * sizeof(float));
+        h = fnv1a(h, &env.type[0], count * sizeof(int));
+    }
+
+    for (int k = 0; k < (int)heldKeys.size(); ++k) {
+        if (!heldKeys[k]) continue;
+        const int32_t key = k;
+        h = fnv1a(h, &key, sizeof(key));
+    }
+    return h;
+}
+
+// Sim side, as each queued key event is applied
+void recordReplayInput(bool down, int key) {
+    if (replay.mode != REPLAY_RECORD) return;
+
+    ReplayEvent e;
+    e.tick = (uint32_t)(simClock.totalTicks - replay.baseTick);
+    e.key = (uint16_t)key;
+    e.down = down ? 1 : 0;
+    e.reserved = 0;
+    replay.events.push_back(e);
+}
+
+bool writeReplay() {
+    ReplayHeader& hd = replay.header;
+    hd.numEvents = (uint32_t)replay.events.size();
+    hd.endTick = (uint64_t)(simClock.totalTicks - replay.baseTick);
+    hd.endChecksum = gameStateChecksum();
+
+    FILE* f = fopen(replay.path, "wb");
+    if (!f) {
+        printf("Cannot write replay %s\n", replay.path);
+        return false;
+    }
+    bool ok = fwrite(&hd, sizeof(hd), 1, f) == 1;
+    if (ok && hd.numEvents > 0) ok = fwrite(&replay.events[0], sizeof(ReplayEvent), hd.numEvents, f) == hd.numEvents;
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        printf("Cannot write replay %s\n", replay.path);
+        return false;
+    }
+
+    printf("Replay: %u events over %llu ticks written to %s (checksum %016llx)\n", hd.numEvents,
+        (unsigned long long)hd.endTick, replay.path, (unsigned long long)hd.endChecksum);
+    return true;
+}
+
+// Registered before the sim thread starts, so its own atexit handler has
+// already stopped it and the state is final
+void writeReplayAtExit() {
+    writeReplay();
+}
+
+// Call right after initGame(), before the sim thread starts
+void startRecording(const char* path) {
+    replay.mode = REPLAY_RECORD;
+    replay.path = path;
+    replay.events.reserve(4096);
+    replay.baseTick = simClock.totalTicks;
+
+    ReplayHeader& hd = replay.header;
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, REPLAY_MAGIC, sizeof(hd.magic));
+    hd.version = REPLAY_VERSION;
+    hd.envObjectTarget = (uint32_t)envObjectTarget;
+    hd.startChecksum = gameStateChecksum();
+    hd.simDt = SIM_DT;
+    atexit(writeReplayAtExit);
+}
+
+bool loadReplay(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        printf("Cannot open replay %s\n", path);
+        return false;
+    }
+
+    ReplayHeader& hd = replay.header;
+    bool ok = fread(&hd, sizeof(hd), 1, f) == 1 && memcmp(hd.magic, REPLAY_MAGIC, sizeof(hd.magic)) == 0;
+    if (ok && (hd.version != REPLAY_VERSION || hd.simDt != SIM_DT)) {
+        printf("Replay %s: version %u at dt %.5f, this build plays version %u at dt %.5f\n",
+            path, hd.version, hd.simDt, REPLAY_VERSION, SIM_DT);
+        fclose(f);
+        return false;
+    }
+    if (ok) {
+        replay.events.resize(hd.numEvents);
+        if (hd.numEvents > 0) ok = fread(&replay.events[0], sizeof(ReplayEvent), hd.numEvents, f) == hd.numEvents;
+    }
+    fclose(f);
+    if (!ok) {
+        printf("Replay %s is not a replay file or is truncated\n", path);
+        return false;
+    }
+
+    replay.mode = REPLAY_PLAYBACK;
+    replay.path = path;
+    return true;
+}
+
+// Runs on whichever thread ticks the simulation: apply this tick's events,
+// and take the checksum once the recorded session length is reached
+void playReplayTick() {
+    uint64_t tick = (uint64_t)(simClock.totalTicks - replay.baseTick);
+    if (tick == replay.header.endTick && !replay.ended) {
+        replay.ended = true;
+        replay.endChecksum = gameStateChecksum();
+    }
+
+    while (replay.next < replay.events.size() && replay.events[replay.next].tick <= tick) {
+        const ReplayEvent& e = replay.events[replay.next++];
+        if (e.down) keyDown(e.key);
+        else keyUp(e.key);
+        ++simClock.inputApplied;
+    }
+}
+
+// After playback has stopped ticking; true when the end state matched
+bool reportReplay() {
+    if (!replay.ended) {
+        printf("  replay stopped at tick %ld of %llu, no checksum\n",
+            simClock.totalTicks - replay.baseTick, (unsigned long long)replay.header.endTick);
+        return false;
+    }
+
+    bool match = replay.endChecksum == replay.header.endChecksum;
+    printf("  replay checksum %016llx, recorded %016llx: %s\n", (unsigned long long)replay.endChecksum,
+        (unsigned long long)replay.header.endChecksum, match ? "match" : "MISMATCH");
+    return match;
+}
+
+// Frames the offscreen benchmark needs to cover the replay at 1/60 s each
+int replayFrames() {
+    return (int)((replay.header.endTick + 1) / 2 + 1);
+}
+
+// =========================
+// Input
+// =========================
+// GLUT callbacks run on the render thread and only queue key presses and
+// releases; the simulation applies them at the start of its next tick, so
+// camera and game state have a single writer. The queue is
+// single-producer, single-consumer and never blocks either side.
+
+enum InputKind { INPUT_KEY_DOWN, INPUT_KEY_UP };
+
+struct InputEvent {
+    unsigned char kind;
+    int    key;                          // heldKeys code
+    double time;                         // nowSeconds() when GLUT reported it
+};
+
+const unsigned INPUT_QUEUE_SIZE = 256;   // power of two
+
+struct InputQueue {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    std::atomic<unsigned> head;          // next slot to read, sim side
+    std::atomic<unsigned> tail;          // next slot to write, render side
+    long dropped;
+};
+
+InputQueue inputQueue;
+
+// Render side. A full queue drops the key rather than stalling the window.
+void pushInput(unsigned char kind, int key) {
+    unsigned tail = inputQueue.tail.load(std::memory_order_relaxed);
+    if (tail - inputQueue.head.load(std::memory_order_acquire) >= INPUT_QUEUE_SIZE) {
+        ++inputQueue.dropped;
+        return;
+    }
+    InputEvent& e = inputQueue.events[tail & (INPUT_QUEUE_SIZE - 1)];
+    e.kind = kind;
+    e.key = key;
+    e.time = nowSeconds();
+    inputQueue.tail.store(tail + 1, std::memory_order_release);
+}
+
+// Sim side
+bool popInput(InputEvent& e) {
+    unsigned head = inputQueue.head.load(std::memory_order_relaxed);
+    if (head == inputQueue.tail.load(std::memory_order_acquire)) return false;
+    e = inputQueue.events[head & (INPUT_QUEUE_SIZE - 1)];
+    inputQueue.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Sim side: consume everything queued since the last tick
+void applyPendingInput() {
+    InputEvent e;
+    while (popInput(e)) {
+        recordReplayInput(e.kind == INPUT_KEY_DOWN, e.key);
+        if (e.kind == INPUT_KEY_UP) {
+            keyUp(e.key);
+        }
+        else if (keyDown(e.key)) {
+            simClock.lastInputTime = e.time;
+        }
+        ++simClock.inputApplied;
+    }
+}
+
+// =========================
+// Sim thread
+// =========================
+// Windowed runs tick the simulation on its own thread at SIM_DT, apart
+// from the render loop's pacing. Each tick drains input, steps, and
+// publishes a snapshot; the renderer interpolates from the tick time.
+
+struct SimThread {
+    std::thread thread;
+    std::atomic<bool> quit;
+};
+
+SimThread simThread;
+
+void simThreadMain() {
+    countAllocations = false;   // not the frame's
+    double next = nowSeconds();
+
+    while (!simThread.quit.load(std::memory_order_relaxed)) {
+        sleepUntil(next);
+        next += SIM_DT;
+
+        // Too far behind (debugger, suspended process): drop the backlog
+        double now = nowSeconds();
+        if (now - next > MAX_FRAME_DT) next = now + SIM_DT;
+
+        applyPendingInput();
+        runSimTick();
+        publishSnapshot();
+    }
+}
+
+void stopSimThread() {
+    if (!simThreadRunning) return;
+    simThread.quit.store(true);
+    simThread.thread.join();
+    simThreadRunning = false;
+}
+
+// Call after the first snapshot is published
+void startSimThread() {
+    simThreadRunning = true;
+    simThread.quit.store(false);
+    simThread.thread = std::thread(simThreadMain);
+    atexit(stopSimThread);
+}
+
+// =========================
+// GLUT input and idle
+// =========================
+
+// Shift must not leave a letter held when it is released after the key
+int keyCode(unsigned char key) {
+    return (key >= 'A' && key <= 'Z') ? key - 'A' + 'a' : key;
+}
+
+void Keyboard(unsigned char key, int x, int y) {
+    // Escape
+    if (key == GLUT_KEY_ESCAPE) {
+        exit(EXIT_SUCCESS);
+    }
+    key = (unsigned char)keyCode(key);
+
+    // Render settings stay on this thread, only when playing
+    if (scene->state == GAME_PLAYING) {
+        if (key == 'm') { // cached vs immediate geometry
+            useMeshCache = !useMeshCache;
+            printf("Mesh cache: %s\n", useMeshCache ? "on" : "off");
+        }
+        else if (key == 'n') { // instanced vs per-object env objects
+            useInstancing = !useInstancing;
+            printf("Instancing: %s\n", (useInstancing && instancing.ready) ? "on" : "off");
+        }
+        else if (key == 'g') { // static geometry batch vs per-object draws
+            useStaticBatch = !useStaticBatch;
+            printf("Static batch: %s\n", staticBatchActive() ? "on" : "off");
+        }
+        else if (key == 'h') { // per-pixel shading, fog and caustics vs fixed function
+            useSceneShaders = !useSceneShaders;
+            printf("Scene shaders: %s\n", sceneShadersActive() ? "on" : "off");
+        }
+        else if (key == 'y') { // clustered object lights vs the overhead light alone
+            useSceneLights = !useSceneLights;
+            printf("Scene lights: %s\n", sceneLightsActive() && sceneShadersActive() ? "on" : "off");
+        }
+        else if (key == 'f') { // front-to-back sort vs fixed draw order
+            useRenderSort = !useRenderSort;
+            printf("Render sort: %s\n", useRenderSort ? "front to back" : "off");
+        }
+        else if (key == 'r') { // redraw every tick vs only on change
+            scheduler.dirtyOnly = !scheduler.dirtyOnly;
+            printf("Dirty-only redraw: %s\n", scheduler.dirtyOnly ? "on" : "off");
+        }
+        else if (key == 'p') { // profiler overlay
+            profiler.overlay = !profiler.overlay;
+            setProfilerEnabled(profiler.overlay);
+            printf("Profiler overlay: %s\n", profiler.overlay ? "on" : "off");
+        }
+    }
+
+    // Everything else belongs to the simulation. No redisplay here: Update()
+    // redraws at most once per frame once the snapshot shows the key.
+    pushInput(INPUT_KEY_DOWN, key);
+    if (!simThreadRunning) applyPendingInput();
+}
+
+void KeyboardUp(unsigned char key, int x, int y) {
+    (void)x;
+    (void)y;
+    pushInput(INPUT_KEY_UP, keyCode(key));
+    if (!simThreadRunning) applyPendingInput();
+}
+
+void Special(int key, int x, int y) {
+    pushInput(INPUT_KEY_DOWN, SPECIAL_KEY_BASE + key);
+    if (!simThreadRunning) applyPendingInput();
+}
+
+void SpecialUp(int key, int x, int y) {
+    (void)x;
+    (void)y;
+    pushInput(INPUT_KEY_UP, SPECIAL_KEY_BASE + key);
+    if (!simThreadRunning) applyPendingInput();
+}
+
+// The projection, culling and light clusters all follow the new size
+void Reshape(int width, int height) {
+    viewportW = width > 0 ? width : 1;
+    viewportH = height > 0 ? height : 1;
+    glViewport(0, 0, viewportW, viewportH);
+    scheduler.shownState = -1;   // redraw at the new size, dirty-only too
+}
+
+// Idle update: oxygen, animations. Runs once per paced frame slot.
+void Update() {
+    paceFrame();
+    ProfileScope prof("Update");
+
+    // Single-threaded: tick here, as many times as the frame covers
+    if (!simThreadRunning) {
+        double now = nowSeconds();
+        float dt = (float)(now - lastFrameTime);
+        if (dt < 0.0f) dt = 0.0f;
+        lastFrameTime = now;
+
+        advanceSimulation(dt);
+    }
+
+    acquireSnapshot();
+    if (!scheduler.dirtyOnly || sceneChanged()) {
+        glutPostRedisplay();
+    }
+    else {
+        ++scheduler.framesSkipped;
+    }
+
+    reportSchedule();
+}
+
+// =========================
+// Initialization
+// =========================
+
+// Reset all game state. Needs no GL context (used by headless runs).
+void resetGame() {
+    const LevelHeader& lv = level.header;
+
+    // Diver start position
+    diver.pos = Vector3f(lv.spawn[0], lv.spawn[1], lv.spawn[2]);
+    diver.radius = 0.4f;
+    diver.rotY = 0.0f;
+    diver.rotX = 0.0f;
+    diver.onGround = true;
+
+    // Oxygen core position
+    oxygenCore.pos = Vector3f(lv.goal[0], lv.goal[1], lv.goal[2]);
+    oxygenCore.radius = 0.5f;
+    oxygenCore.spinAngle = 0.0f;
+    oxygenCore.collected = false;
+
+    // Environment objects placement & types (all start paused)
+    assignEnvObjects((int)lv.numObjects, level.posX, level.posY, level.posZ, level.type);
+
+    // Larger bases: scatter extra objects inside the walls
+    unsigned int seed = 2024u;
+    while (envStore.count < envObjectTarget) {
+        seed = seed * 1664525u + 1013904223u;
+        float x = ((seed >> 8) & 0xFFFF) / 65535.0f;
+        seed = seed * 1664525u + 1013904223u;
+        float z = ((seed >> 8) & 0xFFFF) / 65535.0f;
+        float extent = worldHalfSize - 0.5f;
+        addEnvObject(Vector3f((x * 2.0f - 1.0f) * extent, 0.0f, (z * 2.0f - 1.0f) * extent),
+            envStore.count % NUM_ENV_TYPES);
+    }
+
+    updateDiverWorld();
+    updateWorldMatrices();
+
+    // Nothing to interpolate from yet
+    savePrevSimState();
+    simClock.accumulator = 0.0;
+    simClock.alpha = 0.0f;
+
+    // Camera default (like external camera looking into base)
+    camera.eye = Vector3f(0.0f, 4.0f, 12.0f);
+    camera.center = Vector3f(0.0f, 0.5f, 0.0f);
+    camera.up = Vector3f(0.0f, 1.0f, 0.0f);
+
+    gameState = GAME_PLAYING;
+    oxygenTime = lv.oxygenSeconds;
+    wallColorPhase = 0.0f;
+}
+
+void initGame() {
+    resetGame();
+    lastFrameTime = nowSeconds();
+    simClock.lastTickTime = lastFrameTime;
+    publishSnapshot();
+    acquireSnapshot();
+}
+
+// =========================
+// Headless benchmarks
+// =========================
+
+
+// Back to the recorded starting state, with playback feeding every tick
+void restartReplay() {
+    envObjectTarget = (int)replay.header.envObjectTarget;
+    resetGame();
+    heldKeys.reset();
+
+    uint64_t start = gameStateChecksum();
+    if (start != replay.header.startChecksum) {
+        printf("Replay: start state differs from the recording (%016llx, recorded %016llx)\n",
+            (unsigned long long)start, (unsigned long long)replay.header.startChecksum);
+    }
+
+    replay.baseTick = simClock.totalTicks;
+    replay.next = 0;
+    replay.ended = false;
+    tickInputHook = playReplayTick;
+}
+
+// --replay <file>: the recorded session on the fixed-step sim with no
+// window, as fast as it runs
+int runReplay() {
+    restartReplay();
+
+    long ticks = (long)replay.header.endTick;
+    double start = nowSeconds();
+    while (simClock.totalTicks - replay.baseTick < ticks) runSimTick();
+    double elapsed = nowSeconds() - start;
+    playReplayTick();   // checksum at endTick
+
+    printf("replay: %s, %ld ticks and %u events in %.3f s = %.0f ticks/s\n", replay.path, ticks,
+        replay.header.numEvents, elapsed, ticks / (elapsed > 0.0 ? elapsed : 1e-9));
+    printf("  %d env objects, round %s, diver at (%.3f, %.3f, %.3f)\n", envStore.count,
+        gameState == GAME_PLAYING ? "in progress" : (gameState == GAME_WIN ? "won" : "lost"),
+        diver.pos.x, diver.pos.y, diver.pos.z);
+    return reportReplay() ? 0 : 1;
+}
+
+// Deterministic scripted input: an LCG picks one of the game keys every few
+// ticks, so the diver wanders, toggles animations and eventually either
+// reaches the core or runs out of oxygen.
+const char SCRIPT_KEYS[] = "iiiikkkkjjjjllllzxcvbuuuoo";
+
+unsigned char nextScriptedKey(unsigned int& state) {
+    state = state * 1664525u + 1013904223u;
+    return SCRIPT_KEYS[(state >> 16) % (sizeof(SCRIPT_KEYS) - 1)];
+}
+
+// --bench-sim <million ticks>: fixed-step simulation with no window
+int runSimBenchmark(double millionTicks) {
+    long long ticks = (long long)(millionTicks * 1000000.0);
+    if (ticks <= 0) ticks = 1;
+
+    resetGame();
+    unsigned int script = 12345u;
+    long long wins = 0, losses = 0;
+
+    double start = nowSeconds();
+    for (long long t = 0; t < ticks; ++t) {
+        if ((t & 7) == 0) {   // each scripted key is held for 8 ticks
+            heldKeys.reset();
+            keyDown(nextScriptedKey(script));
+        }
+        stepSimulation(SIM_DT);
+
+        if (gameState != GAME_PLAYING) {
+            if (gameState == GAME_WIN) ++wins;
+            else ++losses;
+            resetGame();
+        }
+    }
+    double elapsed = nowSeconds() - start;
 
-    gluDeleteQuadric(quad);
+    printf("sim bench: %lld ticks in %.3f s = %.0f ticks/s (dt %.4f)\n",
+        ticks, elapsed, ticks / (elapsed > 0.0 ? elapsed : 1e-9), SIM_DT);
+    printf("  rounds won %lld, lost %lld, diver at (%.3f, %.3f, %.3f)\n",
+        wins, losses, diver.pos.x, diver.pos.y, diver.pos.z);
+    return 0;
 }
 
-// Draw environment object by type
-void drawEnvObject(const EnvObject& obj) {
-    glPushMatrix();
-    glTranslatef(obj.pos.x, obj.pos.y, obj.pos.z);
-
-    if (obj.type == 0) {
-        // Floodlight tower: rotate slowly in Y to scan
-        glRotatef(obj.animParam, 0, 1, 0);
-        drawFloodlightTower();
+// --bench-level [objects]: startup cost of a large base. The same level is
+// parsed from its text form, compiled, then mapped from the binary file
+// (warm page cache) and turned into a playable store by resetGame(). The
+// per-object addEnvObject() path is timed on the same data for comparison.
+int runLevelBenchmark(int numObjects) {
+    const char* textPath = "bench_level.txt";
+    const char* binaryPath = "bench_level.lvl";
+    if (numObjects < 0) numObjects = 0;
+
+    LevelSource generated;
+    builtinLevel(generated);
+    generated.header.worldHalfSize = 5.0f + sqrtf((float)numObjects) * 0.25f;
+    scatterLevelObjects(generated, numObjects, 2024u);
+
+    FILE* f = fopen(textPath, "w");
+    if (!f) {
+        printf("level bench: cannot write %s\n", textPath);
+        return 1;
     }
-    else if (obj.type == 1) {
-        // Sonar array: rotating comms
-        glRotatef(obj.animParam, 0, 1, 0);
-        drawSonarArray();
+    const LevelHeader& gh = generated.header;
+    fprintf(f, "# %d objects, written by --bench-level\n", (int)gh.numObjects);
+    fprintf(f, "world %g %g\noxygen %g\n", gh.worldHalfSize, gh.maxHeight, gh.oxygenSeconds);
+    fprintf(f, "spawn %g %g %g\ngoal %g %g %g\n", gh.spawn[0], gh.spawn[1], gh.spawn[2], gh.goal[0], gh.goal[1], gh.goal[2]);
+    for (uint32_t i = 0; i < gh.numObjects; ++i) {
+        fprintf(f, "object %s %.4f %.4f %.4f\n", ENV_TYPE_NAMES[generated.type[i]],
+            generated.posX[i], generated.posY[i], generated.posZ[i]);
     }
-    else if (obj.type == 2) {
-        // Supply crates: gentle bobbing
-        glTranslatef(0.0f, 0.08f * sinf(obj.animParam), 0.0f);
-        drawSupplyCrates();
+    double textBytes = (double)ftell(f);
+    fclose(f);
+
+    double t0 = nowSeconds();
+    LevelSource parsed;
+    bool ok = parseLevelText(textPath, parsed);
+    double t1 = nowSeconds();
+    ok = ok && writeLevel(binaryPath, parsed);
+    double t2 = nowSeconds();
+    ok = ok && loadLevel(binaryPath);
+    double t3 = nowSeconds();
+    if (!ok) return 1;
+
+    envObjectTarget = 0;
+    resetGame();
+    double t4 = nowSeconds();
+    int loaded = envStore.count;
+
+    // Reference: one push_back per object and field, into an empty store
+    EnvObjectStore empty;
+    empty.count = 0;
+    empty.version = empty.staticVersion = 0;
+    std::swap(envStore, empty);
+    double t5 = nowSeconds();
+    for (uint32_t i = 0; i < level.header.numObjects; ++i) {
+        addEnvObject(Vector3f(level.posX[i], level.posY[i], level.posZ[i]), level.type[i]);
     }
-    else if (obj.type == 3) {
-        // Repair drone: rotating drone
-        glTranslatef(0.0f, 0.4f, 0.0f);
-        glRotatef(obj.animParam, 0, 1, 0);
-        drawRepairDrone();
-    }
-    else if (obj.type == 4) {
-        // Oxygen tanks: small bob + rotation
-        glTranslatef(0.0f, 0.05f * sinf(obj.animParam), 0.0f);
-        glRotatef(obj.animParam * 0.5f, 0, 1, 0);
-        drawOxygenTanks();
-    }
-
-    glPopMatrix();
+    double t6 = nowSeconds();
+    std::swap(envStore, empty);
+
+    double fill = t4 - t3;
+    printf("level bench: %d objects, text %.1f MB, binary %.1f MB\n", loaded,
+        textBytes / (1024.0 * 1024.0), (double)level.file.size / (1024.0 * 1024.0));
+    printf("  parse text       %8.2f ms\n", (t1 - t0) * 1000.0);
+    printf("  compile (write)  %8.2f ms\n", (t2 - t1) * 1000.0);
+    printf("  map binary       %8.3f ms\n", (t3 - t2) * 1000.0);
+    printf("  resetGame        %8.2f ms (bulk copy into the store, world matrices)\n", fill * 1000.0);
+    printf("  addEnvObject x n %8.2f ms (per-object path, for comparison)\n", (t6 - t5) * 1000.0);
+    printf("  startup from binary %.2f ms, from text %.2f ms\n", (t3 - t2 + fill) * 1000.0, (t1 - t0 + fill) * 1000.0);
+
+    unmapFile(level.file);
+    initLevel();
+    remove(textPath);
+    remove(binaryPath);
+    return 0;
 }
 
-// =========================
-// Text rendering (HUD)
-// =========================
+// --bench-env: batch animation update over the SoA store, next to the old
+// array-of-structs loop with a branch per object, for 10k/100k/1M objects
+struct EnvObjectAoS {
+    Vector3f pos;
+    float    animParam;
+    bool     animRunning;
+    int      type;
+};
 
-void drawBitmapText(const char* text, float x, float y) {
-    glRasterPos2f(x, y);
-    for (size_t i = 0; i < strlen(text); i++) {
-        glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, text[i]);
-    }
-}
+int runEnvBenchmark() {
+    const int sizes[] = { 10000, 100000, 1000000 };
+    const long long updatesPerSize = 200000000;   // keeps each size ~equal work
 
-void drawHUD() {
-    // Switch to 2D orthographic for text
-    glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
-    gluOrtho2D(0, 1, 0, 1);
+    for (int s = 0; s < 3; ++s) {
+        int n = sizes[s];
+        int iterations = (int)(updatesPerSize / n);
 
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
+        clearEnvObjects();
+        std::vector<EnvObjectAoS> aos(n);
+        for (int i = 0; i < n; ++i) {
+            addEnvObject(Vector3f((float)(i % 100), 0.0f, (float)(i / 100)), i % NUM_ENV_TYPES);
+            setEnvAnimating(i, (i % 3) != 0);
 
-    glDisable(GL_LIGHTING);
-    glColor3f(1.0f, 1.0f, 1.0f);
+            aos[i].pos = Vector3f((float)(i % 100), 0.0f, (float)(i / 100));
+            aos[i].animParam = 0.0f;
+            aos[i].animRunning = (i % 3) != 0;
+            aos[i].type = i % NUM_ENV_TYPES;
+        }
 
-    char buffer[64];
-    sprintf(buffer, "O2 Left: %.1f", (oxygenTime > 0.0f ? oxygenTime : 0.0f));
-    drawBitmapText(buffer, 0.02f, 0.95f);
+        double t0 = nowSeconds();
+        for (int it = 0; it < iterations; ++it) {
+            updateEnvAnimations(SIM_DT);
+        }
+        double soa = nowSeconds() - t0;
+
+        t0 = nowSeconds();
+        for (int it = 0; it < iterations; ++it) {
+            for (int i = 0; i < n; ++i) {
+                if (aos[i].animRunning) {
+                    aos[i].animParam += 60.0f * SIM_DT;
+                }
+            }
+        }
+        double aosTime = nowSeconds() - t0;
 
-    glEnable(GL_LIGHTING);
+        double total = (double)n * iterations;
+        printf("env bench: %8d objects x %5d updates: SoA %6.3f ns/obj, AoS %6.3f ns/obj (check %.1f / %.1f)\n",
+            n, iterations, soa * 1e9 / total, aosTime * 1e9 / total,
+            envStore.animParam[n - 2], aos[n - 2].animParam);
+    }
 
-    // Restore matrices
-    glPopMatrix();
-    glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
-    glMatrixMode(GL_MODELVIEW);
+    clearEnvObjects();
+    return 0;
 }
 
-// =========================
-// Game logic
-// =========================
-
-void clampDiverToWorld() {
-    diver.pos.x = clampf(diver.pos.x, -WORLD_HALF_SIZE + 0.3f, WORLD_HALF_SIZE - 0.3f);
-    diver.pos.z = clampf(diver.pos.z, -WORLD_HALF_SIZE + 0.3f, WORLD_HALF_SIZE - 0.3f);
-    diver.pos.y = clampf(diver.pos.y, GROUND_Y, MAX_HEIGHT);
-
-    diver.onGround = (fabs(diver.pos.y - GROUND_Y) < 0.001f);
-}
-
-void checkGoalCollision() {
-    if (oxygenCore.collected) return;
-    float rSum = diver.radius + oxygenCore.radius;
-    if (distSquared(diver.pos, oxygenCore.pos) <= rSum * rSum) {
-        oxygenCore.collected = true;
-        if (gameState == GAME_PLAYING && oxygenTime > 0.0f) {
-            gameState = GAME_WIN;
-        }
-    }
-}
-
-// Handle diver translation plus required rotations
-void moveDiver(float dx, float dy, float dz) {
-    bool wasOnGround = diver.onGround;
-
-    diver.pos.x += dx;
-    diver.pos.y += dy;
-    diver.pos.z += dz;
-
-    // Update yaw if there is horizontal movement
-    if (fabs(dx) > 0.0001f || fabs(dz) > 0.0001f) {
-        diver.rotY = RAD2DEG(atan2f(-dx, dz));
-    }
-
-    clampDiverToWorld();
-
-    // Ground/air tilt rules
-    if (diver.onGround) {
-        diver.rotX = 0.0f;
-    }
-    else if (wasOnGround && !diver.onGround) {
-        diver.rotX = 25.0f;
-    }
-
-    checkGoalCollision();
-}
+// --bench-collision: grid broadphase vs all-pairs scan for one diver
+// against 100 .. 100k objects at constant density (one per 4 square units)
+int runCollisionBenchmark() {
+    const int sizes[] = { 100, 1000, 10000, 100000 };
+    const int queries = 200000;
+
+    for (int s = 0; s < 4; ++s) {
+        int n = sizes[s];
+        float half = sqrtf(4.0f * n) * 0.5f;
+
+        clearEnvObjects();
+        unsigned int seed = 99u;
+        for (int i = 0; i < n; ++i) {
+            seed = seed * 1664525u + 1013904223u;
+            float x = ((seed >> 8) & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+            seed = seed * 1664525u + 1013904223u;
+            float z = ((seed >> 8) & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+            addEnvObject(Vector3f(x * half, 0.0f, z * half), i % NUM_ENV_TYPES);
+        }
 
-// =========================
-// Rendering the end screens
-// =========================
+        double t0 = nowSeconds();
+        rebuildEnvGrid();
+        double build = nowSeconds() - t0;
+
+        // Same query points for both methods; brute force gets fewer of
+        // them at large counts so the run stays short
+        int bruteQueries = (int)fminf((float)queries, 2.0e8f / n);
+        long long bruteHits = 0, gridHits = 0;
+
+        seed = 7u;
+        t0 = nowSeconds();
+        for (int q = 0; q < queries; ++q) {
+            seed = seed * 1664525u + 1013904223u;
+            float x = ((seed >> 8) & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+            seed = seed * 1664525u + 1013904223u;
+            float z = ((seed >> 8) & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+            Vector3f p(x * half, 0.0f, z * half);
+            int h = queryEnvGrid(p, 0.4f, false);
+            if (q < bruteQueries) gridHits += h;
+        }
+        double gridTime = nowSeconds() - t0;
+
+        seed = 7u;
+        t0 = nowSeconds();
+        for (int q = 0; q < bruteQueries; ++q) {
+            seed = seed * 1664525u + 1013904223u;
+            float x = ((seed >> 8) & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+            seed = seed * 1664525u + 1013904223u;
+            float z = ((seed >> 8) & 0xFFFF) / 65535.0f * 2.0f - 1.0f;
+            bruteHits += queryEnvBruteForce(Vector3f(x * half, 0.0f, z * half), 0.4f);
+        }
+        double bruteTime = nowSeconds() - t0;
 
-void drawEndScreen(const char* msg) {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        printf("collision bench: %6d objects (grid %dx%d, build %.2f ms): grid %8.1f ns/query, "
+            "brute force %10.1f ns/query, hits %s\n",
+            n, envGrid.cellsX, envGrid.cellsZ, build * 1000.0,
+            gridTime * 1e9 / queries, bruteTime * 1e9 / bruteQueries,
+            gridHits == bruteHits ? "match" : "MISMATCH");
+    }
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluOrtho2D(0, 1, 0, 1);
+    clearEnvObjects();
+    return 0;
+}
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+// --bench-math: batch kernels vs the scalar Vector3f versions over the
+// same SoA data, checking the results agree before reporting speed
+int runMathBenchmark() {
+    const int n = 4096;
+    const int reps = 2000;
+
+    std::vector<float> ax(n), ay(n), az(n), bx(n), by(n), bz(n);
+    std::vector<float> ox(n), oy(n), oz(n), rx(n), ry(n), rz(n);
+    unsigned int seed = 5u;
+    float* inputs[6] = { ax.data(), ay.data(), az.data(), bx.data(), by.data(), bz.data() };
+    for (int k = 0; k < 6; ++k) {
+        for (int i = 0; i < n; ++i) {
+            seed = seed * 1664525u + 1013904223u;
+            inputs[k][i] = ((seed >> 8) & 0xFFFF) / 65535.0f * 20.0f - 10.0f;
+        }
+    }
+    ax[0] = ay[0] = az[0] = 0.0f; // unit() of a zero vector must stay zero
+
+    Mat4 world = Mat4::translation(1.5f, -2.0f, 3.0f) * Mat4::rotationY(37.0f) *
+        Mat4::rotationX(-20.0f) * Mat4::scale(2.0f, 0.5f, 1.0f);
+    Vector3f probe(0.5f, 1.0f, -0.25f);
+    bool allOk = true;
+
+    for (int kernel = 0; kernel < 4; ++kernel) {
+        const char* name = "";
+        double scalarTime = 0.0, simdTime = 0.0;
+        float maxErr = 0.0f;
+
+        for (int pass = 0; pass < 2; ++pass) {
+            float* dx = pass == 0 ? rx.data() : ox.data();
+            float* dy = pass == 0 ? ry.data() : oy.data();
+            float* dz = pass == 0 ? rz.data() : oz.data();
+
+            double t0 = nowSeconds();
+            for (int r = 0; r < reps; ++r) {
+                switch (kernel) {
+                case 0:
+                    name = "normalize";
+                    if (pass == 0) {
+                        for (int i = 0; i < n; ++i) {
+                            Vector3f v = Vector3f(ax[i], ay[i], az[i]).unit();
+                            dx[i] = v.x; dy[i] = v.y; dz[i] = v.z;
+                        }
+                    } else {
+                        memcpy(dx, ax.data(), n * sizeof(float));
+                        memcpy(dy, ay.data(), n * sizeof(float));
+                        memcpy(dz, az.data(), n * sizeof(float));
+                        normalizeBatch(dx, dy, dz, n);
+                    }
+                    break;
+                case 1:
+                    name = "cross";
+                    if (pass == 0) {
+                        for (int i = 0; i < n; ++i) {
+                            Vector3f v = Vector3f(ax[i], ay[i], az[i]).cross(Vector3f(bx[i], by[i], bz[i]));
+                            dx[i] = v.x; dy[i] = v.y; dz[i] = v.z;
+                        }
+                    } else {
+                        crossBatch(ax.data(), ay.data(), az.data(), bx.data(), by.data(), bz.data(),
+                            dx, dy, dz, n);
+                    }
+                    break;
+                case 2:
+                    name = "distanceSq";
+                    if (pass == 0) {
+                        for (int i = 0; i < n; ++i) dx[i] = distSquared(Vector3f(ax[i], ay[i], az[i]), probe);
+                    } else {
+                        distanceSqBatch(ax.data(), ay.data(), az.data(), probe, dx, n);
+                    }
+                    break;
+                default:
+                    name = "transform";
+                    if (pass == 0) {
+                        for (int i = 0; i < n; ++i) {
+                            Vector3f v = world.transformPoint(Vector3f(ax[i], ay[i], az[i]));
+                            dx[i] = v.x; dy[i] = v.y; dz[i] = v.z;
+                        }
+                    } else {
+                        transformPointsBatch(world, ax.data(), ay.data(), az.data(), dx, dy, dz, n);
+                    }
+                    break;
+                }
+            }
+            (pass == 0 ? scalarTime : simdTime) = nowSeconds() - t0;
+        }
 
-    glDisable(GL_LIGHTING);
-    glColor3f(1.0f, 1.0f, 1.0f);
-    drawBitmapText(msg, 0.4f, 0.5f);
-    glEnable(GL_LIGHTING);
+        int lanes = kernel == 2 ? 1 : 3;
+        for (int i = 0; i < n; ++i) {
+            maxErr = fmaxf(maxErr, fabsf(ox[i] - rx[i]));
+            if (lanes == 3) {
+                maxErr = fmaxf(maxErr, fabsf(oy[i] - ry[i]));
+                maxErr = fmaxf(maxErr, fabsf(oz[i] - rz[i]));
+            }
+        }
+        // Products of inputs up to 10 carry relative rounding only
+        bool ok = maxErr <= (kernel == 0 ? 1e-5f : 1e-3f);
+        allOk = allOk && ok;
+
+        double elems = (double)n * reps;
+        printf("math bench: %-10s scalar %6.2f ns/elem, simd(%d) %6.2f ns/elem, %.2fx, max err %.2g %s\n",
+            name, scalarTime * 1e9 / elems, SIMD_WIDTH, simdTime * 1e9 / elems,
+            scalarTime / simdTime, maxErr, ok ? "ok" : "FAILED");
+    }
 
-    glFlush();
+    // Matrix helpers against the scalar Vector3f path they replace
+    Mat4 view = Mat4::lookAt(Vector3f(1, 2, 3), Vector3f(0, 0, 0), Vector3f(0, 1, 0));
+    Vector3f ve = view.transformPoint(Vector3f(1, 2, 3));
+    Vector3f vc = view.transformPoint(Vector3f(0, 0, 0));
+    Vec4 wv = world * Vec4(probe.x, probe.y, probe.z, 1.0f);
+    Vector3f wp = world.transformPoint(probe);
+    Mat4 id = world * Mat4::identity();
+    float matErr = fabsf(ve.x) + fabsf(ve.y) + fabsf(ve.z);                 // eye maps to origin
+    matErr += fabsf(vc.x) + fabsf(vc.y) + fabsf(vc.z + sqrtf(14.0f));       // target on -z
+    matErr += fabsf(wv.x - wp.x) + fabsf(wv.y - wp.y) + fabsf(wv.z - wp.z) + fabsf(wv.w - 1.0f);
+    for (int i = 0; i < 16; ++i) matErr += fabsf(id.m[i] - world.m[i]);
+    bool matOk = matErr < 1e-4f;
+    printf("math bench: matrices max err %.2g %s\n", matErr, matOk ? "ok" : "FAILED");
+
+    return (allOk && matOk) ? 0 : 1;
 }
 
-// =========================
-// GLUT callbacks
-// =========================
-
-void Display() {
-    if (gameState == GAME_WIN) {
-        drawEndScreen("GAME WIN");
-        return;
+// --bench-jobs [objects]: the per-object loops at 1 .. N job threads, N
+// being --jobs or the hardware thread count. "update" is a sim tick
+// (animation + world matrices), "visibility" the render side (interpolated
+// matrices, culling/LOD, instance build). Headless, so every mesh gets a
+// stand-in bounding sphere instead of the captured model's.
+int runJobsBenchmark(int numObjects) {
+    if (numObjects < 1) numObjects = 100000;
+    int maxThreads = jobThreadsOption > 0 ? jobThreadsOption : (int)std::thread::hardware_concurrency();
+    if (maxThreads < 1) maxThreads = 1;
+    if (maxThreads > MAX_JOB_THREADS) maxThreads = MAX_JOB_THREADS;
+    const int reps = 50;
+
+    for (int id = 0; id < NUM_MESHES; ++id) {
+        meshBounds[id].centerY = 0.5f;
+        meshBounds[id].radius = 1.0f;
     }
-    if (gameState == GAME_LOSE) {
-        drawEndScreen("GAME LOSE");
-        return;
+    envObjectTarget = numObjects;
+
+    printf("jobs bench: %d objects, %d chunks, %u hardware threads\n", numObjects,
+        jobChunkCount(numObjects, ENV_JOB_GRAIN), std::thread::hardware_concurrency());
+
+    double baseUpdate = 0.0, baseVisibility = 0.0;
+    for (int threads = 1; threads <= maxThreads; ++threads) {
+        initJobSystem(threads);
+        resetGame();
+        setAllEnvAnimations(true);
+        stepSimulation(SIM_DT);   // warm up
+
+        double t0 = nowSeconds();
+        for (int r = 0; r < reps; ++r) stepSimulation(SIM_DT);
+        double update = (nowSeconds() - t0) / reps;
+
+        // Latest tick against the one before, half way between
+        savePrevSimState();
+        stepSimulation(SIM_DT);
+        publishSnapshot();
+        acquireSnapshot();
+        renderAlpha = 0.5f;
+        buildViewFrustum(scene->camera.viewMatrix(), scene->camera.eye);
+        prepareEnvRenderWorlds();
+        buildInstanceData();
+
+        t0 = nowSeconds();
+        for (int r = 0; r < reps; ++r) {
+            prepareEnvRenderWorlds();
+            buildInstanceData();
+        }
+        double visibility = (nowSeconds() - t0) / reps;
+
+        // Same instances in the same order whatever the thread count
+        double check = 0.0;
+        for (int i = 0; i < instancing.numInstances * 4; ++i) check += instancing.instanceData[i] * (i % 7 + 1);
+
+        if (threads == 1) {
+            baseUpdate = update;
+            baseVisibility = visibility;
+        }
+        printf("  %2d threads: update %7.3f ms (x%.2f), visibility %7.3f ms (x%.2f), %d visible (check %.3f)\n",
+            threads, update * 1000.0, baseUpdate / update, visibility * 1000.0, baseVisibility / visibility,
+            instancing.numInstances, check);
     }
 
-    setupCamera();
-    setupLights();
+    clearEnvObjects();
+    return 0;
+}
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// --bench-pacer: the window's frame pacer against a busy-wait loop at the
+// same target rate, with no rendering, to show CPU cost and jitter
+int runPacerBenchmark(int fps) {
+    if (fps <= 0) fps = 60;
+    const double seconds = 2.0;
+    double period = 1.0 / fps;
+
+    for (int spin = 0; spin < 2; ++spin) {
+        initScheduler(fps, false, false);
+        double start = nowSeconds(), cpuStart = processCpuSeconds();
+        double next = start;
+        double last = 0.0, sum = 0.0, sumSq = 0.0, worst = 0.0;
+        int frames = 0;
+
+        while (nowSeconds() - start < seconds) {
+            if (spin) {
+                while (nowSeconds() < next) {}
+                next += period;
+            }
+            else {
+                paceFrame();
+            }
 
-    drawFloor();
-    drawWalls();
+            double now = nowSeconds();
+            if (frames > 0) {
+                double interval = now - last;
+                sum += interval;
+                sumSq += interval * interval;
+                if (fabs(interval - period) > worst) worst = fabs(interval - period);
+            }
+            last = now;
+            ++frames;
+        }
 
-    // Environment objects
-    for (int i = 0; i < NUM_ENV_OBJECTS; ++i) {
-        drawEnvObject(envObjects[i]);
+        double wall = nowSeconds() - start;
+        double mean = sum / (frames - 1);
+        double var = sumSq / (frames - 1) - mean * mean;
+        printf("pacer bench: %-5s %d fps target: %.1f fps, interval %.3f ms, jitter %.3f ms, "
+            "worst %.3f ms off, cpu %.0f%%\n", spin ? "spin" : "sleep", fps, frames / wall,
+            mean * 1000.0, var > 0.0 ? sqrt(var) * 1000.0 : 0.0, worst * 1000.0,
+            (processCpuSeconds() - cpuStart) / wall * 100.0);
     }
+    return 0;
+}
 
-    // Oxygen core (goal)
-    drawOxygenCore();
+// Fixed GL state shared by the window and the offscreen context
+void initGLState() {
+    invalidateGLState();
+    glClearColor(WATER_COLOR[0], WATER_COLOR[1], WATER_COLOR[2], 0.0f);
 
-    // Diver (player)
-    drawDiver();
+    setCap(CAP_DEPTH_TEST, true);
+    setCap(CAP_LIGHTING, true);
+    glEnable(GL_LIGHT0);
+    glEnable(GL_NORMALIZE);
+    glEnable(GL_COLOR_MATERIAL);
+    glShadeModel(GL_SMOOTH);
+}
 
-    // HUD (oxygen timer)
-    drawHUD();
+// Value at fraction p (0..1) of an already sorted sample array
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
 
-    glFlush();
+void printTimings(const char* label, std::vector<double>& samples) {
+    std::sort(samples.begin(), samples.end());
+    printf("  %-6s ms  p50 %7.3f  p95 %7.3f  p99 %7.3f  max %7.3f\n", label,
+        percentile(samples, 0.50) * 1000.0, percentile(samples, 0.95) * 1000.0,
+        percentile(samples, 0.99) * 1000.0, percentile(samples, 1.0) * 1000.0);
 }
 
-// Camera controls from original lab solution
-void CameraKeyboard(unsigned char key) {
-    float d = 0.1f;
+// Binary PPM of the current read buffer (bottom-up rows flipped)
+bool writePPM(const char* path, int width, int height, std::vector<unsigned char>& pixels) {
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
 
-    switch (key) {
-    case 'w':
-        camera.moveY(d);
-        break;
-    case 's':
-        camera.moveY(-d);
-        break;
-    case 'a':
-        camera.moveX(d);
-        break;
-    case 'd':
-        camera.moveX(-d);
-        break;
-    case 'q':
-        camera.moveZ(d);
-        break;
-    case 'e':
-        camera.moveZ(-d);
-        break;
-    default:
-        break;
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    for (int y = height - 1; y >= 0; --y) {
+        fwrite(&pixels[(size_t)y * width * 3], 1, (size_t)width * 3, f);
     }
+    fclose(f);
+    return true;
 }
 
-void Keyboard(unsigned char key, int x, int y) {
-    // Escape
-    if (key == GLUT_KEY_ESCAPE) {
-        exit(EXIT_SUCCESS);
+// Camera orbit used by the offscreen benchmark: one full turn around the
+// base with a slow height change, so every run sees the same views
+void setOffscreenCamera(int frame, int numFrames) {
+    float a = 2.0f * PI * frame / numFrames;
+    offscreenCamera.eye = Vector3f(9.0f * sinf(a), 6.0f + 2.0f * sinf(2.0f * a), 9.0f * cosf(a));
+    offscreenCamera.center = Vector3f(0.0f, 0.5f, 0.0f);
+    offscreenCamera.up = Vector3f(0.0f, 1.0f, 0.0f);
+}
+
+#if OFFSCREEN_EGL
+struct OffscreenContext {
+    EGLDisplay display;
+    EGLSurface surface;
+    EGLContext context;
+};
+
+// Desktop GL context on an EGL pbuffer; prefers the surfaceless Mesa
+// platform so no X server is needed (llvmpipe when there is no GPU)
+bool createOffscreenContext(OffscreenContext& ctx, int width, int height) {
+    ctx.display = EGL_NO_DISPLAY;
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (ctx.display == EGL_NO_DISPLAY) {
+        ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
     }
 
-    // Camera movement keys
-    if (key == 'w' || key == 's' || key == 'a' || key == 'd' || key == 'q' || key == 'e') {
-        CameraKeyboard(key);
-        glutPostRedisplay();
-        return;
+    EGLint major, minor;
+    if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, &major, &minor)) {
+        printf("offscreen: cannot initialize EGL (0x%x)\n", eglGetError());
+        return false;
     }
 
-    // Game controls only when playing
-    if (gameState == GAME_PLAYING) {
-        float step = 0.2f;
-
-        // Diver movement (movement keys also define facing)
-        if (key == 'i') { // swim forward (+z)
-            moveDiver(0.0f, 0.0f, step);
-        }
-        else if (key == 'k') { // swim backward (-z)
-            moveDiver(0.0f, 0.0f, -step);
-        }
-        else if (key == 'j') { // left (-x)
-            moveDiver(-step, 0.0f, 0.0f);
-        }
-        else if (key == 'l') { // right (+x)
-            moveDiver(step, 0.0f, 0.0f);
-        }
-        else if (key == 'u') { // up (+y)
-            moveDiver(0.0f, step, 0.0f);
-        }
-        else if (key == 'o') { // down (-y)
-            moveDiver(0.0f, -step, 0.0f);
-        }
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(ctx.display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        printf("offscreen: no pbuffer config with desktop GL\n");
+        return false;
+    }
 
-        // Toggle environment animations (z, x, c, v, b)
-        if (key == 'z') {
-            envObjects[0].animRunning = !envObjects[0].animRunning;
-        }
-        else if (key == 'x') {
-            envObjects[1].animRunning = !envObjects[1].animRunning;
-        }
-        else if (key == 'c') {
-            envObjects[2].animRunning = !envObjects[2].animRunning;
-        }
-        else if (key == 'v') {
-            envObjects[3].animRunning = !envObjects[3].animRunning;
-        }
-        else if (key == 'b') {
-            envObjects[4].animRunning = !envObjects[4].animRunning;
-        }
+    const EGLint surfaceAttribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    ctx.surface = eglCreatePbufferSurface(ctx.display, config, surfaceAttribs);
+    eglBindAPI(EGL_OPENGL_API);
+    ctx.context = eglCreateContext(ctx.display, config, EGL_NO_CONTEXT, NULL);
 
-        // Camera preset views (security cams)
-        if (key == '1') { // front view
-            camera.eye = Vector3f(0.0f, 3.0f, 10.0f);
-            camera.center = Vector3f(0.0f, 0.5f, 0.0f);
-            camera.up = Vector3f(0.0f, 1.0f, 0.0f);
-        }
-        else if (key == '2') { // side view
-            camera.eye = Vector3f(10.0f, 3.0f, 0.0f);
-            camera.center = Vector3f(0.0f, 0.5f, 0.0f);
-            camera.up = Vector3f(0.0f, 1.0f, 0.0f);
-        }
-        else if (key == '3') { // top sonar view
-            camera.eye = Vector3f(0.0f, 15.0f, 0.01f);
-            camera.center = Vector3f(0.0f, 0.0f, 0.0f);
-            camera.up = Vector3f(0.0f, 0.0f, -1.0f);
-        }
-    }
+    if (ctx.surface == EGL_NO_SURFACE || ctx.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context)) {
+        printf("offscreen: cannot create pbuffer context (0x%x)\n", eglGetError());
+        return false;
+    }
+    return true;
+}
 
-    glutPostRedisplay();
+void destroyOffscreenContext(OffscreenContext& ctx) {
+    eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(ctx.display, ctx.context);
+    eglDestroySurface(ctx.display, ctx.surface);
+    eglTerminate(ctx.display);
+}
+#endif
+
+// --offscreen [frames]: render the real frame pipeline into a pbuffer along
+// a fixed camera path and report per-frame CPU (submission) and GL (time
+// until glFinish returns) percentiles. --dump <dir> writes every frame as PPM.
+// Exits non-zero if any measured frame made a heap allocation or created
+// a GL object, so scripts can hold the render loop to zero.
+// --paused: leave env objects at rest, which exercises the static batch
+// --threaded: tick on the sim thread in real time instead of 1/60 s per
+// frame (frames then no longer match between runs)
+// --replay <file>: play a recorded session instead of the unattended
+// rounds, by default for as many measured frames as it lasts
+bool offscreenAnimate = true;
+
+// Runs on whichever thread ticks the simulation
+void restartOffscreenRound() {
+    resetGame();
+    setAllEnvAnimations(offscreenAnimate);
 }
 
-void Special(int key, int x, int y) {
-    float a = 2.0f;
+int runOffscreenBenchmark(int numFrames, const char* dumpDir, bool threaded) {
+#if OFFSCREEN_EGL
+    const int width = VIEWPORT_W, height = VIEWPORT_H, warmupFrames = 10;
+    if (numFrames < 1) numFrames = 1;
+
+    OffscreenContext ctx;
+    if (!createOffscreenContext(ctx, width, height)) return 1;
+    offscreenActive = true;
+
+    glViewport(0, 0, width, height);
+    initGLState();
+    initResources();
+    buildMeshCache();
+    initInstancedRenderer();
+    initSceneShaders();
+    initParticles();
+    initStaticBatch();
+    initProfiler();
+    initOverdrawQueries();
+    bool replaying = replay.mode == REPLAY_PLAYBACK;
+    if (replaying) {
+        restartReplay();
+    }
+    else {
+        restartOffscreenRound();
+        roundOverHook = restartOffscreenRound;
+    }
 
-    switch (key) {
-    case GLUT_KEY_UP:
-        camera.rotateX(a);
-        break;
-    case GLUT_KEY_DOWN:
-        camera.rotateX(-a);
-        break;
-    case GLUT_KEY_LEFT:
-        camera.rotateY(a);
-        break;
-    case GLUT_KEY_RIGHT:
-        camera.rotateY(-a);
-        break;
+    printf("offscreen: %d frames %dx%d on %s\n", numFrames, width, height,
+        (const char*)glGetString(GL_RENDERER));
+    printf("  %d env objects (%s), mesh cache %s, instancing %s, static batch %s, shaders %s, sim %s\n",
+        envStore.count, offscreenAnimate ? "animating" : "paused", useMeshCache ? "on" : "off",
+        (useInstancing && instancing.ready) ? "on" : "off", staticBatchActive() ? "on" : "off",
+        sceneShadersActive() ? "on" : "off", threaded ? "threaded" : "inline");
+
+    // Everything the loop needs is allocated up front
+    std::vector<double> cpuTimes, glTimes, frameTimes;
+    cpuTimes.reserve(numFrames);
+    glTimes.reserve(numFrames);
+    frameTimes.reserve(numFrames);
+    std::vector<unsigned char> pixels(dumpDir ? (size_t)width * height * 3 : 1);
+    long maxFrameAllocations = 0, maxFrameGLObjects = 0;
+    double sumCulled = 0.0, sumDrawn = 0.0, sumTriangles = 0.0;
+    double sumStateChanges = 0.0, sumStateSaved = 0.0, sumOverdraw = 0.0;
+    double sumLights = 0.0, sumLightRefs = 0.0, sumParticles = 0.0;
+
+    publishSnapshot();
+    if (threaded) startSimThread();
+
+    for (int frame = -warmupFrames; frame < numFrames; ++frame) {
+        // Warm-up plays the replay too, then it starts over with the first
+        // measured frame (threaded, it just keeps going)
+        if (replaying && frame == 0 && !threaded) restartReplay();
+        if (!threaded) advanceSimulation(1.0f / 60.0f);
+        setOffscreenCamera(frame < 0 ? 0 : frame, numFrames);
+
+        beginFrameAllocations();
+        double t0 = nowSeconds();
+        renderFrame();
+        double t1 = nowSeconds();
+        glFinish();
+        double t2 = nowSeconds();
+        endFrameAllocations();
+        endProfileFrame();
+
+        if (frame < 0) continue;
+
+        cpuTimes.push_back(t1 - t0);
+        glTimes.push_back(t2 - t1);
+        frameTimes.push_back(t2 - t0);
+        if (lastFrameAllocations > maxFrameAllocations) maxFrameAllocations = lastFrameAllocations;
+        if (lastFrameGLObjects > maxFrameGLObjects) maxFrameGLObjects = lastFrameGLObjects;
+        sumCulled += frameStats.objectsCulled;
+        sumDrawn += frameStats.objectsDrawn;
+        sumTriangles += frameStats.triangles;
+        sumStateChanges += frameStats.stateChanges;
+        sumStateSaved += frameStats.stateChangesSaved;
+        sumOverdraw += frameStats.overdraw;
+        sumLights += frameStats.lights;
+        sumLightRefs += frameStats.lightRefs;
+        sumParticles += frameStats.particles;
+
+        if (dumpDir) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/frame_%05d.ppm", dumpDir, frame);
+            if (!writePPM(path, width, height, pixels)) {
+                printf("offscreen: cannot write %s\n", path);
+                dumpDir = NULL;
+            }
+        }
     }
 
-    glutPostRedisplay();
+    printTimings("cpu", cpuTimes);
+    printTimings("gl", glTimes);
+    printTimings("frame", frameTimes);
+    printf("  per frame: %.1f objects drawn, %.1f culled, %.0f triangles\n",
+        sumDrawn / numFrames, sumCulled / numFrames, sumTriangles / numFrames);
+    printf("  GL state calls per frame: %.1f issued, %.1f skipped as redundant%s\n",
+        sumStateChanges / numFrames, sumStateSaved / numFrames, useStateCache ? "" : " (cache off)");
+    if (sumLights > 0.0) {
+        printf("  clustered lights per frame: %.1f, %.1f cluster entries\n", sumLights / numFrames,
+            sumLightRefs / numFrames);
+    }
+    if (sumParticles > 0.0) {
+        printf("  particles per frame: %.1f live, %d dropped with the pool full\n", sumParticles / numFrames,
+            particles.dropped);
+    }
+    if (overdraw.ready) {
+        printf("  opaque fragments per pixel: %.2f (%s)\n", sumOverdraw / numFrames,
+            useRenderSort ? "front to back" : "unsorted");
+    }
+    printf("  heap allocations per frame (max): %ld, GL objects created: %ld\n", maxFrameAllocations,
+        maxFrameGLObjects);
+    if (profiler.enabled) printProfile();
+
+    stopSimThread();
+    roundOverHook = NULL;
+    if (replaying) {
+        if (!replay.ended && simClock.totalTicks - replay.baseTick == (long)replay.header.endTick) playReplayTick();
+        reportReplay();
+        tickInputHook = NULL;
+    }
+    releaseResources();
+    destroyOffscreenContext(ctx);
+    offscreenActive = false;
+
+    bool allocFree = maxFrameAllocations == 0 && maxFrameGLObjects == 0;
+    if (!allocFree) printf("offscreen: steady-state frames allocated, FAILED\n");
+    return allocFree ? 0 : 1;
+#else
+    printf("offscreen: built without EGL support (OFFSCREEN_EGL=0)\n");
+    return 1;
+#endif
 }
 
-// Idle update: oxygen, animations
-void Update() {
-    int currentTimeMs = glutGet(GLUT_ELAPSED_TIME);
-    float dt = (currentTimeMs - lastTimeMs) / 1000.0f;
-    if (dt < 0.0f) dt = 0.0f;
-    lastTimeMs = currentTimeMs;
-
-    if (gameState == GAME_PLAYING) {
-        // Oxygen timer
-        oxygenTime -= dt;
-        if (oxygenTime <= 0.0f && !oxygenCore.collected) {
-            oxygenTime = 0.0f;
-            gameState = GAME_LOSE;
-        }
-
-        // Oxygen core animation
-        oxygenCore.spinAngle += 60.0f * dt;
-        if (oxygenCore.spinAngle > 360.0f) oxygenCore.spinAngle -= 360.0f;
-
-        // Wall light phase
-        wallColorPhase += 1.5f * dt;
-
-        // Animate environment objects
-        for (int i = 0; i < NUM_ENV_OBJECTS; ++i) {
-            if (envObjects[i].animRunning) {
-                envObjects[i].animParam += 60.0f * dt;
-            }
+// --bench-lights [objects]: frame time against the number of clustered
+// lights, stepping --lights up to everything the base has. "cluster" is
+// the CPU cost of gathering, binning and uploading them, "gl" the time
+// until glFinish returns and "frame" both ends together. Every step
+// renders the same frames.
+int runLightBenchmark(int numObjects) {
+#if OFFSCREEN_EGL
+    const int width = VIEWPORT_W, height = VIEWPORT_H;
+    const int warmupFrames = 3, numFrames = 8;
+    const int limits[] = { 0, 4, 16, 64, 256, MAX_SCENE_LIGHTS };
+    if (numObjects < 1) numObjects = 500;
+
+    OffscreenContext ctx;
+    if (!createOffscreenContext(ctx, width, height)) return 1;
+    offscreenActive = true;
+
+    glViewport(0, 0, width, height);
+    initGLState();
+    initResources();
+    buildMeshCache();
+    initInstancedRenderer();
+    initSceneShaders();
+    initParticles();
+    initStaticBatch();
+    initProfiler();
+    initOverdrawQueries();
+    if (!sceneLightsActive()) {
+        printf("lights bench: needs the scene shaders and texture buffers (GL 3.2)\n");
+        releaseResources();
+        destroyOffscreenContext(ctx);
+        offscreenActive = false;
+        return 1;
+    }
+
+    envObjectTarget = numObjects;
+    printf("lights bench: %d env objects, %dx%dx%d clusters, %d frames per step on %s\n", numObjects,
+        CLUSTER_X, CLUSTER_Y, CLUSTER_Z, numFrames, (const char*)glGetString(GL_RENDERER));
+
+    double baseGl = 0.0;
+    for (int step = 0; step < (int)(sizeof(limits) / sizeof(limits[0])); ++step) {
+        sceneLightLimit = limits[step];
+        restartOffscreenRound();
+        publishSnapshot();
+
+        double sumCluster = 0.0, sumFrame = 0.0, sumGl = 0.0;
+        double sumLights = 0.0, sumRefs = 0.0, sumDropped = 0.0;
+        for (int frame = -warmupFrames; frame < numFrames; ++frame) {
+            advanceSimulation(1.0f / 60.0f);
+            setOffscreenCamera(frame < 0 ? 0 : frame, numFrames);
+
+            double t0 = nowSeconds();
+            renderFrame();
+            double t1 = nowSeconds();
+            glFinish();
+            double t2 = nowSeconds();
+
+            // Once more on its own: same view, same lights
+            buildLightClusters();
+            double t3 = nowSeconds();
+            glFinish();
+
+            if (frame < 0) continue;
+            sumFrame += t2 - t0;
+            sumGl += t2 - t1;
+            sumCluster += t3 - t2;
+            sumLights += frameStats.lights;
+            sumRefs += frameStats.lightRefs;
+            sumDropped += clusters.dropped;
         }
+
+        double gl = sumGl / numFrames;
+        if (step == 0) baseGl = gl;
+        printf("  %4d lights max: %6.1f lights, %5.2f per cluster, %4.0f dropped, cluster %6.3f ms, "
+            "gl %8.3f ms (x%.2f), frame %8.3f ms\n", limits[step], sumLights / numFrames,
+            sumRefs / numFrames / NUM_CLUSTERS, sumDropped / numFrames, sumCluster / numFrames * 1000.0,
+            gl * 1000.0, gl / baseGl, sumFrame / numFrames * 1000.0);
     }
 
-    glutPostRedisplay();
+    sceneLightLimit = MAX_SCENE_LIGHTS;
+    releaseResources();
+    destroyOffscreenContext(ctx);
+    offscreenActive = false;
+    return 0;
+#else
+    (void)numObjects;
+    printf("lights bench: built without EGL support (OFFSCREEN_EGL=0)\n");
+    return 1;
+#endif
 }
 
-// =========================
-// Initialization
-// =========================
-
-void initGame() {
-    // Diver start position
-    diver.pos = Vector3f(0.0f, GROUND_Y, 0.0f);
-    diver.radius = 0.4f;
-    diver.rotY = 0.0f;
-    diver.rotX = 0.0f;
-    diver.onGround = true;
+// --bench-particles [live]: the particle update (SIMD integration,
+// recycling and sprite writing) at a steady population, spawning each
+// frame about as many as expire. Headless, at a fixed 1/60 s step. The
+// pool never grows, so the per-frame cost is bounded by its capacity.
+int runParticleBenchmark(int target) {
+    if (target < 1) target = 100000;
+    if (target > MAX_PARTICLES) target = MAX_PARTICLES;
+    const int warmupFrames = 60, numFrames = 600;
+    const float dt = 1.0f / 60.0f;
+    float meanLife = 0.0f;
+    for (int k = 0; k < NUM_PARTICLE_KINDS; ++k) meanLife += particleKinds[k].life / NUM_PARTICLE_KINDS;
+    float perFrame = target * dt / meanLife;
+
+    printf("particles bench: %d live of %d, SIMD width %d, %d job threads\n", target, MAX_PARTICLES,
+        SIMD_WIDTH, jobs.numThreads);
+
+    // Lives staggered so they do not all expire at once
+    initParticles();
+    for (int i = 0; i < target; ++i) {
+        float x = (particleRandom() * 2.0f - 1.0f) * worldHalfSize;
+        float z = (particleRandom() * 2.0f - 1.0f) * worldHalfSize;
+        int slot = spawnParticle(i % NUM_PARTICLE_KINDS, x, particleRandom() * maxHeight, z,
+            particleRandom() - 0.5f, particleRandom() - 0.5f, particleRandom() - 0.5f);
+        particles.life[slot] *= particleRandom();
+    }
 
-    // Oxygen core position
-    oxygenCore.pos = Vector3f(2.0f, 0.6f, 2.0f);
-    oxygenCore.radius = 0.5f;
-    oxygenCore.spinAngle = 0.0f;
-    oxygenCore.collected = false;
+    std::vector<double> times;
+    times.reserve(numFrames);
+    double sumLive = 0.0, spawnDebt = 0.0;
+    long allocations = 0;
+    for (int frame = -warmupFrames; frame < numFrames; ++frame) {
+        long allocStart = totalAllocations;
+        double t0 = nowSeconds();
+        for (spawnDebt += perFrame; spawnDebt >= 1.0; spawnDebt -= 1.0) {
+            float x = (particleRandom() * 2.0f - 1.0f) * worldHalfSize;
+            float z = (particleRandom() * 2.0f - 1.0f) * worldHalfSize;
+            spawnParticle(frame & 1, x, GROUND_Y, z, particleRandom() - 0.5f, 1.0f, particleRandom() - 0.5f);
+        }
+        stepParticles(dt);
+        double t1 = nowSeconds();
 
-    // Environment objects placement & types
-    // 0: Floodlight tower (major)
-    envObjects[0].pos = Vector3f(-3.0f, 0.0f, -2.0f);
-    envObjects[0].type = 0;
-    envObjects[0].animParam = 0.0f;
-    envObjects[0].animRunning = false;
-
-    // 1: Sonar array (major)
-    envObjects[1].pos = Vector3f(3.0f, 0.0f, -3.0f);
-    envObjects[1].type = 1;
-    envObjects[1].animParam = 0.0f;
-    envObjects[1].animRunning = false;
-
-    // 2: Supply crates (regular)
-    envObjects[2].pos = Vector3f(-2.0f, 0.0f, 3.0f);
-    envObjects[2].type = 2;
-    envObjects[2].animParam = 0.0f;
-    envObjects[2].animRunning = false;
-
-    // 3: Repair drone (regular)
-    envObjects[3].pos = Vector3f(2.5f, 0.2f, 0.0f);
-    envObjects[3].type = 3;
-    envObjects[3].animParam = 0.0f;
-    envObjects[3].animRunning = false;
-
-    // 4: Oxygen tanks (regular)
-    envObjects[4].pos = Vector3f(0.0f, 0.0f, -3.0f);
-    envObjects[4].type = 4;
-    envObjects[4].animParam = 0.0f;
-    envObjects[4].animRunning = false;
+        if (frame < 0) continue;
+        times.push_back(t1 - t0);
+        sumLive += particles.live;
+        allocations += totalAllocations - allocStart;
+    }
 
-    // Camera default (like external camera looking into base)
-    camera.eye = Vector3f(0.0f, 4.0f, 12.0f);
-    camera.center = Vector3f(0.0f, 0.5f, 0.0f);
-    camera.up = Vector3f(0.0f, 1.0f, 0.0f);
+    printTimings("update", times);
+    printf("  %.0f live on average, high-water %d, %d dropped, %.2f ns per live particle, %ld heap allocations\n",
+        sumLive / numFrames, particles.highWater, particles.dropped,
+        percentile(times, 0.5) * 1e9 / (sumLive / numFrames), allocations);
 
-    gameState = GAME_PLAYING;
-    oxygenTime = 60.0f;
-    lastTimeMs = glutGet(GLUT_ELAPSED_TIME);
+    initParticles();
+    return 0;
 }
 
 int main(int argc, char** argv) {
+    // Options shared by the window and the headless modes
+    // --immediate: start with the mesh cache off
+    const char* dumpDir = NULL;
+    int targetFps = 60;
+    bool vsync = true, dirtyOnly = false;
+    int threaded = -1;   // default: sim thread in the window, inline offscreen
+    const char* tracePath = NULL;
+    bool profile = false;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    const char* levelPath = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--immediate") == 0) useMeshCache = false;
+        else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) dumpDir = argv[++i];
+        else if (strcmp(argv[i], "--objects") == 0 && i + 1 < argc) envObjectTarget = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-instancing") == 0) useInstancing = false;
+        else if (strcmp(argv[i], "--no-cull") == 0) useCulling = false;
+        else if (strcmp(argv[i], "--no-batch") == 0) useStaticBatch = false;
+        else if (strcmp(argv[i], "--no-state-cache") == 0) useStateCache = false;
+        else if (strcmp(argv[i], "--no-sort") == 0) useRenderSort = false;
+        else if (strcmp(argv[i], "--fixed-function") == 0) useSceneShaders = false;
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc) sceneLightLimit = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--paused") == 0) offscreenAnimate = false;
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) targetFps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-vsync") == 0) vsync = false;
+        else if (strcmp(argv[i], "--dirty-only") == 0) dirtyOnly = true;
+        else if (strcmp(argv[i], "--threaded") == 0) threaded = 1;
+        else if (strcmp(argv[i], "--single-thread") == 0) threaded = 0;
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobThreadsOption = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--profile") == 0) profile = true;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) tracePath = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) recordPath = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replayPath = argv[++i];
+        else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) levelPath = argv[++i];
+    }
+
+    initJobSystem(jobThreadsOption);
+
+    // --profile: overlay on from the start (table at the end offscreen)
+    // --trace <file>: Chrome trace JSON of every frame, written at exit
+    if (tracePath) {
+        startTrace(tracePath);
+        atexit(writeTraceAtExit);
+    }
+    if (profile) {
+        profiler.overlay = true;
+        setProfilerEnabled(true);
+    }
+
+    // --level <file>: play a compiled (or text) level instead of the built-in base
+    // --compile-level <text> <binary>: check a text level and write its binary form
+    initLevel();
+    for (int i = 1; i + 2 < argc; ++i) {
+        if (strcmp(argv[i], "--compile-level") != 0) continue;
+
+        LevelSource src;
+        if (!parseLevelText(argv[i + 1], src) || !writeLevel(argv[i + 2], src)) return 1;
+        printf("Level %s: %u objects, world +-%.1f, compiled to %s\n", argv[i + 1], src.header.numObjects,
+            src.header.worldHalfSize, argv[i + 2]);
+        return 0;
+    }
+    if (levelPath && !loadLevel(levelPath)) return 1;
+
+    // --record <file>: log the windowed session's input for --replay
+    // --replay <file>: headless playback, or rendered with --offscreen
+    if (replayPath && !loadReplay(replayPath)) return 1;
+
+    // Headless modes run before glutInit so they need no display
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bench-sim") == 0) {
+            return runSimBenchmark(i + 1 < argc ? atof(argv[i + 1]) : 10.0);
+        }
+        if (strcmp(argv[i], "--bench-env") == 0) {
+            return runEnvBenchmark();
+        }
+        if (strcmp(argv[i], "--bench-level") == 0) {
+            return runLevelBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000);
+        }
+        if (strcmp(argv[i], "--bench-collision") == 0) {
+            return runCollisionBenchmark();
+        }
+        if (strcmp(argv[i], "--bench-math") == 0) {
+            return runMathBenchmark();
+        }
+        if (strcmp(argv[i], "--bench-jobs") == 0) {
+            return runJobsBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000);
+        }
+        if (strcmp(argv[i], "--bench-pacer") == 0) {
+            return runPacerBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : targetFps);
+        }
+        if (strcmp(argv[i], "--bench-particles") == 0) {
+            return runParticleBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000);
+        }
+        if (strcmp(argv[i], "--bench-lights") == 0) {
+            return runLightBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 500);
+        }
+        if (strcmp(argv[i], "--offscreen") == 0) {
+            int frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            if (frames < 1) frames = replayPath ? replayFrames() : 300;
+            return runOffscreenBenchmark(frames, dumpDir, threaded == 1);
+        }
+    }
+    if (replayPath) return runReplay();
+
     glutInit(&argc, argv);
-    glutInitWindowSize(640, 480);
+    glutInitWindowSize(VIEWPORT_W, VIEWPORT_H);
     glutInitWindowPosition(50, 50);
-    glutInitDisplayMode(GLUT_SINGLE | GLUT_RGB | GLUT_DEPTH);
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 
     glutCreateWindow("Underwater Research Base - Oxygen Run");
 
     glutDisplayFunc(Display);
+    glutReshapeFunc(Reshape);
     glutKeyboardFunc(Keyboard);
+    glutKeyboardUpFunc(KeyboardUp);
     glutSpecialFunc(Special);
+    glutSpecialUpFunc(SpecialUp);
+    glutIgnoreKeyRepeat(1);   // held keys are tracked, repeats add nothing
     glutIdleFunc(Update);
 
-    glClearColor(0.0f, 0.0f, 0.15f, 0.0f); // deep water blue
+    glutActive = true;
+    initGLState();
 
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-    glEnable(GL_NORMALIZE);
-    glEnable(GL_COLOR_MATERIAL);
-    glShadeModel(GL_SMOOTH);
+    initResources();
+    atexit(releaseResources);
 
+    buildMeshCache();
+    initInstancedRenderer();
+    initSceneShaders();
+    initParticles();
+    initStaticBatch();
+    initProfiler();
+    initOverdrawQueries();
+    buildGlyphAtlas();
     initGame();
+    if (recordPath) startRecording(recordPath);
+    if (threaded != 0) startSimThread();
+
+    initScheduler(targetFps, vsync, dirtyOnly);
+    applySwapInterval();
 
     glutMainLoop();
     return 0;